@@ -0,0 +1,143 @@
+/**
+ * Time lookups of a file backed log: indexedLogSearch through the flat
+ * circ_log_index_t array against the compact groups, with index RAM and
+ * lookup time for each
+ *
+ * Build from the repository root, Linux
+ *   gcc -O2 -I. bench/compactIndexBench.c src/circularflash.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/circularflash.h"
+
+#define BENCH_LENGTH 0x1000000
+#define BENCH_GRANULARITY 0x100
+#define BENCH_ENTRIES CIRC_INDEX_ENTRIES(BENCH_LENGTH, BENCH_GRANULARITY)
+#define BENCH_LINES 500000
+#define BENCH_LOOKUPS 20000
+#define BENCH_START 1668175200
+
+int mutexCount = 0;
+
+void assertHandler(char *file, int line) {
+  printf("CIRCULAR_LOG_ASSERT(%s:%i\r\n", file, line);
+  exit(1);
+}
+
+static int fd;
+
+static uint32_t fileRead(uint32_t addr, uint8_t *buff, uint32_t len) {
+  return pread(fd, buff, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileWrite(uint32_t addr, uint8_t *buff, uint32_t len) {
+  static uint8_t page[0x1000];
+  uint32_t i;
+  if (len > sizeof(page) || fileRead(addr, page, len) != len) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    page[i] &= buff[i];
+  }
+  return pwrite(fd, page, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileErase(uint32_t addr, uint32_t len) {
+  static uint8_t erased[0x1000];
+  uint32_t done;
+  memset(erased, FLASH_ERASED, sizeof(erased));
+  for (done = 0; done < len; done += sizeof(erased)) {
+    if (pwrite(fd, erased, sizeof(erased), addr + done) != sizeof(erased)) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+static uint32_t parseTime(const char *line) {
+  return strtoul(line, NULL, 10);
+}
+
+static double msSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Looks up every stamp in the same order, return : bytes found */
+static uint32_t lookups(circ_log_t *log, double *ms) {
+  uint8_t out[LINE_ESTIMATE_FACTOR * 2];
+  struct timespec start;
+  uint32_t i, found = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    found += indexedLogSearch(
+        log, out, sizeof(out),
+        BENCH_START + (uint32_t)(((uint64_t)i * 7919) % BENCH_LINES) * 60);
+  }
+  *ms = msSince(&start);
+  return found;
+}
+
+int main(void) {
+  static uint8_t wBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t flatIndex[BENCH_ENTRIES];
+  static circ_log_cindex_t compactIndex[CIRC_CINDEX_GROUPS(BENCH_ENTRIES)];
+  char name[] = "/tmp/circBenchXXXXXX";
+  char line[128];
+  circ_log_t flat = {.name = "FLAT",
+                     .read = fileRead,
+                     .write = fileWrite,
+                     .erase = fileErase,
+                     .baseAddress = 0,
+                     .logsLength = BENCH_LENGTH,
+                     .wBuff = wBuff,
+                     .wBuffLen = sizeof(wBuff),
+                     .index = flatIndex,
+                     .parseTime = parseTime,
+                     .indexGranularity = BENCH_GRANULARITY};
+  circ_log_t compact = flat;
+  double flatMs, compactMs;
+  uint32_t i, flatFound, compactFound;
+  int32_t len;
+  compact.name = "COMPACT";
+  compact.index = NULL;
+  compact.compactIndex = compactIndex;
+  fd = mkstemp(name);
+  if (fd < 0) {
+    return 1;
+  }
+  unlink(name);
+  if (fileErase(0, BENCH_LENGTH) != BENCH_LENGTH ||
+      circularLogInit(&flat) != CIRC_LOG_ERR_NONE) {
+    return 1;
+  }
+  for (i = 0; i < BENCH_LINES; i++) {
+    len = snprintf(line, sizeof(line), "%010u Status line %u temp %u\r\n",
+                   BENCH_START + i * 60, i, i % 80);
+    circularWriteLog(&flat, (uint8_t *)line, len);
+  }
+  /* Both built from the same flash at init */
+  if (circularLogInit(&flat) != CIRC_LOG_ERR_NONE ||
+      circularLogInit(&compact) != CIRC_LOG_ERR_NONE) {
+    return 1;
+  }
+
+  flatFound = lookups(&flat, &flatMs);
+  compactFound = lookups(&compact, &compactMs);
+  printf("flat index     %8u bytes  %8.1f ms  %u bytes found\r\n",
+         (uint32_t)sizeof(flatIndex), flatMs, flatFound);
+  printf("compact index  %8u bytes  %8.1f ms  %u bytes found\r\n",
+         (uint32_t)sizeof(compactIndex), compactMs, compactFound);
+  printf("%u lookups, RAM x%.2f, time x%.2f\r\n", BENCH_LOOKUPS,
+         (double)sizeof(flatIndex) / sizeof(compactIndex), compactMs / flatMs);
+  close(fd);
+  return compactFound == flatFound ? 0 : 1;
+}
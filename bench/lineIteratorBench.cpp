@@ -0,0 +1,103 @@
+/**
+ * Filtered scan: line iterator vs copy based circularFileRead
+ *
+ * Build from the repository root
+ *   gcc -O2 -I. -c src/circularflash.c -o circularflash.o
+ *   g++ -std=c++17 -O2 -I. bench/lineIteratorBench.cpp circularflash.o
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "src/circularflash.hpp"
+
+int mutexCount = 0;
+
+void assertHandler(char *file, int line) {
+  printf("CIRCULAR_LOG_ASSERT(%s:%i\r\n", file, line);
+  exit(1);
+}
+
+namespace {
+
+constexpr uint32_t kBase = 0x200000;
+constexpr uint32_t kLength = 0x1E0000;
+std::vector<uint8_t> flash(kLength, FLASH_ERASED);
+
+struct RamFlash {
+  static uint32_t read(uint32_t addr, uint8_t *buff, uint32_t len) {
+    memcpy(buff, &flash[addr - kBase], len);
+    return len;
+  }
+  static uint32_t write(uint32_t addr, uint8_t *buff, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+      flash[addr - kBase + i] &= buff[i];
+    }
+    return len;
+  }
+  static uint32_t erase(uint32_t addr, uint32_t len) {
+    memset(&flash[addr - kBase], FLASH_ERASED, len);
+    return len;
+  }
+};
+
+using Log = circular::CircularLog<circular::Geometry<0x1000, 0x100>, RamFlash>;
+
+double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+} // namespace
+
+int main() {
+  Log log("BENCH", kBase, kLength);
+  char line[128];
+  const int rounds = 20;
+  if (log.init() != CIRC_LOG_ERR_NONE) {
+    return 1;
+  }
+  for (int i = 0; i < 60000; i++) {
+    int len = (i % 97 == 0)
+                  ? snprintf(line, sizeof(line), "ALARM motor %i stalled\r\n", i)
+                  : snprintf(line, sizeof(line),
+                             "Status line %i temp %i rpm %i\r\n", i, i % 80,
+                             i % 3000);
+    log.write(std::string_view(line, len));
+  }
+
+  /* Copy based, lines land in the caller buffer */
+  static uint8_t out[0x10000];
+  uint32_t copyHits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    auto cur = log.open(CIRC_FLAGS_OLDEST);
+    int32_t len;
+    while ((len = cur.read(out, CIRC_DIR_FORWARD, 100, "ALARM")) > 0) {
+      for (int32_t i = 0; i < len; i++) {
+        copyHits += out[i] == '\n';
+      }
+    }
+  }
+  double copyMs = msSince(start);
+
+  /* Iterator, views into the cursor buffer */
+  uint32_t iterHits = 0;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    auto cur = log.open(CIRC_FLAGS_OLDEST);
+    for (std::string_view l : cur.lines()) {
+      iterHits += l.compare(0, 5, "ALARM") == 0;
+    }
+  }
+  double iterMs = msSince(start);
+
+  printf("Filtered scan x%i: circularFileRead %.2fms (%u hits), "
+         "LineIterator %.2fms (%u hits), speedup %.2fx\r\n",
+         rounds, copyMs, copyHits, iterMs, iterHits, copyMs / iterMs);
+  return copyHits == iterHits ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/**
+ * Filtered scan of a file backed log: circularFileRead against
+ * circularFileSearch over 1 to CIRC_PARALLEL_MAX_THREADS threads
+ *
+ * Build from the repository root, Linux
+ *   gcc -O2 -I. bench/parallelSearchBench.c src/circularflash.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/circularflash.h"
+
+#define BENCH_LENGTH 0x1000000
+
+int mutexCount = 0;
+
+void assertHandler(char *file, int line) {
+  printf("CIRCULAR_LOG_ASSERT(%s:%i\r\n", file, line);
+  exit(1);
+}
+
+static int fd;
+
+/* pread keeps no file position, safe from every worker */
+static uint32_t fileRead(uint32_t addr, uint8_t *buff, uint32_t len) {
+  return pread(fd, buff, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileWrite(uint32_t addr, uint8_t *buff, uint32_t len) {
+  static uint8_t page[0x1000];
+  uint32_t i;
+  if (len > sizeof(page) || fileRead(addr, page, len) != len) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    page[i] &= buff[i];
+  }
+  return pwrite(fd, page, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileErase(uint32_t addr, uint32_t len) {
+  static uint8_t erased[0x1000];
+  uint32_t done;
+  memset(erased, FLASH_ERASED, sizeof(erased));
+  for (done = 0; done < len; done += sizeof(erased)) {
+    if (pwrite(fd, erased, sizeof(erased), addr + done) != sizeof(erased)) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+static double msSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(void) {
+  static uint8_t wBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t out[0x100000];
+  static circular_FILE file;
+  char name[] = "/tmp/circBenchXXXXXX";
+  char line[128];
+  circ_log_t log = {.name = "BENCH",
+                    .read = fileRead,
+                    .write = fileWrite,
+                    .erase = fileErase,
+                    .baseAddress = 0,
+                    .logsLength = BENCH_LENGTH,
+                    .wBuff = wBuff,
+                    .wBuffLen = sizeof(wBuff)};
+  struct timespec start;
+  double seqMs, oneMs = 0, ms;
+  int32_t len, seqLen;
+  uint32_t i, threads;
+  fd = mkstemp(name);
+  if (fd < 0) {
+    return 1;
+  }
+  unlink(name);
+  if (fileErase(0, BENCH_LENGTH) != BENCH_LENGTH ||
+      circularLogInit(&log) != CIRC_LOG_ERR_NONE) {
+    return 1;
+  }
+  for (i = 0; i < 500000; i++) {
+    len = (i % 97 == 0)
+              ? snprintf(line, sizeof(line), "ALARM motor %u stalled\r\n", i)
+              : snprintf(line, sizeof(line), "Status line %u temp %u rpm %u\r\n",
+                         i, i % 80, i % 3000);
+    circularWriteLog(&log, (uint8_t *)line, len);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  circularFileOpen(&log, CIRC_FLAGS_OLDEST, &file);
+  seqLen = circularFileRead(&log, &file, out, sizeof(out), CIRC_DIR_FORWARD,
+                            1000000, "ALARM");
+  seqMs = msSince(&start);
+  printf("circularFileRead        %8.1f ms  %i bytes\r\n", seqMs, seqLen);
+
+  for (threads = 1; threads <= CIRC_PARALLEL_MAX_THREADS; threads *= 2) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    circularFileOpen(&log, CIRC_FLAGS_OLDEST, &file);
+    len = circularFileSearch(&log, &file, out, sizeof(out), "ALARM", threads);
+    ms = msSince(&start);
+    if (threads == 1) {
+      oneMs = ms;
+    }
+    /* Scaling against one worker, and against the sequential read */
+    printf("circularFileSearch x%-2u  %8.1f ms  %i bytes  x%.2f  x%.2f\r\n",
+           threads, ms, len, oneMs / ms, seqMs / ms);
+    if (len != seqLen) {
+      return 1;
+    }
+  }
+  printf("%li cores online\r\n", sysconf(_SC_NPROCESSORS_ONLN));
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * Lines per second written one at a time with circularWriteLog, as three
+ * fragments with circularWriteLogV, and in batches with
+ * circularWriteLogBatch, to a file backed log
+ *
+ * Build from the repository root, Linux
+ *   gcc -O2 -I. bench/writeBatchBench.c src/circularflash.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/circularflash.h"
+
+#define BENCH_LENGTH 0x1000000
+#define BENCH_LINES 500000
+#define BENCH_BATCH 64
+
+int mutexCount = 0;
+
+void assertHandler(char *file, int line) {
+  printf("CIRCULAR_LOG_ASSERT(%s:%i\r\n", file, line);
+  exit(1);
+}
+
+static int fd;
+static uint32_t programs;
+
+static uint32_t fileRead(uint32_t addr, uint8_t *buff, uint32_t len) {
+  return pread(fd, buff, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileWrite(uint32_t addr, uint8_t *buff, uint32_t len) {
+  static uint8_t page[0x1000];
+  uint32_t i;
+  if (len > sizeof(page) || fileRead(addr, page, len) != len) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    page[i] &= buff[i];
+  }
+  programs++;
+  return pwrite(fd, page, len, addr) == (ssize_t)len ? len : 0;
+}
+
+static uint32_t fileErase(uint32_t addr, uint32_t len) {
+  static uint8_t erased[0x1000];
+  uint32_t done;
+  memset(erased, FLASH_ERASED, sizeof(erased));
+  for (done = 0; done < len; done += sizeof(erased)) {
+    if (pwrite(fd, erased, sizeof(erased), addr + done) != sizeof(erased)) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+static double msSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static const char *modes[] = {"circularWriteLog", "circularWriteLogV",
+                              "circularWriteLogBatch"};
+
+int main(void) {
+  static uint8_t wBuff[FLASH_WRITE_SIZE * 16];
+  static char text[BENCH_BATCH][128];
+  static circ_log_iov_t lines[BENCH_BATCH];
+  char name[] = "/tmp/circBenchXXXXXX";
+  char prefix[32], msg[96];
+  circ_log_t log = {.name = "BENCH",
+                    .read = fileRead,
+                    .write = fileWrite,
+                    .erase = fileErase,
+                    .baseAddress = 0,
+                    .logsLength = BENCH_LENGTH,
+                    .wBuff = wBuff,
+                    .wBuffLen = sizeof(wBuff)};
+  circ_log_iov_t iov[3];
+  struct timespec start;
+  double ms, oneMs = 0;
+  uint32_t i, n, mode;
+  int len;
+  fd = mkstemp(name);
+  if (fd < 0) {
+    return 1;
+  }
+  unlink(name);
+  for (mode = 0; mode < 3; mode++) {
+    if (fileErase(0, BENCH_LENGTH) != BENCH_LENGTH ||
+        circularLogInit(&log) != CIRC_LOG_ERR_NONE) {
+      return 1;
+    }
+    programs = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0, n = 0; i < BENCH_LINES; i++) {
+      snprintf(prefix, sizeof(prefix), "%010u I ", 1700000000 + i);
+      snprintf(msg, sizeof(msg), "Status line %u temp %u rpm %u", i, i % 80,
+               i % 3000);
+      if (mode == 0) {
+        len = snprintf(text[0], sizeof(text[0]), "%s%s\r\n", prefix, msg);
+        circularWriteLog(&log, (uint8_t *)text[0], len);
+      } else if (mode == 1) {
+        iov[0].buf = (uint8_t *)prefix;
+        iov[0].len = strlen(prefix);
+        iov[1].buf = (uint8_t *)msg;
+        iov[1].len = strlen(msg);
+        iov[2].buf = (uint8_t *)"\r\n";
+        iov[2].len = 2;
+        circularWriteLogV(&log, iov, 3);
+      } else {
+        lines[n].buf = (uint8_t *)text[n];
+        lines[n].len = snprintf(text[n], sizeof(text[n]), "%s%s\r\n", prefix,
+                                msg);
+        if (++n == BENCH_BATCH || i == BENCH_LINES - 1) {
+          circularWriteLogBatch(&log, lines, n);
+          n = 0;
+        }
+      }
+    }
+    ms = msSince(&start);
+    if (mode == 0) {
+      oneMs = ms;
+    }
+    printf("%-22s %8.1f ms  %9.0f lines/s  %7u programs  x%.2f\r\n",
+           modes[mode], ms, BENCH_LINES * 1e3 / ms, programs, oneMs / ms);
+  }
+  close(fd);
+  return 0;
+}
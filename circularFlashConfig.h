@@ -2,6 +2,12 @@
 #define __CIRCULARFLASHCONFIG_H
 #define FLASH_SECTOR_SIZE 0x1000
 #define FLASH_WRITE_SIZE 0x100
+/* Test exercises several geometries from one binary */
+#define CIRC_LOG_RUNTIME_GEOMETRY 1
+/* Parallel search uses pthreads */
+#ifndef _WIN32
+#define CIRC_LOG_PARALLEL 1
+#endif
 
 extern int mutexCount;
 
@@ -42,55 +42,69 @@ int mutexCount = 0;
 uint32_t readHitCount = 0;
 uint32_t parseDateHits = 0;
 
+uint32_t writeHitCount = 0;
+
 unsigned char *FakeFlash;
 #define FLASH_LOGS_ADDRESS 0x200000
 #define FLASH_LOGS_LENGTH 0x1E0000
 
+/* Second device for alternate geometry tests, not persisted */
+unsigned char *AltFlash;
+#define ALT_LOGS_ADDRESS 0x800000
+#define ALT_LOGS_LENGTH 0x60000
+
+static unsigned char *fakeFlashMap(uint32_t FlashAddress, uint32_t len) {
+  if (FlashAddress >= FLASH_LOGS_ADDRESS &&
+      FlashAddress < FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
+    if (FlashAddress + len > FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
+      printf("Address+len out of range 0x%X\r\n", FlashAddress);
+      return NULL;
+    }
+    return &FakeFlash[FlashAddress - FLASH_LOGS_ADDRESS];
+  }
+  if (FlashAddress >= ALT_LOGS_ADDRESS &&
+      FlashAddress < ALT_LOGS_ADDRESS + ALT_LOGS_LENGTH) {
+    if (FlashAddress + len > ALT_LOGS_ADDRESS + ALT_LOGS_LENGTH) {
+      printf("Address+len out of range 0x%X\r\n", FlashAddress);
+      return NULL;
+    }
+    return &AltFlash[FlashAddress - ALT_LOGS_ADDRESS];
+  }
+  printf("Address out of range 0x%X\r\n", FlashAddress);
+  return NULL;
+}
+
 uint32_t circFlashRead(uint32_t FlashAddress, uint8_t *buff,
                        uint32_t len) {
-  if (FlashAddress < FLASH_LOGS_ADDRESS ||
-      FlashAddress >= FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address out of range 0x%X\r\n", FlashAddress);
-    return 0;
-  }
-  if (FlashAddress + len > FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address+len out of range 0x%X\r\n", FlashAddress);
+  unsigned char *flash = fakeFlashMap(FlashAddress, len);
+  if (flash == NULL) {
     return 0;
   }
   readHitCount += len;
-  memcpy(buff, &FakeFlash[FlashAddress - FLASH_LOGS_ADDRESS], len);
+  memcpy(buff, flash, len);
   return len;
 }
 
 uint32_t circFlashWrite(uint32_t FlashAddress, uint8_t *buff,
                         uint32_t len) {
   uint32_t i;
-  if (FlashAddress < FLASH_LOGS_ADDRESS ||
-      FlashAddress >= FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address out of range 0x%X\r\n", FlashAddress);
-    return 0;
-  }
-  if (FlashAddress + len > FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address+len out of range 0x%X\r\n", FlashAddress);
+  unsigned char *flash = fakeFlashMap(FlashAddress, len);
+  if (flash == NULL) {
     return 0;
   }
+  writeHitCount++;
   for (i = 0; i < len; i++) {
-    FakeFlash[FlashAddress - FLASH_LOGS_ADDRESS + i] &= buff[i];
+    flash[i] &= buff[i];
   }
   return len;
 }
 
 uint32_t circFlashErase(uint32_t FlashAddress, uint32_t len) {
-  if (FlashAddress < FLASH_LOGS_ADDRESS ||
-      FlashAddress >= FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address out of range 0x%X\r\n", FlashAddress);
+  unsigned char *flash = fakeFlashMap(FlashAddress, len);
+  if (flash == NULL) {
     return 0;
   }
-  if (FlashAddress + len > FLASH_LOGS_ADDRESS + FLASH_LOGS_LENGTH) {
-    printf("Address+len out of range 0x%X\r\n", FlashAddress);
-    return 0;
-  }
-  memset(&FakeFlash[FlashAddress - FLASH_LOGS_ADDRESS], FLASH_ERASED, len);
+  memset(flash, FLASH_ERASED, len);
   return len;
 }
 
@@ -268,8 +282,9 @@ static const char *test_circLogFileTime(void) {
   char tbuf[512];
   uint8_t Read[1024] = {0};
   for (i = 0; i < 100000; i++) {
+    /* Keep line width independent of RAND_MAX */
     len = sprintf(printbuf, "%010i Was Stamped[%05i] %i\r\n",
-                  1668175200 + (i * 900), i, rand());
+                  1668175200 + (i * 900), i, rand() & 0x7FFF);
     circularWriteLog(&log, (unsigned char *)printbuf, len);
   }
 
@@ -365,6 +380,2166 @@ static const char *test_circLogSearchHang(void) {
   return NULL;
 }
 
+static const char *test_circLogGetLine(void) {
+  circular_FILE cf;
+  uint32_t i, count;
+  int32_t len;
+  const char *line;
+  char printbuf[128];
+  for (i = 0; i < 500; i++) {
+    len = sprintf(printbuf, "GetLine[%03i] %i\r\n", i, rand());
+    circularWriteLog(&log, (unsigned char *)printbuf, len);
+  }
+  /* Newest first in place */
+  mu_assert("error, log file open err",
+            circularFileOpen(&log, CIRC_FLAGS_NEWEST, &cf) ==
+                CIRC_LOG_ERR_NONE);
+  len = circularFileGetLine(&log, &cf, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, newest line", len == (int32_t)strlen(printbuf) &&
+                                      memcmp(line, printbuf, len) == 0);
+  for (i = 498; i >= 400; i--) {
+    len = circularFileGetLine(&log, &cf, CIRC_DIR_REVERSE, &line);
+    sprintf(printbuf, "GetLine[%03i]", i);
+    mu_assert("error, reverse line", len > 0 && memcmp(line, printbuf, 12) == 0);
+  }
+  /* Whole log forward, every line terminated */
+  mu_assert("error, log file open err",
+            circularFileOpen(&log, CIRC_FLAGS_OLDEST, &cf) ==
+                CIRC_LOG_ERR_NONE);
+  count = 0;
+  while ((len = circularFileGetLine(&log, &cf, CIRC_DIR_FORWARD, &line)) > 0) {
+    mu_assert("error, forward line", line[len - 1] == '\n');
+    count += memcmp(line, "GetLine[", 8) == 0;
+  }
+  mu_assert("error, forward count", count == 500);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogStamped(void) {
+  static const uint32_t cuts[] = {0x1000, 0x1000 - 3, 200, 7};
+  circular_FILE cf;
+  static char printbuf[128];
+  static uint8_t range[0x1000];
+  char tbuf[128];
+  uint8_t Read[256];
+  int32_t i;
+  uint32_t len, stamp, pass, seek, total, hash, firstTotal = 0, firstHash = 0;
+  for (i = 0; i < 20000; i++) {
+    len = sprintf(printbuf, "Binary stamp line %05i\r\n", i);
+    circularWriteLogStamped(&log, 1800000000 + (i * 60), (uint8_t *)printbuf,
+                            len);
+  }
+  len = circularReadLines(&log, Read, sizeof(Read), 1, NULL, 0);
+  mu_assert("error, header not stripped",
+            len == strlen(printbuf) && memcmp(Read, printbuf, len) == 0);
+  mu_assert("error, log file open err",
+            circularFileOpen(&log, CIRC_FLAGS_NEWEST, &cf) ==
+                CIRC_LOG_ERR_NONE);
+  len = circularFileRead(&log, &cf, Read, sizeof(Read), CIRC_DIR_REVERSE, 1,
+                         "Binary stamp line 19999");
+  mu_assert("error, filtered stamped line", len == strlen(printbuf));
+  /* Byte reads strip the headers of the lines they hold */
+  circularFileOpen(&log, CIRC_FLAGS_NEWEST, &cf);
+  len = circularReadLogPartial(&log, Read, cf.seekPos - 200, 200, &stamp);
+  mu_assert("error, partial header not stripped",
+            len < 200 && memchr(Read, CIRC_REC_MARKER, len) == NULL &&
+                memcmp(&Read[len - strlen(printbuf)], printbuf,
+                       strlen(printbuf)) == 0);
+  cf.seekPos -= 200;
+  i = circularFileRead(&log, &cf, Read, sizeof(Read), CIRC_DIR_FORWARD,
+                       LINES_READ_ALL, NULL);
+  mu_assert("error, read all header not stripped",
+            i == (int32_t)len && memchr(Read, CIRC_REC_MARKER, len) == NULL);
+  /* The whole log in ranges that cut headers, the same text every time */
+  for (pass = 0; pass < sizeof(cuts) / sizeof(cuts[0]); pass++) {
+    seek = total = 0;
+    hash = 2166136261u;
+    do {
+      len = circularReadLogPartial(&log, range, seek, cuts[pass], &stamp);
+      for (i = 0; i < (int32_t)len; i++) {
+        mu_assert("error, range header bytes",
+                  range[i] != CIRC_REC_MARKER && range[i] < 0x80);
+        hash = (hash ^ range[i]) * 16777619u;
+      }
+      total += len;
+      seek += cuts[pass];
+    } while (stamp);
+    if (pass == 0) {
+      firstTotal = total;
+      firstHash = hash;
+    }
+    mu_assert("error, range text", total && total == firstTotal &&
+                                       hash == firstHash);
+  }
+  /* Second pass searches an index rebuilt from flash */
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 20000 - 1; i >= 15000; i -= 7) {
+      stamp = 1800000000 + (i * 60);
+      parseDateHits = 0;
+      len = indexedLogSearch(&log, Read, sizeof(Read), stamp);
+      sprintf(tbuf, "Binary stamp line %05i\r\n", i);
+      sprintf(printbuf, "err @ stamped %i pass %i", i, pass);
+      mu_assert(printbuf, len == strlen(tbuf) && memcmp(Read, tbuf, len) == 0);
+      mu_assert("error, parseTime called", parseDateHits == 0);
+    }
+    mu_assert("error, reinit", circularLogInit(&log) == CIRC_LOG_ERR_NONE);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogIndexGranularity(void) {
+  static const uint32_t granularity[] = {0x1000, 0x400, 0x100};
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[ALT_LOGS_LENGTH / 0x100];
+  static char printbuf[256];
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t g, i, len, stamp, pass, ioTrack;
+  for (g = 0; g < sizeof(granularity) / sizeof(granularity[0]); g++) {
+    circ_log_t alt = {.name = "ALT",
+                      .read = circFlashRead,
+                      .write = circFlashWrite,
+                      .erase = circFlashErase,
+                      .baseAddress = ALT_LOGS_ADDRESS,
+                      .logsLength = ALT_LOGS_LENGTH,
+                      .wBuff = altBuff,
+                      .index = altIndex,
+                      .parseTime = parseTime,
+                      .wBuffLen = sizeof(altBuff),
+                      .indexGranularity = granularity[g]};
+    memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+    mu_assert("error, granularity init",
+              circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    for (i = 0; i < 20000; i++) {
+      len = sprintf(printbuf, "%010i Granular line %i %i\r\n",
+                    1668175200 + (i * 60), i, rand() & 0x7FFF);
+      circularWriteLog(&alt, (uint8_t *)printbuf, len);
+    }
+    /* Live index, then one rebuilt at init */
+    for (pass = 0; pass < 2; pass++) {
+      ioTrack = 0;
+      for (i = 20000 - 1; i >= 12000; i -= 13) {
+        stamp = 1668175200 + (i * 60);
+        readHitCount = 0;
+        len = indexedLogSearch(&alt, Read, sizeof(Read), stamp);
+        sprintf(printbuf, "%010i", stamp);
+        mu_assert("error, granularity search",
+                  len && memcmp(Read, printbuf, 10) == 0);
+        if (readHitCount > ioTrack) {
+          ioTrack = readHitCount;
+        }
+      }
+      mu_assert("error, granularity IO",
+                ioTrack <= granularity[g] * 2 + sizeof(altBuff));
+      mu_assert("error, granularity reinit",
+                circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    }
+    printf("Index granularity 0x%X = SearchIO(%i) RAM(%i)\r\n",
+           granularity[g], ioTrack,
+           (int)(CIRC_INDEX_ENTRIES(ALT_LOGS_LENGTH, granularity[g]) *
+                 sizeof(circ_log_index_t)));
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogCompactIndex(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t flatIndex[ALT_LOGS_LENGTH / 0x100];
+  static circ_log_cindex_t compactIndex[CIRC_CINDEX_GROUPS(
+      ALT_LOGS_LENGTH / 0x100)];
+  static char printbuf[256];
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2];
+  uint8_t flatRead[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t i, len, flatLen, stamp, rep;
+  circ_log_t flat = {.name = "FLAT",
+                     .read = circFlashRead,
+                     .write = circFlashWrite,
+                     .erase = circFlashErase,
+                     .baseAddress = ALT_LOGS_ADDRESS,
+                     .logsLength = ALT_LOGS_LENGTH,
+                     .wBuff = altBuff,
+                     .index = flatIndex,
+                     .parseTime = parseTime,
+                     .wBuffLen = sizeof(altBuff),
+                     .indexGranularity = 0x100};
+  circ_log_t compact = flat;
+  compact.name = "COMPACT";
+  compact.index = NULL;
+  compact.compactIndex = compactIndex;
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, compact init",
+            circularLogInit(&compact) == CIRC_LOG_ERR_NONE);
+  /* Live updates, wrapping the log with a gap that forces rebasing */
+  for (i = 0; i < 20000; i++) {
+    len = sprintf(printbuf, "%010i Compact line %i %i\r\n",
+                  1668175200 + (i * 60) + (i >= 10000 ? 2000000 : 0), i,
+                  rand() & 0x7FFF);
+    circularWriteLog(&compact, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, flat init", circularLogInit(&flat) == CIRC_LOG_ERR_NONE);
+  for (rep = 0; rep < 2; rep++) {
+    for (i = 20000 - 1; i >= 12000; i -= 7) {
+      stamp = 1668175200 + (i * 60) + 2000000;
+      flatLen = indexedLogSearch(&flat, flatRead, sizeof(flatRead), stamp);
+      len = indexedLogSearch(&compact, Read, sizeof(Read), stamp);
+      sprintf(printbuf, "%010i", stamp);
+      mu_assert("error, compact search",
+                len && memcmp(Read, printbuf, 10) == 0);
+      mu_assert("error, compact mismatch",
+                len == flatLen && memcmp(Read, flatRead, len) == 0);
+    }
+    /* Then against an index rebuilt at init */
+    mu_assert("error, compact reinit",
+              circularLogInit(&compact) == CIRC_LOG_ERR_NONE);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+#define FINDEX_LOG_LENGTH 0x5C000
+#define FINDEX_LENGTH 0x4000
+
+static const char *flashIndexCheck(circ_log_t *paged, circ_log_t *flat,
+                                   uint32_t newest, uint32_t oldest) {
+  static char printbuf[32];
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2];
+  uint8_t flatRead[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t i, len, flatLen, stamp;
+  for (i = newest; i >= oldest; i -= 11) {
+    stamp = 1668175200 + (i * 60);
+    flatLen = indexedLogSearch(flat, flatRead, sizeof(flatRead), stamp);
+    readHitCount = 0;
+    len = indexedLogSearch(paged, Read, sizeof(Read), stamp);
+    sprintf(printbuf, "%010i", stamp);
+    mu_assert("error, flash index search",
+              len && memcmp(Read, printbuf, 10) == 0);
+    mu_assert("error, flash index mismatch",
+              len == flatLen && memcmp(Read, flatRead, len) == 0);
+    /* One index page over the flat index bound */
+    mu_assert("error, flash index IO",
+              readHitCount <= 0x100 * 2 + FLASH_WRITE_SIZE * 3);
+  }
+  return NULL;
+}
+
+static const char *test_circLogFlashIndex(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t flatBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t flatIndex[FINDEX_LOG_LENGTH / 0x100];
+  static uint32_t summary[CIRC_FINDEX_PAGES(FINDEX_LENGTH, FLASH_WRITE_SIZE)];
+  static uint8_t cache[FLASH_WRITE_SIZE];
+  static circ_log_findex_t findex = {.baseAddress =
+                                         ALT_LOGS_ADDRESS + FINDEX_LOG_LENGTH,
+                                     .length = FINDEX_LENGTH,
+                                     .summary = summary,
+                                     .cache = cache};
+  static char printbuf[256];
+  const char *err;
+  uint32_t i, len, flatInitIO, pagedInitIO;
+  circ_log_t paged = {.name = "PAGED",
+                      .read = circFlashRead,
+                      .write = circFlashWrite,
+                      .erase = circFlashErase,
+                      .baseAddress = ALT_LOGS_ADDRESS,
+                      .logsLength = FINDEX_LOG_LENGTH,
+                      .wBuff = altBuff,
+                      .flashIndex = &findex,
+                      .parseTime = parseTime,
+                      .wBuffLen = sizeof(altBuff),
+                      .indexGranularity = 0x100};
+  circ_log_t flat = paged;
+  flat.name = "FLAT";
+  flat.wBuff = flatBuff;
+  flat.flashIndex = NULL;
+  flat.index = flatIndex;
+  mu_assert("error, flash index area",
+            FINDEX_LENGTH >=
+                CIRC_FINDEX_LENGTH(FINDEX_LOG_LENGTH / 0x100, FLASH_SECTOR_SIZE));
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, flash index init",
+            circularLogInit(&paged) == CIRC_LOG_ERR_NONE);
+  writeHitCount = 0;
+  for (i = 0; i < 20000; i++) {
+    len = sprintf(printbuf, "%010i Paged line %i %i\r\n",
+                  1668175200 + (i * 60), i, rand() & 0x7FFF);
+    circularWriteLog(&paged, (uint8_t *)printbuf, len);
+  }
+  /* One program a line, index entries a page at a time on top */
+  mu_assert("error, flash index programs", writeHitCount <= i + i / 100);
+  readHitCount = 0;
+  mu_assert("error, flat init", circularLogInit(&flat) == CIRC_LOG_ERR_NONE);
+  flatInitIO = readHitCount;
+  if ((err = flashIndexCheck(&paged, &flat, 20000 - 1, 13000)) != NULL) {
+    return err;
+  }
+  /* Reopened from the index area, without scanning the log */
+  readHitCount = 0;
+  mu_assert("error, flash index reinit",
+            circularLogInit(&paged) == CIRC_LOG_ERR_NONE);
+  pagedInitIO = readHitCount;
+  mu_assert("error, flash index init IO", pagedInitIO < flatInitIO);
+  if ((err = flashIndexCheck(&paged, &flat, 20000 - 1, 13000)) != NULL) {
+    return err;
+  }
+  /* Live updates after reopening */
+  for (; i < 21000; i++) {
+    len = sprintf(printbuf, "%010i Paged line %i %i\r\n",
+                  1668175200 + (i * 60), i, rand() & 0x7FFF);
+    circularWriteLog(&paged, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, flat init", circularLogInit(&flat) == CIRC_LOG_ERR_NONE);
+  if ((err = flashIndexCheck(&paged, &flat, 21000 - 1, 14000)) != NULL) {
+    return err;
+  }
+  /* A blank area is rebuilt from the log */
+  circFlashErase(findex.baseAddress, FINDEX_LENGTH);
+  mu_assert("error, flash index rebuild",
+            circularLogInit(&paged) == CIRC_LOG_ERR_NONE);
+  if ((err = flashIndexCheck(&paged, &flat, 21000 - 1, 14000)) != NULL) {
+    return err;
+  }
+  printf("Flash index RAM(%i) flat RAM(%i), init IO flash(%i) flat(%i)\r\n",
+         (int)(sizeof(summary) + sizeof(cache) + sizeof(findex)),
+         (int)sizeof(flatIndex), pagedInitIO, flatInitIO);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+#define BLOOM_LOG_LENGTH 0x55000
+#define BLOOM_BYTES 0x200
+
+/* Filtered reads both ways, return : bytes read from flash */
+static const char *bloomCompare(circ_log_t *bloomLog, circ_log_t *plain,
+                                CIRC_DIR dir, char *filter, uint32_t *io) {
+  static circular_FILE bloomFile, plainFile;
+  static uint8_t bloomRead[0x2000], plainRead[0x2000];
+  int32_t len, plainLen;
+  mu_assert("error, bloom open",
+            circularFileOpen(bloomLog,
+                             dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST
+                                                     : CIRC_FLAGS_NEWEST,
+                             &bloomFile) == CIRC_LOG_ERR_NONE);
+  circularFileOpen(plain,
+                   dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST
+                                           : CIRC_FLAGS_NEWEST,
+                   &plainFile);
+  plainLen = circularFileRead(plain, &plainFile, plainRead, sizeof(plainRead),
+                              dir, 1000, filter);
+  readHitCount = 0;
+  len = circularFileRead(bloomLog, &bloomFile, bloomRead, sizeof(bloomRead),
+                         dir, 1000, filter);
+  *io = readHitCount;
+  mu_assert("error, bloom found nothing", len > 0);
+  mu_assert("error, bloom mismatch",
+            len == plainLen && memcmp(bloomRead, plainRead, len) == 0);
+  return NULL;
+}
+
+static const char *test_circLogBloom(void) {
+  static const char *modules[] = {"MOTOR", "PUMP", "VALVE", "HEATER"};
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t plainBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t head[BLOOM_BYTES];
+  static circ_log_bloom_t bloom = {.baseAddress =
+                                       ALT_LOGS_ADDRESS + BLOOM_LOG_LENGTH,
+                                   .length = ALT_LOGS_LENGTH - BLOOM_LOG_LENGTH,
+                                   .bytes = BLOOM_BYTES,
+                                   .head = head};
+  static char printbuf[256];
+  static char *filters[] = {"FAULT E7734", "FAULT", "VALVE 12345 "};
+  const char *err;
+  circ_log_stats_t stats;
+  uint32_t i, f, len, io, plainIO, rep;
+  CIRC_DIR dir;
+  circ_log_t bloomLog = {.name = "BLOOM",
+                         .read = circFlashRead,
+                         .write = circFlashWrite,
+                         .erase = circFlashErase,
+                         .baseAddress = ALT_LOGS_ADDRESS,
+                         .logsLength = BLOOM_LOG_LENGTH,
+                         .wBuff = altBuff,
+                         .wBuffLen = sizeof(altBuff),
+                         .bloom = &bloom};
+  circ_log_t plain = bloomLog;
+  plain.name = "PLAIN";
+  plain.wBuff = plainBuff;
+  plain.bloom = NULL;
+  mu_assert("error, bloom area",
+            bloom.length >= CIRC_BLOOM_LENGTH(BLOOM_LOG_LENGTH /
+                                                  FLASH_SECTOR_SIZE,
+                                              BLOOM_BYTES, FLASH_SECTOR_SIZE));
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, bloom init",
+            circularLogInit(&bloomLog) == CIRC_LOG_ERR_NONE);
+  /* Rare faults over a log that wraps twice */
+  for (i = 0; i < 30000; i++) {
+    if (i % 4000 == 1234) {
+      len = sprintf(printbuf, "FAULT E7734 overcurrent %i\r\n", i);
+    } else {
+      len = sprintf(printbuf, "%s %i state %i\r\n", modules[i & 3],
+                    rand() & 0x7FFF, i);
+    }
+    circularWriteLog(&bloomLog, (uint8_t *)printbuf, len);
+  }
+  len = sprintf(printbuf, "VALVE 12345 stuck\r\n");
+  circularWriteLog(&bloomLog, (uint8_t *)printbuf, len);
+  mu_assert("error, plain init", circularLogInit(&plain) == CIRC_LOG_ERR_NONE);
+  for (rep = 0; rep < 2; rep++) {
+    for (f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+      for (dir = CIRC_DIR_FORWARD; dir <= CIRC_DIR_REVERSE; dir++) {
+        memset(&bloomLog.stats, 0, sizeof(bloomLog.stats));
+        if ((err = bloomCompare(&bloomLog, &plain, dir, filters[f], &io)) !=
+            NULL) {
+          return err;
+        }
+        if ((err = bloomCompare(&plain, &plain, dir, filters[f], &plainIO)) !=
+            NULL) {
+          return err;
+        }
+        circularGetStats(&bloomLog, &stats);
+        mu_assert("error, bloom skipped nothing", stats.bloomSkipped);
+        mu_assert("error, bloom IO", io * 5 < plainIO);
+        if (rep == 0 && dir == CIRC_DIR_FORWARD) {
+          printf("Bloom '%s' IO %i/%i skipped %i/%i false %i\r\n", filters[f],
+                 io, plainIO, stats.bloomSkipped, stats.bloomChecked,
+                 stats.bloomFalse);
+        }
+      }
+    }
+    /* Head sector filter rebuilt at init */
+    mu_assert("error, bloom reinit",
+              circularLogInit(&bloomLog) == CIRC_LOG_ERR_NONE);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+/* Level from an "L<n> " prefix */
+static uint8_t parseTag(const char *line) {
+  if (line[0] == 'L' && line[1] >= '0' && line[1] <= '9') {
+    return line[1] - '0';
+  }
+  return 0;
+}
+
+/* Lines of a tag mask against the plain log, return : line count */
+static const char *tagCompare(circ_log_t *tagLog, circ_log_t *plain,
+                              CIRC_DIR dir, uint32_t *io) {
+  static circular_FILE tagFile, plainFile;
+  static uint8_t tagRead[0x2000], plainRead[0x2000];
+  int32_t len, plainLen;
+  CIRC_FLAGS flags =
+      dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST : CIRC_FLAGS_NEWEST;
+  circularFileOpen(plain, flags, &plainFile);
+  plainLen = circularFileRead(plain, &plainFile, plainRead, sizeof(plainRead),
+                              dir, 1000, "L3 ");
+  mu_assert("error, tag open",
+            circularFileOpen(tagLog, flags, &tagFile) == CIRC_LOG_ERR_NONE);
+  circularFileSetTags(&tagFile, CIRC_TAG_BIT(3));
+  readHitCount = 0;
+  len = circularFileRead(tagLog, &tagFile, tagRead, sizeof(tagRead), dir, 1000,
+                         NULL);
+  *io = readHitCount;
+  mu_assert("error, tag found nothing", len > 0);
+  mu_assert("error, tag mismatch",
+            len == plainLen && memcmp(tagRead, plainRead, len) == 0);
+  return NULL;
+}
+
+static const char *test_circLogTags(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t plainBuff[FLASH_WRITE_SIZE * 2];
+  static uint32_t tagMap[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static char printbuf[256];
+  static circular_FILE file;
+  const char *err, *line;
+  circ_log_stats_t stats;
+  uint32_t i, io, plainIO, rep, count, plainCount;
+  int32_t len;
+  CIRC_DIR dir;
+  circ_log_t tagLog = {.name = "TAGS",
+                       .read = circFlashRead,
+                       .write = circFlashWrite,
+                       .erase = circFlashErase,
+                       .baseAddress = ALT_LOGS_ADDRESS,
+                       .logsLength = ALT_LOGS_LENGTH,
+                       .wBuff = altBuff,
+                       .wBuffLen = sizeof(altBuff),
+                       .parseTag = parseTag,
+                       .tagMap = tagMap};
+  circ_log_t plain = tagLog;
+  plain.name = "PLAIN";
+  plain.wBuff = plainBuff;
+  plain.tagMap = NULL;
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, tag init", circularLogInit(&tagLog) == CIRC_LOG_ERR_NONE);
+  /* Mostly debug and info, rare warnings and errors */
+  for (i = 0; i < 30000; i++) {
+    if (i % 3000 == 777) {
+      len = sprintf(printbuf, "L3 pressure high %i\r\n", i);
+      circularWriteLog(&tagLog, (uint8_t *)printbuf, len);
+    } else if (i % 5000 == 2500) {
+      len = sprintf(printbuf, "ERROR sensor lost %i\r\n", i);
+      circularWriteLogTagged(&tagLog, 4, (uint8_t *)printbuf, len);
+    } else {
+      len = sprintf(printbuf, "L%i state %i\r\n", i & 1, i);
+      circularWriteLog(&tagLog, (uint8_t *)printbuf, len);
+    }
+  }
+  mu_assert("error, plain init", circularLogInit(&plain) == CIRC_LOG_ERR_NONE);
+  circularFileOpen(&plain, CIRC_FLAGS_OLDEST, &file);
+  plainCount = 0;
+  while ((len = circularFileGetLine(&plain, &file, CIRC_DIR_FORWARD, &line)) >
+         0) {
+    if (memcmp(line, "L3 ", 3) == 0 || memcmp(line, "ERROR", 5) == 0) {
+      plainCount++;
+    }
+  }
+  for (rep = 0; rep < 2; rep++) {
+    for (dir = CIRC_DIR_FORWARD; dir <= CIRC_DIR_REVERSE; dir++) {
+      memset(&tagLog.stats, 0, sizeof(tagLog.stats));
+      if ((err = tagCompare(&tagLog, &plain, dir, &io)) != NULL) {
+        return err;
+      }
+      if ((err = tagCompare(&plain, &plain, dir, &plainIO)) != NULL) {
+        return err;
+      }
+      circularGetStats(&tagLog, &stats);
+      mu_assert("error, tag skipped nothing", stats.tagSkipped);
+      mu_assert("error, tag IO", io * 5 < plainIO);
+      if (rep == 0 && dir == CIRC_DIR_FORWARD) {
+        printf("Tags IO %i/%i skipped %i sectors\r\n", io, plainIO,
+               stats.tagSkipped);
+      }
+      /* Warnings and above by line */
+      circularFileOpen(&tagLog, dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST
+                                                        : CIRC_FLAGS_NEWEST,
+                       &file);
+      circularFileSetTags(&file, CIRC_TAGS_FROM(3));
+      count = 0;
+      while ((len = circularFileGetLine(&tagLog, &file, dir, &line)) > 0) {
+        mu_assert("error, tag line",
+                  memcmp(line, "L3 ", 3) == 0 || memcmp(line, "ERROR", 5) == 0);
+        count++;
+      }
+      mu_assert("error, tag line count", count == plainCount);
+    }
+    /* Tag map rebuilt at init */
+    mu_assert("error, tag reinit",
+              circularLogInit(&tagLog) == CIRC_LOG_ERR_NONE);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+#if CIRC_LOG_PARALLEL
+/* No shared counters, called from several threads */
+static uint32_t circFlashReadShared(uint32_t FlashAddress, uint8_t *buff,
+                                    uint32_t len) {
+  unsigned char *flash = fakeFlashMap(FlashAddress, len);
+  if (flash == NULL) {
+    return 0;
+  }
+  memcpy(buff, flash, len);
+  return len;
+}
+
+static const char *test_circLogParallel(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t seqRead[0x80000], parRead[0x80000];
+  static char printbuf[512];
+  static circular_FILE file;
+  static const uint32_t threads[] = {1, 2, 3, 4, 7, 16};
+  static char *filters[] = {"ALARM", NULL};
+  uint32_t i, t, f, len, total;
+  int32_t seqLen, ret;
+  circ_log_t alt = {.name = "PARALLEL",
+                    .read = circFlashReadShared,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff)};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, parallel init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* Wrapped, with lines of every length across sector edges */
+  for (i = 0; i < 30000; i++) {
+    if (i % 61 == 0) {
+      len = sprintf(printbuf, "ALARM %i %.*s\r\n", i, (int)(i % 300),
+                    "ALARM payload ALARM payload ALARM payload ALARM payload "
+                    "ALARM payload ALARM payload ALARM payload ALARM payload "
+                    "ALARM payload ALARM payload ALARM payload ALARM payload "
+                    "ALARM payload ALARM payload ALARM payload ALARM payload "
+                    "ALARM payload ALARM payload ALARM payload ALARM payload "
+                    "ALARM payload ALARM payload ALARM payload ALARM payload");
+    } else {
+      len = sprintf(printbuf, "Status %i temp %i\r\n", i, rand() % 1000);
+    }
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  for (f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+    circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+    seqLen = circularFileRead(&alt, &file, seqRead, sizeof(seqRead),
+                              CIRC_DIR_FORWARD, 100000, filters[f]);
+    mu_assert("error, parallel sequential read", seqLen > 0);
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+      circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+      ret = circularFileSearch(&alt, &file, parRead, sizeof(parRead),
+                               filters[f], threads[t]);
+      mu_assert("error, parallel mismatch",
+                ret == seqLen && memcmp(seqRead, parRead, ret) == 0);
+      /* Continued through a small buffer */
+      circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+      total = 0;
+      while ((ret = circularFileSearch(&alt, &file, &parRead[total], 0x300,
+                                       filters[f], threads[t])) > 0) {
+        total += ret;
+        if (total >= (uint32_t)seqLen) {
+          break;
+        }
+      }
+      mu_assert("error, parallel continued",
+                total == (uint32_t)seqLen &&
+                    memcmp(seqRead, parRead, total) == 0);
+    }
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+#endif
+
+static uint32_t dedupClock;
+
+static uint32_t dedupNow(void) { return dedupClock; }
+
+static const char *test_circLogDedup(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_dedup_t dedup = {.skip = 11, .timeout = 60, .now = dedupNow};
+  static circular_FILE file;
+  static char printbuf[256];
+  static const char *expect[] = {
+      "1700000000 Pump fault code 7\r\n",
+      "1700000999 last message repeated 999 times\r\n",
+      "1700001000 Pump recovered\r\n",
+      "1700002000 Pump fault code 7\r\n",
+      "1700002070 last message repeated 7 times\r\n",
+      "1700002090 last message repeated 2 times\r\n",
+      "1700002100 Pump recovered\r\n",
+      "1700002100 last message repeated 1 times\r\n",
+      "1700002200 Pump fault vAJsqy\r\n",
+      "1700002201 Pump fault 2Ar6Yt\r\n"};
+  const char *line;
+  circ_log_stats_t stats;
+  uint32_t i, len, n, plainWrites;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "DEDUP",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff)};
+  /* Page programs for the flood without dedup */
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  circularLogInit(&alt);
+  writeHitCount = 0;
+  for (i = 0; i < 1000; i++) {
+    len = sprintf(printbuf, "%010u Pump fault code 7\r\n", 1700000000 + i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  plainWrites = writeHitCount;
+  alt.dedup = &dedup;
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, dedup init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  writeHitCount = 0;
+  dedupClock = 0;
+  for (i = 0; i < 1000; i++) {
+    len = sprintf(printbuf, "%010u Pump fault code 7\r\n", 1700000000 + i);
+    mu_assert("error, dedup write",
+              circularWriteLog(&alt, (uint8_t *)printbuf, len) == len);
+  }
+  len = sprintf(printbuf, "%010u Pump recovered\r\n", 1700001000);
+  circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  mu_assert("error, dedup writes", writeHitCount * 20 < plainWrites);
+  /* Timeout flushes during a slow flood, then a periodic flush */
+  for (i = 0; i < 10; i++) {
+    dedupClock = i * 10;
+    len = sprintf(printbuf, "%010u Pump fault code 7\r\n", 1700002000 + i * 10);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  dedupClock = 200;
+  circularFlushRepeats(&alt, 0);
+  len = sprintf(printbuf, "%010u Pump recovered\r\n", 1700002100);
+  circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  circularFlushRepeats(&alt, 1);
+  /* Equal hash and length, different text */
+  circularWriteLog(&alt, (uint8_t *)expect[8], strlen(expect[8]));
+  circularWriteLog(&alt, (uint8_t *)expect[9], strlen(expect[9]));
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  n = sizeof(expect) / sizeof(expect[0]);
+  while ((lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE, &line)) >
+         0) {
+    mu_assert("error, dedup extra line", n > 0);
+    n--;
+    mu_assert("error, dedup line",
+              (uint32_t)lineLen == strlen(expect[n]) &&
+                  memcmp(line, expect[n], lineLen) == 0);
+  }
+  /* The first line is only returned as a partial first line */
+  mu_assert("error, dedup line count", n <= 1);
+  circularGetStats(&alt, &stats);
+  mu_assert("error, dedup stats", stats.repeatsCollapsed == 999 + 7 + 2 + 1);
+  printf("Dedup page writes %i against %i\r\n", writeHitCount, plainWrites);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t limitClock;
+
+static uint32_t limitNow(void) { return limitClock; }
+
+static const char *test_circLogRateLimit(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_limit_t limit[] = {
+      /* Tag 2 is a chatty module with no budget of its own */
+      {.tags = CIRC_TAG_BIT(2), .now = limitNow, .reportEvery = 10},
+      {.rate = 100,
+       .burst = 1000,
+       .now = limitNow,
+       .criticalTags = CIRC_TAGS_FROM(7),
+       .sampleTags = CIRC_TAG_BIT(3),
+       .sampleEvery = 4,
+       .reportEvery = 10}};
+  static circular_FILE file;
+  static char printbuf[256];
+  const char *line;
+  circ_log_stats_t stats;
+  uint32_t i, len, written, critical, sampled, reports;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "LIMIT",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .parseTag = parseTag,
+                    .limit = limit,
+                    .limitCount = sizeof(limit) / sizeof(limit[0])};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  limitClock = 0;
+  mu_assert("error, limit init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* A runaway producer within one tick, 25 byte lines */
+  written = critical = sampled = 0;
+  for (i = 0; i < 1000; i++) {
+    uint32_t tag = i % 50 == 0 ? 7 : i % 10 == 5 ? 3 : i % 10 == 6 ? 2 : 0;
+    len = sprintf(printbuf, "L%u runaway line %06u\r\n", tag, i);
+    if (circularWriteLog(&alt, (uint8_t *)printbuf, len) == len) {
+      written++;
+      critical += tag == 7;
+      sampled += tag == 3;
+    }
+  }
+  mu_assert("error, limit critical dropped", critical == 20);
+  mu_assert("error, limit tag budget", written < 1000 / 2);
+  /* 100 bytes a tick pay the debt of one burst, the report goes with
+   * the next line */
+  limitClock = 20;
+  len = sprintf(printbuf, "L0 after the storm\r\n");
+  mu_assert("error, limit refill",
+            circularWriteLog(&alt, (uint8_t *)printbuf, len) == len);
+  /* A bucket admitting nothing still reports on schedule */
+  len = sprintf(printbuf, "L2 still chatty\r\n");
+  mu_assert("error, limit zero rate",
+            circularWriteLog(&alt, (uint8_t *)printbuf, len) == 0);
+  circularGetStats(&alt, &stats);
+  mu_assert("error, limit stats", stats.rateDropped == 1000 - written + 1);
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  reports = 0;
+  i = 0;
+  while ((lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD,
+                                        &line)) > 0) {
+    if (memcmp(line, "rate limit dropped", 18) == 0) {
+      /* Tag 2 drops stay with their own bucket */
+      mu_assert("error, limit report count",
+                strtoul(&line[19], NULL, 10) ==
+                    (reports ? 101 : 1000 - written - 100));
+      reports++;
+    }
+    mu_assert("error, limit tag 2 written", memcmp(line, "L2", 2) != 0);
+    i++;
+  }
+  mu_assert("error, limit report", reports == 2);
+  printf("Rate limit wrote %i of 1000, critical %i sampled %i, %i lines\r\n",
+         written, critical, sampled, i);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogLimitDedup(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_limit_t limit = {.burst = 20,
+                                   .now = limitNow,
+                                   .criticalTags = CIRC_TAG_BIT(7),
+                                   .reportEvery = 1000};
+  static circ_log_dedup_t dedup;
+  static circular_FILE file;
+  static char printbuf[64];
+  const char *line;
+  uint32_t i, len, lines;
+  circ_log_t alt = {.name = "LIMDEDUP",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .parseTag = parseTag,
+                    .dedup = &dedup,
+                    .limit = &limit,
+                    .limitCount = 1};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  limitClock = 0;
+  mu_assert("error, limdedup init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  len = sprintf(printbuf, "L1 sensor timeout\r\n");
+  /* Opening at the oldest passes over the first line */
+  circularWriteLog(&alt, (uint8_t *)"L7 boot\r\n", 9);
+  /* Over budget, neither the line nor its repeats reach flash */
+  for (i = 0; i < 5; i++) {
+    mu_assert("error, limdedup dropped",
+              circularWriteLog(&alt, (uint8_t *)printbuf, len) == 0);
+  }
+  circularWriteLog(&alt, (uint8_t *)"L7 critical\r\n", 13);
+  circularFlushRepeats(&alt, 1);
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  lines = 0;
+  while (circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line) > 0) {
+    mu_assert("error, limdedup summary", strstr(line, "repeated") == NULL);
+    mu_assert("error, limdedup line", memcmp(line, "L1", 2) != 0);
+    lines++;
+  }
+  mu_assert("error, limdedup lines", lines == 1);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogTrim(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circular_FILE file;
+  static char printbuf[256];
+  const char *line;
+  uint32_t i, len, cutoff, oldest, erased, pass, sector;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "TRIM",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, trim init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* A line a minute, wrapped once */
+  for (i = 0; i < 16000; i++) {
+    len = sprintf(printbuf, "%010u Retained line %i\r\n", 1700000000 + i * 60,
+                  i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  for (pass = 0; pass < 2; pass++) {
+    cutoff = 1700000000 + (10000 + pass * 2000) * 60;
+    mu_assert("error, trim",
+              circularTrimBefore(&alt, cutoff) == CIRC_LOG_ERR_NONE);
+    mu_assert("error, trim nothing pending", alt.trimPending > 0);
+    /* Older lines only remain in the sector holding the cutoff */
+    circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+    lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+    mu_assert("error, trim read", lineLen > 0);
+    oldest = strtoul(line, NULL, 10);
+    mu_assert("error, trim too much", oldest < cutoff);
+    mu_assert("error, trim too little",
+              cutoff - oldest <= 60 * (FLASH_SECTOR_SIZE / 30));
+    /* Trimmed sectors stay programmed until maintenance */
+    sector = (alt.LogFlashTailPtr + ALT_LOGS_LENGTH -
+              alt.trimPending * FLASH_SECTOR_SIZE) %
+             ALT_LOGS_LENGTH;
+    mu_assert("error, trim erased early", AltFlash[sector] != FLASH_ERASED);
+    if (pass == 0) {
+      erased = 0;
+      while (alt.trimPending) {
+        circularMaintain(&alt, 4);
+        erased++;
+      }
+      mu_assert("error, trim maintenance", erased > 1);
+      mu_assert("error, trim not erased", AltFlash[sector] == FLASH_ERASED);
+    }
+  }
+  /* The writer erases what maintenance left */
+  for (i = 16000; i < 30000; i++) {
+    len = sprintf(printbuf, "%010u Retained line %i\r\n", 1700000000 + i * 60,
+                  i);
+    mu_assert("error, trim write",
+              circularWriteLog(&alt, (uint8_t *)printbuf, len) == len);
+  }
+  mu_assert("error, trim pending left", alt.trimPending == 0);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, trim last line",
+            (uint32_t)lineLen == len && memcmp(line, printbuf, len) == 0);
+  mu_assert("error, trim reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, trim reinit line",
+            (uint32_t)lineLen == len && memcmp(line, printbuf, len) == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t blockEraseCalls, blockEraseMisaligned;
+
+/* Counts driver erases and checks each is aligned on its own size */
+static uint32_t circFlashEraseBlocks(uint32_t FlashAddress, uint32_t len) {
+  blockEraseCalls++;
+  if ((len & (len - 1)) || FlashAddress % len) {
+    blockEraseMisaligned++;
+  }
+  return circFlashErase(FlashAddress, len);
+}
+
+static const char *test_circLogEraseSizes(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[0x50000 / FLASH_SECTOR_SIZE];
+  static circular_FILE file;
+  static char printbuf[256];
+  const char *line;
+  uint32_t i, len, pending;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "BLOCKS",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashEraseBlocks,
+                    .baseAddress = ALT_LOGS_ADDRESS + 0x3000,
+                    .logsLength = 0x50000,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime,
+                    .geometry = {.sectorSize = FLASH_SECTOR_SIZE,
+                                 .writeSize = FLASH_WRITE_SIZE,
+                                 .eraseSizes = 0x1000 | 0x8000 | 0x10000}};
+  memset(AltFlash, 0, ALT_LOGS_LENGTH);
+  mu_assert("error, blocks init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* 5 sectors up to 32K, one 32K, four 64K, 3 sectors */
+  blockEraseCalls = blockEraseMisaligned = 0;
+  mu_assert("error, blocks clear",
+            circularClearLog(&alt) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, blocks clear calls", blockEraseCalls == 13);
+  mu_assert("error, blocks misaligned", blockEraseMisaligned == 0);
+  for (i = 0; i < 0x50000; i++) {
+    mu_assert("error, blocks not erased",
+              AltFlash[0x3000 + i] == FLASH_ERASED);
+  }
+  mu_assert("error, blocks overrun",
+            AltFlash[0x2FFF] == 0 && AltFlash[0x53000] == 0);
+  for (i = 0; i < 12000; i++) {
+    len = sprintf(printbuf, "%010u Block line %i\r\n", 1700000000 + i * 60, i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  /* Maintenance erases a bulk trim in blocks, not sector by sector */
+  mu_assert("error, blocks trim",
+            circularTrimBefore(&alt, 1700000000 + 11000 * 60) ==
+                CIRC_LOG_ERR_NONE);
+  pending = alt.trimPending;
+  mu_assert("error, blocks trim pending", pending > 32);
+  blockEraseCalls = 0;
+  while (alt.trimPending) {
+    mu_assert("error, blocks maintain",
+              circularMaintain(&alt, 1) == CIRC_LOG_ERR_NONE);
+  }
+  printf("Block erase %u sectors in %u calls\r\n", pending, blockEraseCalls);
+  mu_assert("error, blocks maintain calls", blockEraseCalls < pending / 4);
+  mu_assert("error, blocks misaligned", blockEraseMisaligned == 0);
+  for (i = 12000; i < 20000; i++) {
+    len = sprintf(printbuf, "%010u Block line %i\r\n", 1700000000 + i * 60, i);
+    mu_assert("error, blocks write",
+              circularWriteLog(&alt, (uint8_t *)printbuf, len) == len);
+  }
+  /* Space for a large record is taken from the tail in blocks too */
+  blockEraseCalls = 0;
+  mu_assert("error, blocks large",
+            circularRecordBegin(&alt, 0, 0x30000) == CIRC_LOG_ERR_NONE &&
+                circularRecordEnd(&alt) == CIRC_LOG_ERR_NONE);
+  printf("Block erase large record in %u calls\r\n", blockEraseCalls);
+  mu_assert("error, blocks large calls",
+            blockEraseCalls < 0x30000 / FLASH_SECTOR_SIZE / 2);
+  mu_assert("error, blocks misaligned", blockEraseMisaligned == 0);
+  mu_assert("error, blocks reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, blocks last line",
+            (uint32_t)lineLen == len && memcmp(line, printbuf, len) == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogResume(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circular_FILE file;
+  static char printbuf[64];
+  const char *line;
+  circ_log_pos_t pos, future;
+  uint32_t i, len, lost, sent, next, skipped;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "RESUME",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .sequenced = 1};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, resume init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 1000; i++) {
+    len = sprintf(printbuf, "Upload line %06i\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  /* Send some, save the position */
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  for (i = 0; i < 300; i++) {
+    lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+    mu_assert("error, resume read", lineLen == 20);
+  }
+  sent = strtoul(&line[12], NULL, 10);
+  mu_assert("error, resume tell",
+            circularFileTell(&alt, &file, &pos) == CIRC_LOG_ERR_NONE);
+  for (i = 1000; i < 2000; i++) {
+    len = sprintf(printbuf, "Upload line %06i\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  /* Resumes at the next line, before and after a restart */
+  for (i = 0; i < 2; i++) {
+    mu_assert("error, resume open",
+              circularFileOpenAt(&alt, &pos, &file, &lost) ==
+                  CIRC_LOG_ERR_NONE);
+    mu_assert("error, resume lost", lost == 0);
+    lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+    mu_assert("error, resume line",
+              lineLen == 20 && strtoul(&line[12], NULL, 10) == sent + 1);
+    mu_assert("error, resume reinit",
+              circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  }
+  /* A position ahead of the head is refused */
+  future = pos;
+  future.seq += 1000;
+  mu_assert("error, resume future",
+            circularFileOpenAt(&alt, &future, &file, &lost) ==
+                CIRC_LOG_ERR_API);
+  /* Wrapped past, the loss is counted up to the oldest line */
+  for (i = 2000; i < 40000; i++) {
+    len = sprintf(printbuf, "Upload line %06i\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, resume reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, resume wrapped",
+            circularFileOpenAt(&alt, &pos, &file, &lost) == CIRC_LOG_ERR_NONE);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  next = strtoul(&line[12], NULL, 10);
+  skipped = (next - sent - 1) * 20;
+  printf("Resume lost %u bytes, lines %u to %u\r\n", lost, sent + 1, next - 1);
+  /* Lines plus the sector stamps among them */
+  mu_assert("error, resume lost count",
+            lost >= skipped && (lost - skipped) % 8 == 0 &&
+                lost <= skipped + 8 * (skipped / FLASH_SECTOR_SIZE + 2));
+  /* Positions taken after the wrap still resolve */
+  for (i = 0; i < 50; i++) {
+    circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  }
+  sent = strtoul(&line[12], NULL, 10);
+  circularFileTell(&alt, &file, &pos);
+  mu_assert("error, resume reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  circularFileOpenAt(&alt, &pos, &file, &lost);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  mu_assert("error, resume wrapped line",
+            lost == 0 && strtoul(&line[12], NULL, 10) == sent + 1);
+  /* Plain logs carry no sequence */
+  circularFileOpen(&log, CIRC_FLAGS_OLDEST, &file);
+  mu_assert("error, resume unsequenced",
+            circularFileTell(&log, &file, &pos) == CIRC_LOG_ERR_API);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t poolReadCalls;
+
+static uint32_t circFlashReadCounted(uint32_t FlashAddress, uint8_t *buff,
+                                     uint32_t len) {
+  poolReadCalls++;
+  return circFlashRead(FlashAddress, buff, len);
+}
+
+static const char *test_circLogPool(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t poolBuff[2 * 0x1000];
+  static uint8_t own[256];
+  static char expect[0x10000], got[0x10000];
+  static circular_FILE file, a, b, c;
+  static char printbuf[64];
+  circ_log_pool_t pool = {.buff = poolBuff, .size = 0x1000, .count = 2};
+  const char *line;
+  uint32_t i, len, dir, embeddedCalls;
+  int32_t expectLen, gotLen;
+  circ_log_t alt = {.name = "POOL",
+                    .read = circFlashReadCounted,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff)};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, pool init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 5000; i++) {
+    len = sprintf(printbuf, "Pool line %i\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  /* Pooled scans return what the embedded buffer does, in fewer reads */
+  for (dir = CIRC_DIR_FORWARD; dir <= CIRC_DIR_REVERSE; dir++) {
+    alt.pool = NULL;
+    poolReadCalls = 0;
+    circularFileOpen(&alt, dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST
+                                                   : CIRC_FLAGS_NEWEST,
+                     &file);
+    expectLen = circularFileRead(&alt, &file, expect, sizeof(expect),
+                                 (CIRC_DIR)dir, LINES_READ_ALL, "Pool line 1");
+    embeddedCalls = poolReadCalls;
+    alt.pool = &pool;
+    poolReadCalls = 0;
+    circularFileOpen(&alt, dir == CIRC_DIR_FORWARD ? CIRC_FLAGS_OLDEST
+                                                   : CIRC_FLAGS_NEWEST,
+                     &file);
+    gotLen = circularFileRead(&alt, &file, got, sizeof(got), (CIRC_DIR)dir,
+                              LINES_READ_ALL, "Pool line 1");
+    mu_assert("error, pool read", expectLen > 0 && gotLen == expectLen &&
+                                      memcmp(expect, got, gotLen) == 0);
+    mu_assert("error, pool read calls",
+              dir == CIRC_DIR_FORWARD ? poolReadCalls <= embeddedCalls
+                                      : poolReadCalls < embeddedCalls);
+    mu_assert("error, pool not returned", pool.busy == 0);
+  }
+  /* Line cursors keep theirs until released */
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &a);
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &b);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &c);
+  mu_assert("error, pool line a",
+            circularFileGetLine(&alt, &a, CIRC_DIR_FORWARD, &line) > 0);
+  mu_assert("error, pool line b",
+            circularFileGetLine(&alt, &b, CIRC_DIR_FORWARD, &line) > 0);
+  mu_assert("error, pool exhausted",
+            circularFileGetLine(&alt, &c, CIRC_DIR_REVERSE, &line) ==
+                -CIRC_LOG_ERR_API);
+  circularFileRelease(&alt, &a);
+  gotLen = circularFileGetLine(&alt, &c, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, pool released",
+            gotLen == 16 && memcmp(line, "Pool line 4999\r\n", 16) == 0);
+  /* The caller's buffer needs no pool */
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &a);
+  circularFileSetBuffer(&a, own, sizeof(own));
+  gotLen = circularFileGetLine(&alt, &a, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, pool own buffer",
+            gotLen == 16 && memcmp(line, "Pool line 4999\r\n", 16) == 0);
+  circularFileRelease(&alt, &b);
+  circularFileRelease(&alt, &c);
+  mu_assert("error, pool leak", pool.busy == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *const fmtTable[] = {
+    "Temperature sensor %u reading out of range: %d\r\n",
+    "Motor %u stalled at %d rpm, retry %u of %u",
+    "Valve %02X position %u%%\r\n"};
+
+static const char *test_circLogFormat(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circular_FILE file;
+  static char expect[0x4000], got[0x4000];
+  char text[128];
+  const char *line;
+  uint32_t args[4], i, time, textBytes = 0, expectLen = 0;
+  int32_t len;
+  circ_log_t alt = {.name = "FORMAT",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime,
+                    .formats = fmtTable,
+                    .formatCount = 3};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, format init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 3000; i++) {
+    time = 1700000000 + i;
+    args[0] = i % 7;
+    args[1] = (uint32_t)(i % 5 ? 1500 - (int32_t)i : -(int32_t)i);
+    args[2] = i % 3;
+    args[3] = 3;
+    mu_assert("error, format write",
+              circularWriteLogFormat(&alt, time, 0, i % 3, args, 4) > 0);
+    /* The same line as text with its stamp */
+    if (i % 3 == 0) {
+      len = sprintf(text, "%010u Temperature sensor %u reading out of range: "
+                          "%d\r\n",
+                    time, args[0], (int32_t)args[1]);
+    } else if (i % 3 == 1) {
+      len = sprintf(text, "%010u Motor %u stalled at %d rpm, retry %u of %u"
+                          "\r\n",
+                    time, args[0], (int32_t)args[1], args[2], args[3]);
+    } else {
+      len = sprintf(text, "%010u Valve %02X position %u%%\r\n", time,
+                    args[0], args[1]);
+    }
+    textBytes += len;
+    /* Motor lines, text after the stamp */
+    if (i % 3 == 1 && args[0] == 4 && expectLen + len < sizeof(expect)) {
+      memcpy(&expect[expectLen], &text[11], len - 11);
+      expectLen += len - 11;
+    }
+  }
+  printf("Format %u bytes stored, %u as text\r\n", alt.LogFlashHeadPtr,
+         textBytes);
+  mu_assert("error, format size", (uint32_t)alt.LogFlashHeadPtr * 3 < textBytes);
+  /* Read back expanded, the filter sees the text */
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  len = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_FORWARD, 1000,
+                         "Motor 4 ");
+  mu_assert("error, format read",
+            len == (int32_t)expectLen && memcmp(got, expect, len) == 0);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  len = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_REVERSE, 1,
+                         NULL);
+  got[len] = 0;
+  mu_assert("error, format reverse",
+            strcmp(got, "Valve 03 position 4294965797%\r\n") == 0);
+  /* Lines in place stay coded */
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  len = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE, &line);
+  mu_assert("error, format line", len > 0 && line[0] == CIRC_FMT_MARKER);
+  mu_assert("error, format line text",
+            circularFormatLine(&alt, (const uint8_t *)line, len,
+                               (uint8_t *)text, sizeof(text)) == 31 &&
+                memcmp(text, got, 31) == 0);
+  /* Found by time through the index */
+  len = indexedLogSearch(&alt, got, sizeof(got), 1700000000 + 1000);
+  got[len] = 0;
+  mu_assert("error, format indexed",
+            strcmp(got, "Motor 6 stalled at -1000 rpm, retry 1 of 3\r\n") ==
+                0);
+  /* No table entry */
+  args[0] = 7;
+  args[1] = (uint32_t)-2;
+  circularWriteLogFormat(&alt, 1700009999, 0, 9, args, 2);
+  circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+  len = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_REVERSE, 1,
+                         NULL);
+  got[len] = 0;
+  mu_assert("error, format unknown",
+            strcmp(got, "format 9 7 4294967294\r\n") == 0);
+#if CIRC_LOG_PARALLEL
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  len = circularFileSearch(&alt, &file, got, sizeof(got), "Motor 4 ", 4);
+  mu_assert("error, format search",
+            len == (int32_t)expectLen && memcmp(got, expect, len) == 0);
+#endif
+  /* The newest lines as text, filtered on it */
+  len = circularReadLines(&alt, (uint8_t *)got, sizeof(got), 2, NULL, 0);
+  mu_assert("error, format read lines",
+            strcmp(got, "Valve 03 position 4294965797%\r\n"
+                        "format 9 7 4294967294\r\n") == 0 &&
+                len == (int32_t)strlen(got));
+  len = circularReadLines(&alt, (uint8_t *)got, sizeof(got), 12, "Motor", 0);
+  mu_assert("error, format read lines filter",
+            len > 0 && strncmp(got, "Motor ", 6) == 0 &&
+                strstr(got, "Valve") == NULL);
+  /* Expanded past a short buffer, the oldest text goes */
+  len = circularReadLines(&alt, (uint8_t *)text, 48, 4, NULL, 12);
+  mu_assert("error, format read lines short",
+            len >= 23 && len < 48 &&
+                strcmp(&text[len - 23], "format 9 7 4294967294\r\n") == 0);
+  /* Passing over a large record */
+  memset(expect, 'x', 5000);
+  memcpy(&expect[4998], "\r\n", 2);
+  circularWriteLog(&alt, (uint8_t *)expect, 5000);
+  circularWriteLog(&alt, (uint8_t *)"done\r\n", 6);
+  len = circularReadLines(&alt, (uint8_t *)got, sizeof(got), 3, NULL, 4000);
+  mu_assert("error, format read lines large",
+            strcmp(got, "format 9 7 4294967294\r\ndone\r\n") == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogBatch(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[0x10000 / FLASH_SECTOR_SIZE];
+  static uint8_t image[0x10000];
+  static char body[800];
+  static circ_log_iov_t lines[50];
+  static char text[50][sizeof(body) + 16];
+  char stamp[16], found[64];
+  circ_log_iov_t iov[3];
+  uint32_t pass, i, n, writes[3];
+  int32_t len;
+  circ_log_t alt = {.name = "BATCH",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = 0x10000,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime};
+  memset(body, 'x', sizeof(body));
+  /* The same lines whole, as stamp, body and CRLF, then in batches */
+  for (pass = 0; pass < 3; pass++) {
+    memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+    mu_assert("error, batch init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    writeHitCount = 0;
+    for (i = 0, n = 0; i < 3000; i++) {
+      /* Every 500th body is longer than wBuff */
+      sprintf(stamp, "%010u ", 1700000000 + i);
+      len = i % 500 == 7 ? sizeof(body) : 12 + i % 20;
+      if (pass == 0) {
+        len = sprintf(text[0], "%s%.*s\r\n", stamp, len, body);
+        circularWriteLog(&alt, (uint8_t *)text[0], len);
+      } else if (pass == 1) {
+        iov[0].buf = (uint8_t *)stamp;
+        iov[0].len = 11;
+        iov[1].buf = (uint8_t *)body;
+        iov[1].len = len;
+        iov[2].buf = (uint8_t *)"\r\n";
+        iov[2].len = 2;
+        mu_assert("error, batch vector",
+                  circularWriteLogV(&alt, iov, 3) == (uint32_t)len + 13);
+      } else {
+        lines[n].buf = (uint8_t *)text[n];
+        lines[n].len = sprintf(text[n], "%s%.*s\r\n", stamp, len, body);
+        if (++n == 50) {
+          mu_assert("error, batch write",
+                    circularWriteLogBatch(&alt, lines, n) == n);
+          n = 0;
+        }
+      }
+    }
+    writes[pass] = writeHitCount;
+    if (pass == 0) {
+      memcpy(image, AltFlash, sizeof(image));
+    } else {
+      mu_assert("error, batch image", memcmp(image, AltFlash, sizeof(image)) == 0);
+    }
+    /* Lines are found after a rebuild */
+    mu_assert("error, batch reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    len = indexedLogSearch(&alt, (uint8_t *)found, sizeof(found),
+                           1700000000 + 2990);
+    mu_assert("error, batch search", memcmp(found, "1700002990 xx", 13) == 0);
+  }
+  printf("Batch page programs %u single, %u vector, %u batched\r\n", writes[0],
+         writes[1], writes[2]);
+  mu_assert("error, batch vector writes", writes[1] == writes[0]);
+  mu_assert("error, batch writes", writes[2] * 4 < writes[0]);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const uint8_t *directBuff;
+static uint32_t directLen, directCalls, directBytes;
+
+/* Counts programs, and bytes passed from directBuff itself */
+static uint32_t directWrite(uint32_t FlashAddress, uint8_t *buff,
+                            uint32_t len) {
+  directCalls++;
+  if (buff >= directBuff && buff < directBuff + directLen) {
+    directBytes += len;
+  }
+  return circFlashWrite(FlashAddress, buff, len);
+}
+
+static const char *test_circLogWriteMax(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static uint8_t line[3000];
+  uint32_t i, pass;
+  circ_log_t alt = {.name = "DIRECT",
+                    .read = circFlashRead,
+                    .write = directWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = 0x10000,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff)};
+  for (i = 0; i < sizeof(line) - 2; i++) {
+    line[i] = 'a' + i % 26;
+  }
+  line[i++] = '\r';
+  line[i] = '\n';
+  directBuff = line;
+  directLen = sizeof(line);
+  /* One page per call, then one call for the whole interior */
+  for (pass = 0; pass < 2; pass++) {
+    alt.geometry.writeMax = pass ? 0x1000 : 0;
+    memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+    mu_assert("error, direct init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    circularWriteLog(&alt, (uint8_t *)"Short one\r\n", 11);
+    directCalls = directBytes = 0;
+    mu_assert("error, direct write",
+              circularWriteLog(&alt, line, sizeof(line)) == sizeof(line));
+    /* Head and tail pages staged, 10 whole pages in place */
+    printf("Direct write %u calls, %u bytes in place\r\n", directCalls,
+           directBytes);
+    mu_assert("error, direct bytes", directBytes == 10 * FLASH_WRITE_SIZE);
+    mu_assert("error, direct calls", directCalls == (pass ? 3 : 12));
+    mu_assert("error, direct line",
+              memcmp(&AltFlash[11], line, sizeof(line)) == 0);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t printStamp;
+
+static uint32_t printPrefix(char *buff, uint32_t len) {
+  return snprintf(buff, len, "%010u ", printStamp);
+}
+
+static const char *test_circLogPrintf(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 4];
+  static circ_log_index_t altIndex[0x10000 / FLASH_SECTOR_SIZE];
+  static uint8_t image[0x10000];
+  static char body[2000], text[sizeof(body) + 16];
+  circ_log_dedup_t dedup;
+  uint32_t pass, i, n, writes[2];
+  int32_t len;
+  circ_log_t alt = {.name = "PRINTF",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = 0x10000,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime,
+                    .dedup = &dedup,
+                    .sequenced = 1,
+                    .printPrefix = printPrefix};
+  memset(body, 'p', sizeof(body));
+  /* The same lines from a buffer, then formatted in place */
+  for (pass = 0; pass < 2; pass++) {
+    memset(&dedup, 0, sizeof(dedup));
+    dedup.skip = 11;
+    memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+    mu_assert("error, printf init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    writeHitCount = 0;
+    for (i = 0; i < 3000; i++) {
+      printStamp = 1700000000 + i;
+      /* Runs of repeats, and lines over several pages */
+      n = i % 50 < 3 ? i - i % 50 : i;
+      len = i % 200 == 7 ? 700 : i % 20;
+      if (pass == 0) {
+        len = sprintf(text, "%010u Printf line %u %.*s\r\n", printStamp, n, len,
+                      body);
+        mu_assert("error, printf text",
+                  circularWriteLog(&alt, (uint8_t *)text, len) == (uint32_t)len);
+      } else {
+        mu_assert("error, printf write",
+                  circularPrintf(&alt, "Printf line %u %.*s\r\n", n, len,
+                                 body) == 27 + (uint32_t)len + (n > 9) +
+                                              (n > 99) + (n > 999));
+      }
+    }
+    writes[pass] = writeHitCount;
+    if (pass == 0) {
+      memcpy(image, AltFlash, sizeof(image));
+    } else {
+      mu_assert("error, printf image",
+                memcmp(image, AltFlash, sizeof(image)) == 0);
+    }
+  }
+  printf("Printf page programs %u written, %u formatted\r\n", writes[0],
+         writes[1]);
+  mu_assert("error, printf writes", writes[1] <= writes[0]);
+  /* Lines longer than wBuff are cut to it */
+  len = circularPrintf(&alt, "Printf long %s\r\n", body);
+  mu_assert("error, printf long", len > 0 && len < (int32_t)sizeof(altBuff));
+  circularReadLines(&alt, (uint8_t *)text, sizeof(text), 1, NULL, 0);
+  mu_assert("error, printf cut", text[strlen(text) - 1] == '\n');
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+/* Reads every record from the oldest, the large ones joined from chunks
+ * into large, return : large records seen holding the start of expect */
+static uint32_t largeReadAll(circ_log_t *alt, circular_FILE *file,
+                             char *large, const char *expect) {
+  char chunk[300];
+  int32_t len;
+  uint32_t left, count = 0, at = 0;
+  circularFileOpen(alt, CIRC_FLAGS_OLDEST, file);
+  while ((len = circularFileReadRecord(alt, file, chunk, sizeof(chunk),
+                                       &left)) > 0) {
+    if (left || at) {
+      memcpy(&large[at], chunk, len);
+      at += len;
+    }
+    if (at && !left) {
+      count += memcmp(large, expect, at) == 0;
+      at = 0;
+    }
+  }
+  return count;
+}
+
+static const char *test_circLogLarge(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t altIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circular_FILE file;
+  static char trace[0xA000], got[0xA000], printbuf[64];
+  const char *line;
+  uint32_t i, len, traceLen = 0, start, end, head, tail, stamp;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "LARGE",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .index = altIndex,
+                    .parseTime = parseTime,
+                    .sequenced = 1};
+  for (i = 0; traceLen < sizeof(trace) - 64; i++) {
+    traceLen += sprintf(&trace[traceLen], "  frame %05u at 0x%08X\r\n", i,
+                        0x08000000 + i * 52);
+  }
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, large init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* Wrapped, then a trace streamed in small pieces */
+  for (stamp = 1000000; stamp < 1030000; stamp++) {
+    len = sprintf(printbuf, "%u status ok\r\n", stamp);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  start = alt.LogFlashHeadPtr;
+  mu_assert("error, large begin",
+            circularRecordBegin(&alt, 5, traceLen) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, large locked", mutexCount == 1);
+  /* Erased ahead of the payload */
+  for (i = 0; i < traceLen; i++) {
+    if (AltFlash[(start + 64 + i) % ALT_LOGS_LENGTH] != FLASH_ERASED) {
+      break;
+    }
+  }
+  mu_assert("error, large erased ahead", i == traceLen);
+  for (i = 0; i < traceLen; i += len) {
+    len = traceLen - i < 97 ? traceLen - i : 97;
+    mu_assert("error, large write",
+              circularRecordWrite(&alt, (uint8_t *)&trace[i], len) == len);
+  }
+  mu_assert("error, large end", circularRecordEnd(&alt) == CIRC_LOG_ERR_NONE);
+  end = alt.LogFlashHeadPtr;
+  printf("Large record 0x%X bytes from 0x%X to 0x%X\r\n", traceLen, start,
+         end);
+  /* Longer than a sector through circularWriteLog, stored whole */
+  mu_assert("error, large write log",
+            circularWriteLog(&alt, (uint8_t *)trace, 6000) == 6000);
+  for (; stamp < 1031000; stamp++) {
+    len = sprintf(printbuf, "%u status ok\r\n", stamp);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  head = alt.LogFlashHeadPtr;
+  tail = alt.LogFlashTailPtr;
+  for (i = 0; i < 2; i++) {
+    /* Back in chunks, '\n' restored */
+    mu_assert("error, large records",
+              largeReadAll(&alt, &file, got, trace) == 2);
+    /* Line readers pass over them both ways */
+    circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+    lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+    len = strtoul(line, NULL, 10);
+    while ((lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD,
+                                          &line)) > 0) {
+      mu_assert("error, large forward line",
+                strtoul(line, NULL, 10) == ++len);
+    }
+    mu_assert("error, large forward end", len == stamp - 1);
+    while ((lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_REVERSE,
+                                          &line)) > 0) {
+      mu_assert("error, large reverse line", strtoul(line, NULL, 10) == len--);
+    }
+    mu_assert("error, large reverse end", len < 1030000 - 1000);
+    circularFileOpen(&alt, CIRC_FLAGS_NEWEST, &file);
+    lineLen = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_REVERSE,
+                               2000, NULL);
+    len = sprintf(printbuf, "%u status ok\r\n", 1029000);
+    mu_assert("error, large read back",
+              lineLen == 2000 * (int32_t)len &&
+                  memcmp(&got[lineLen - len], printbuf, len) == 0);
+    circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+    lineLen = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_FORWARD,
+                               100000, "1029999");
+    mu_assert("error, large read forward",
+              lineLen == (int32_t)len && memcmp(got, "1029999", 7) == 0);
+    /* Index past the trace, then the same after a restart */
+    mu_assert("error, large search",
+              indexedLogSearch(&alt, got, sizeof(got), 1030000) == len &&
+                  memcmp(got, "1030000", 7) == 0);
+    mu_assert("error, large reinit",
+              circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    mu_assert("error, large head tail",
+              alt.LogFlashHeadPtr == (int32_t)head &&
+                  alt.LogFlashTailPtr == (int32_t)tail);
+  }
+  /* The tail inside the trace, files open past it */
+  while (!((uint32_t)alt.LogFlashTailPtr > start &&
+           (uint32_t)alt.LogFlashTailPtr < end)) {
+    len = sprintf(printbuf, "%u status ok\r\n", stamp++);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, large reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  mu_assert("error, large torn tail",
+            lineLen > 0 && strtoul(line, NULL, 10) == 1030000);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+/* Large records hold any byte values, both ways they are written */
+static const char *test_circLogLargeBinary(void) {
+  static const uint32_t cuts[] = {0x3000, 0x1000, 0x1000 - 3, 100};
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circular_FILE file;
+  static char dump[0x3000], got[0x3000], printbuf[64];
+  const char *line;
+  uint32_t i, len, head, tail, cut, seek, left, text;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "BINARY",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff)};
+  for (i = 0; i < sizeof(dump); i++) {
+    dump[i] = (char)(i + i / 256);
+  }
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, binary init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  /* Nothing to write to or end before Begin */
+  mu_assert("error, binary no record",
+            circularRecordWrite(&alt, (uint8_t *)dump, 16) == 0 &&
+                circularRecordEnd(&alt) == CIRC_LOG_ERR_API &&
+                alt.LogFlashHeadPtr == 0 && mutexCount == 0);
+  /* Files open past the oldest line */
+  circularWriteLog(&alt, (uint8_t *)"first\r\n", 7);
+  mu_assert("error, binary write log",
+            circularWriteLog(&alt, (uint8_t *)dump, sizeof(dump)) ==
+                sizeof(dump));
+  circularWriteLog(&alt, (uint8_t *)"second\r\n", 8);
+  mu_assert("error, binary begin",
+            circularRecordBegin(&alt, 3, sizeof(dump)) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < sizeof(dump); i += len) {
+    len = sizeof(dump) - i < 77 ? sizeof(dump) - i : 77;
+    mu_assert("error, binary record write",
+              circularRecordWrite(&alt, (uint8_t *)&dump[i], len) == len);
+  }
+  mu_assert("error, binary end", circularRecordEnd(&alt) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, binary end twice",
+            circularRecordEnd(&alt) == CIRC_LOG_ERR_API);
+  circularWriteLog(&alt, (uint8_t *)"third\r\n", 7);
+  head = alt.LogFlashHeadPtr;
+  tail = alt.LogFlashTailPtr;
+  mu_assert("error, binary reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, binary head tail",
+            alt.LogFlashHeadPtr == (int32_t)head &&
+                alt.LogFlashTailPtr == (int32_t)tail);
+  /* Every byte value back, escapes split across chunks */
+  mu_assert("error, binary records",
+            largeReadAll(&alt, &file, got, dump) == 2);
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  for (i = 0; (lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD,
+                                             &line)) > 0;
+       i++) {
+    len = sprintf(printbuf, "%.*s", (int)lineLen - 2, line);
+    mu_assert("error, binary lines",
+              strcmp(printbuf, i ? "third" : "second") == 0);
+  }
+  mu_assert("error, binary line count", i == 2);
+  /* Byte ranges pass over both records, whatever bytes they cut */
+  for (cut = 0; cut < sizeof(cuts) / sizeof(cuts[0]); cut++) {
+    seek = text = 0;
+    do {
+      len = circularReadLogPartial(&alt, (uint8_t *)got, seek, cuts[cut],
+                                   &left);
+      mu_assert("error, binary range text", text + len < sizeof(printbuf));
+      memcpy(&printbuf[text], got, len);
+      text += len;
+      seek += cuts[cut];
+    } while (left);
+    mu_assert("error, binary range",
+              text == 22 &&
+                  memcmp(printbuf, "first\r\nsecond\r\nthird\r\n", 22) == 0);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t followWakes;
+
+static void followWake(void) { followWakes++; }
+
+static const char *test_circLogFollow(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circular_FILE file, oldest;
+  static char printbuf[64], got[0x1000];
+  static circ_log_iov_t batch[10];
+  static char batchText[10][32];
+  const char *line, *first;
+  uint32_t i, len;
+  int32_t lineLen;
+  circ_log_t alt = {.name = "FOLLOW",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = 0x10000,
+                    .wBuff = altBuff,
+                    .wBuffLen = sizeof(altBuff),
+                    .onAppend = followWake};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, follow init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 100; i++) {
+    len = sprintf(printbuf, "Follow line %06u\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, follow wakes", followWakes == 100);
+  mu_assert("error, follow open",
+            circularFileOpen(&alt, CIRC_FLAGS_FOLLOW, &file) ==
+                CIRC_LOG_ERR_NONE);
+  /* Idle polls read nothing from flash */
+  readHitCount = 0;
+  for (i = 0; i < 1000; i++) {
+    mu_assert("error, follow idle",
+              circularFileRead(&alt, &file, got, sizeof(got),
+                               CIRC_DIR_FORWARD, 100, NULL) == 0 &&
+                  circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD,
+                                      &line) == 0);
+  }
+  mu_assert("error, follow idle reads", readHitCount == 0);
+  /* Only what was written since, each write one wake */
+  followWakes = 0;
+  for (; i < 1003; i++) {
+    len = sprintf(printbuf, "Follow line %06u\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  mu_assert("error, follow wake each", followWakes == 3);
+  lineLen = circularFileRead(&alt, &file, got, sizeof(got), CIRC_DIR_FORWARD,
+                             100, NULL);
+  mu_assert("error, follow new",
+            lineLen == 3 * (int32_t)len &&
+                memcmp(got, "Follow line 001000", 18) == 0 &&
+                memcmp(&got[2 * len], printbuf, len) == 0);
+  for (i = 0; i < 10; i++) {
+    batch[i].len = sprintf(batchText[i], "Follow batch %02u\r\n", i);
+    batch[i].buf = (uint8_t *)batchText[i];
+  }
+  circularWriteLogBatch(&alt, batch, 10);
+  mu_assert("error, follow batch wake", followWakes == 4);
+  for (i = 0; i < 10; i++) {
+    lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+    mu_assert("error, follow batch line",
+              lineLen == (int32_t)batch[i].len &&
+                  memcmp(line, batchText[i], lineLen) == 0);
+  }
+  mu_assert("error, follow batch end",
+            circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line) == 0);
+  /* Overrun by the writer, goes on from the oldest line */
+  for (i = 0; i < 10000; i++) {
+    len = sprintf(printbuf, "Follow line %06u\r\n", i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &oldest);
+  circularFileGetLine(&alt, &oldest, CIRC_DIR_FORWARD, &first);
+  lineLen = circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  mu_assert("error, follow overrun",
+            lineLen == (int32_t)len && memcmp(line, first, len) == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static uint32_t plainReads, readvCalls;
+
+static uint32_t readCounted(uint32_t addr, uint8_t *buff, uint32_t len) {
+  plainReads++;
+  return circFlashRead(addr, buff, len);
+}
+
+static uint32_t readvCounted(const circ_log_seg_t *seg, uint32_t count) {
+  uint32_t i, total = 0;
+  readvCalls++;
+  for (i = 0; i < count; i++) {
+    total += circFlashRead(seg[i].addr, seg[i].buff, seg[i].len);
+  }
+  return total;
+}
+
+static const char *test_circLogReadv(void) {
+  static uint8_t plainBuff[FLASH_WRITE_SIZE * 2], vBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t plainIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circ_log_index_t vIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static char printbuf[64], a[0x3000], b[0x3000];
+  static circular_FILE fa, fb;
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2], vRead[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t i, len, stamp, plainIO, vIO;
+  int32_t lenA, lenB;
+  circ_log_t plain = {.name = "PLAIN",
+                      .read = readCounted,
+                      .write = circFlashWrite,
+                      .erase = circFlashErase,
+                      .baseAddress = ALT_LOGS_ADDRESS,
+                      .logsLength = ALT_LOGS_LENGTH,
+                      .wBuff = plainBuff,
+                      .index = plainIndex,
+                      .parseTime = parseTime,
+                      .wBuffLen = sizeof(plainBuff)};
+  circ_log_t vlog = plain;
+  vlog.name = "READV";
+  vlog.readv = readvCounted;
+  vlog.wBuff = vBuff;
+  vlog.index = vIndex;
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, readv init", circularLogInit(&plain) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 15000; i++) {
+    len = sprintf(printbuf, "%010u Readv line %u %u\r\n", 1668175200 + i * 60,
+                  i, rand() & 0x7FFF);
+    circularWriteLog(&plain, (uint8_t *)printbuf, len);
+  }
+  /* Same image, each sector probe batch and index batch one call */
+  plainReads = 0;
+  mu_assert("error, readv plain reinit",
+            circularLogInit(&plain) == CIRC_LOG_ERR_NONE);
+  plainIO = plainReads;
+  plainReads = readvCalls = 0;
+  mu_assert("error, readv reinit", circularLogInit(&vlog) == CIRC_LOG_ERR_NONE);
+  vIO = plainReads + readvCalls;
+  printf("Init read calls plain %u readv %u\r\n", plainIO, vIO);
+  mu_assert("error, readv pointers",
+            vlog.LogFlashHeadPtr == plain.LogFlashHeadPtr &&
+                vlog.LogFlashTailPtr == plain.LogFlashTailPtr &&
+                vlog.LogFlashTailPtr > vlog.LogFlashHeadPtr);
+  /* The head sweep is unchanged, the ~75 live slots take a third the calls */
+  mu_assert("error, readv init calls", vIO + 40 < plainIO);
+  for (i = 15000 - 1; i >= 8000; i -= 17) {
+    stamp = 1668175200 + i * 60;
+    len = indexedLogSearch(&plain, Read, sizeof(Read), stamp);
+    mu_assert("error, readv search",
+              len && indexedLogSearch(&vlog, vRead, sizeof(vRead), stamp) ==
+                         len &&
+                  memcmp(Read, vRead, len) == 0);
+  }
+  /* Whole log in big reads, across the physical end */
+  readvCalls = 0;
+  circularFileOpen(&plain, CIRC_FLAGS_OLDEST, &fa);
+  circularFileOpen(&vlog, CIRC_FLAGS_OLDEST, &fb);
+  do {
+    lenA = circularFileRead(&plain, &fa, a, sizeof(a), CIRC_DIR_FORWARD,
+                            1000, NULL);
+    lenB = circularFileRead(&vlog, &fb, b, sizeof(b), CIRC_DIR_FORWARD, 1000,
+                            NULL);
+    mu_assert("error, readv wrapped read",
+              lenA == lenB && memcmp(a, b, lenA > 0 ? lenA : 0) == 0);
+  } while (lenA > 0);
+  mu_assert("error, readv wrapped call", readvCalls > 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogWarmBoot(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_index_t retainedIndex[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circ_log_cindex_t
+      retainedGroups[CIRC_CINDEX_GROUPS(ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE)];
+  static circ_log_hint_t retained;
+  static circ_log_sector_stat_t stats[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static char printbuf[64];
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t i, len, stamp, trimmed, hist[4];
+  int32_t head, tail;
+  circ_log_t cold = {.name = "WARM",
+                     .read = circFlashRead,
+                     .write = circFlashWrite,
+                     .erase = circFlashErase,
+                     .baseAddress = ALT_LOGS_ADDRESS,
+                     .logsLength = ALT_LOGS_LENGTH,
+                     .wBuff = altBuff,
+                     .index = retainedIndex,
+                     .parseTime = parseTime,
+                     .wBuffLen = sizeof(altBuff),
+                     .sectorStats = stats};
+  circ_log_t alt = cold;
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  /* Power on, the retained RAM is garbage */
+  memset(&retained, 0x5A, sizeof(retained));
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, warm init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 15000; i++) {
+    len = sprintf(printbuf, "%010u Warm line %u\r\n", 1668175200 + i * 60, i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  /* Soft reset, RAM state lost but for the retained hint and index, both
+   * reused after three one byte reads */
+  head = alt.LogFlashHeadPtr;
+  tail = alt.LogFlashTailPtr;
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  readHitCount = 0;
+  mu_assert("error, warm reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  mu_assert("error, warm reads", readHitCount == 3);
+  mu_assert("error, warm pointers",
+            alt.LogFlashHeadPtr == head && alt.LogFlashTailPtr == tail &&
+                tail > head);
+  stamp = 1668175200 + 14000 * 60;
+  sprintf(printbuf, "%010u", stamp);
+  len = indexedLogSearch(&alt, Read, sizeof(Read), stamp);
+  mu_assert("error, warm search", len && memcmp(Read, printbuf, 10) == 0);
+  /* Line counts built on first use, a line written before that in them */
+  memset(stats, 0x5A, sizeof(stats));
+  len = sprintf(printbuf, "%010u Warm line %u\r\n", 1668175200 + 15000 * 60,
+                15000);
+  circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  mu_assert("error, warm histogram",
+            circularHistogram(&alt, 1668175200 + 14970 * 60, 600, hist, 4, 0) ==
+                    CIRC_LOG_ERR_NONE &&
+                hist[0] == 10 && hist[1] == 10 && hist[2] == 10 &&
+                hist[3] == 1 && readHitCount > 3);
+  sprintf(printbuf, "%010u", stamp);
+  /* A trim survives, its sectors still pending erase */
+  circularTrimBefore(&alt, 1668175200 + 9000 * 60);
+  trimmed = alt.trimPending;
+  tail = alt.LogFlashTailPtr;
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  readHitCount = 0;
+  circularLogInit(&alt);
+  mu_assert("error, warm trim",
+            trimmed && alt.trimPending == trimmed &&
+                alt.LogFlashTailPtr == tail && readHitCount == 3);
+  /* A changed index is rebuilt */
+  retainedIndex[3].time ^= 1;
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  readHitCount = 0;
+  circularLogInit(&alt);
+  mu_assert("error, warm index rebuilt",
+            readHitCount > 3 &&
+                indexedLogSearch(&alt, Read, sizeof(Read), stamp) == len &&
+                memcmp(Read, printbuf, 10) == 0);
+  /* Lines written without the hint, it no longer agrees with the flash */
+  circularLogInit(&cold);
+  for (i = 0; i < 100; i++) {
+    len = sprintf(printbuf, "%010u Warm line %u\r\n", 1668175200 + i * 60, i);
+    circularWriteLog(&cold, (uint8_t *)printbuf, len);
+  }
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  mu_assert("error, stale hint", circularLogInit(&alt) == CIRC_LOG_ERR_NONE &&
+                                     alt.LogFlashHeadPtr ==
+                                         cold.LogFlashHeadPtr &&
+                                     alt.LogFlashTailPtr ==
+                                         cold.LogFlashTailPtr);
+  /* A damaged hint falls back to the scan */
+  retained.head ^= 0x10;
+  head = alt.LogFlashHeadPtr;
+  readHitCount = 0;
+  mu_assert("error, bad hint", circularLogInit(&alt) == CIRC_LOG_ERR_NONE &&
+                                   alt.LogFlashHeadPtr == head &&
+                                   readHitCount > 3);
+  /* A retained compact index, its check kept up by the writes */
+  cold.index = NULL;
+  cold.compactIndex = retainedGroups;
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  circularLogInit(&alt);
+  for (i = 15000; i < 17000; i++) {
+    len = sprintf(printbuf, "%010u Warm line %u\r\n", 1668175200 + i * 60, i);
+    circularWriteLog(&alt, (uint8_t *)printbuf, len);
+  }
+  memcpy(&alt, &cold, sizeof(alt));
+  alt.hint = &retained;
+  alt.hintIndex = 1;
+  readHitCount = 0;
+  circularLogInit(&alt);
+  stamp = 1668175200 + 16000 * 60;
+  sprintf(printbuf, "%010u", stamp);
+  mu_assert("error, warm compact",
+            readHitCount == 3 &&
+                indexedLogSearch(&alt, Read, sizeof(Read), stamp) &&
+                memcmp(Read, printbuf, 10) == 0);
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogHistogram(void) {
+  static uint8_t altBuff[FLASH_WRITE_SIZE * 2];
+  static circ_log_sector_stat_t stats[ALT_LOGS_LENGTH / FLASH_SECTOR_SIZE];
+  static circular_FILE file;
+  static char printbuf[64];
+  uint32_t exact[20], approx[20], want[20], tagged[20], wantTagged[20];
+  uint32_t i, b, len, first, start, pass, io;
+  const char *line;
+  circ_log_t alt = {.name = "HIST",
+                    .read = circFlashRead,
+                    .write = circFlashWrite,
+                    .erase = circFlashErase,
+                    .baseAddress = ALT_LOGS_ADDRESS,
+                    .logsLength = ALT_LOGS_LENGTH,
+                    .wBuff = altBuff,
+                    .parseTime = parseTime,
+                    .wBuffLen = sizeof(altBuff),
+                    .sectorStats = stats,
+                    .statTags = CIRC_TAG_BIT(2)};
+  memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+  mu_assert("error, hist init", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  for (i = 0; i < 20000; i++) {
+    len = sprintf(printbuf, "%010u Hist line %06u\r\n", 1668175200 + i * 7, i);
+    if (i % 13 == 0) {
+      circularWriteLogTagged(&alt, 2, (uint8_t *)printbuf, len);
+    } else {
+      circularWriteLog(&alt, (uint8_t *)printbuf, len);
+    }
+  }
+  /* Hourly buckets from well past the oldest line */
+  circularFileOpen(&alt, CIRC_FLAGS_OLDEST, &file);
+  circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  circularFileGetLine(&alt, &file, CIRC_DIR_FORWARD, &line);
+  first = (strtoul(line, NULL, 10) - 1668175200) / 7;
+  start = 1668175200 + (first + 300) * 7;
+  memset(want, 0, sizeof(want));
+  memset(wantTagged, 0, sizeof(wantTagged));
+  for (i = first + 300; i < 20000; i++) {
+    b = (i * 7 - (first + 300) * 7) / 3600;
+    if (b < 20) {
+      want[b]++;
+      wantTagged[b] += i % 13 == 0;
+    }
+  }
+  /* Live counts, then ones rebuilt at init */
+  for (pass = 0; pass < 2; pass++) {
+    readHitCount = 0;
+    mu_assert("error, hist approx",
+              circularHistogram(&alt, start, 3600, approx, 20, 0) ==
+                  CIRC_LOG_ERR_NONE &&
+                  readHitCount == 0);
+    readHitCount = 0;
+    circularHistogram(&alt, start, 3600, exact, 20, CIRC_HIST_EXACT);
+    io = readHitCount;
+    circularHistogram(&alt, start, 3600, tagged, 20,
+                      CIRC_HIST_EXACT | CIRC_HIST_MATCHED);
+    for (b = 0; b < 20; b++) {
+      mu_assert("error, hist exact", exact[b] == want[b]);
+      mu_assert("error, hist tagged", tagged[b] == wantTagged[b]);
+      mu_assert("error, hist spread", approx[b] + FLASH_SECTOR_SIZE / 28 >=
+                                              want[b] &&
+                                          approx[b] <=
+                                              want[b] + FLASH_SECTOR_SIZE / 28);
+    }
+    /* Bucket edges and the range ends, not the log */
+    mu_assert("error, hist IO",
+              io <= 22 * (FLASH_SECTOR_SIZE + 1 + CIRC_REC_MAX_HEADER +
+                          FLASH_MAX_DATE_LEN));
+    printf("Histogram %u buckets read %u bytes of %u\r\n", 20, io,
+           ALT_LOGS_LENGTH);
+    mu_assert("error, hist reinit", circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
+static const char *test_circLogGeometry(void) {
+  static const struct {
+    uint32_t sectorSize;
+    uint32_t writeSize;
+  } geo[] = {{0x800, 0x80}, {0x1000, 0x100}, {0x10000, 0x100}, {0xC00, 0x100}};
+  static uint8_t altBuff[0x200];
+  static circ_log_index_t altIndex[ALT_LOGS_LENGTH / 0x800];
+  static char printbuf[256];
+  uint8_t Read[LINE_ESTIMATE_FACTOR * 2];
+  uint32_t g, i, len, stamp;
+  clock_t start;
+  for (g = 0; g < sizeof(geo) / sizeof(geo[0]); g++) {
+    circ_log_t alt = {.name = "ALT",
+                      .read = circFlashRead,
+                      .write = circFlashWrite,
+                      .erase = circFlashErase,
+                      .baseAddress = ALT_LOGS_ADDRESS,
+                      .logsLength = ALT_LOGS_LENGTH,
+                      .wBuff = altBuff,
+                      .index = altIndex,
+                      .parseTime = parseTime,
+                      .wBuffLen = geo[g].writeSize * 2,
+                      .geometry = {.sectorSize = geo[g].sectorSize,
+                                   .writeSize = geo[g].writeSize}};
+    memset(AltFlash, FLASH_ERASED, ALT_LOGS_LENGTH);
+    mu_assert("error, geometry init",
+              circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    writeHitCount = 0;
+    start = clock();
+    for (i = 0; i < 20000; i++) {
+      len = sprintf(printbuf, "%010i Geometry line %i\r\n",
+                    1668175200 + (i * 60), i);
+      circularWriteLog(&alt, (uint8_t *)printbuf, len);
+    }
+    circularReadLines(&alt, Read, sizeof(Read), 1, NULL, 0);
+    mu_assert("error, geometry last line",
+              memcmp(Read, printbuf, len) == 0);
+    /* Rebuild from flash and search */
+    mu_assert("error, geometry reinit",
+              circularLogInit(&alt) == CIRC_LOG_ERR_NONE);
+    stamp = 1668175200 + (19000 * 60);
+    readHitCount = 0;
+    len = indexedLogSearch(&alt, Read, sizeof(Read), stamp);
+    sprintf(printbuf, "%010i", stamp);
+    mu_assert("error, geometry search", memcmp(Read, printbuf, 10) == 0);
+    printf("Geometry metrics @ sector 0x%X page 0x%X = Writes(%i) "
+           "SearchIO(%i) %ims\r\n",
+           geo[g].sectorSize, geo[g].writeSize, writeHitCount, readHitCount,
+           (int)((clock() - start) * 1000 / CLOCKS_PER_SEC));
+  }
+  mu_assert("error, mutex count", mutexCount == 0);
+  return NULL;
+}
+
 static const char *all_tests() {
   mu_run_test(test_circLogInit);
   mu_run_test(test_newLogTest);
@@ -375,13 +2550,42 @@ static const char *all_tests() {
   mu_run_test(test_circLogFileTime);
   mu_run_test(test_circLogSearchHang);
   mu_run_test(test_newInitial);
+  mu_run_test(test_circLogGetLine);
+  mu_run_test(test_circLogGeometry);
+  mu_run_test(test_circLogStamped);
+  mu_run_test(test_circLogIndexGranularity);
+  mu_run_test(test_circLogCompactIndex);
+  mu_run_test(test_circLogFlashIndex);
+  mu_run_test(test_circLogBloom);
+  mu_run_test(test_circLogTags);
+#if CIRC_LOG_PARALLEL
+  mu_run_test(test_circLogParallel);
+#endif
+  mu_run_test(test_circLogDedup);
+  mu_run_test(test_circLogRateLimit);
+  mu_run_test(test_circLogLimitDedup);
+  mu_run_test(test_circLogTrim);
+  mu_run_test(test_circLogEraseSizes);
+  mu_run_test(test_circLogResume);
+  mu_run_test(test_circLogPool);
+  mu_run_test(test_circLogFormat);
+  mu_run_test(test_circLogBatch);
+  mu_run_test(test_circLogWriteMax);
+  mu_run_test(test_circLogPrintf);
+  mu_run_test(test_circLogLarge);
+  mu_run_test(test_circLogLargeBinary);
+  mu_run_test(test_circLogFollow);
+  mu_run_test(test_circLogReadv);
+  mu_run_test(test_circLogWarmBoot);
+  mu_run_test(test_circLogHistogram);
   return NULL;
 }
 
 int main(int argc, char *argv[]) {
 
   FakeFlash = (unsigned char *)malloc(FLASH_LOGS_LENGTH);
-  if (FakeFlash == NULL) {
+  AltFlash = (unsigned char *)malloc(ALT_LOGS_LENGTH);
+  if (FakeFlash == NULL || AltFlash == NULL) {
     return -1;
   }
 
@@ -0,0 +1,164 @@
+/**
+ * Tests for the C++ wrapper, src/circularflash.hpp
+ *
+ * Build from the repository root
+ *   gcc -O2 -I. -c src/circularflash.c -o circularflash.o
+ *   g++ -std=c++17 -O2 -I. mainHpp.cpp circularflash.o -lpthread
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "minunit.h"
+#include "src/circularflash.hpp"
+
+int tests_run = 0;
+int mutexCount = 0;
+
+void assertHandler(char *file, int line) {
+  printf("CIRCULAR_LOG_ASSERT(%s:%i\r\n", file, line);
+  exit(1);
+}
+
+namespace {
+
+constexpr uint32_t kBase = 0x200000;
+constexpr uint32_t kLength = 0x20000;
+constexpr int kLines = 500;
+std::vector<uint8_t> flash(kLength, FLASH_ERASED);
+
+struct RamFlash {
+  static uint32_t read(uint32_t addr, uint8_t *buff, uint32_t len) {
+    memcpy(buff, &flash[addr - kBase], len);
+    return len;
+  }
+  static uint32_t write(uint32_t addr, uint8_t *buff, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+      flash[addr - kBase + i] &= buff[i];
+    }
+    return len;
+  }
+  static uint32_t erase(uint32_t addr, uint32_t len) {
+    memset(&flash[addr - kBase], FLASH_ERASED, len);
+    return len;
+  }
+};
+
+using Log = circular::CircularLog<circular::Geometry<0x1000, 0x100>, RamFlash>;
+
+int lineNumber(std::string_view line) {
+  if (line.size() < 6 || line.substr(0, 5) != "Line " ||
+      line.back() != '\n') {
+    return -1;
+  }
+  return atoi(std::string(line.substr(5)).c_str());
+}
+
+const char *test_hppOpenFail() {
+  /* Never initialised, the open fails before the file is touched */
+  Log log("HPP", kBase, kLength);
+  uint8_t buff[64];
+  {
+    auto cur = log.open(CIRC_FLAGS_OLDEST);
+    mu_assert("error, open before init", !cur);
+    mu_assert("error, open error", cur.error() == CIRC_LOG_ERR_INIT);
+    auto range = cur.lines();
+    mu_assert("error, failed range", range.begin() == range.end());
+    auto back = cur.reverseLines();
+    mu_assert("error, failed reverse", back.begin() == back.end());
+    mu_assert("error, failed read",
+              cur.read(buff, CIRC_DIR_FORWARD, 1, nullptr) <= 0);
+  }
+  /* Released without ever being opened */
+  mu_assert("error, failed release", mutexCount == 0);
+  return 0;
+}
+
+const char *test_hppEmpty() {
+  std::fill(flash.begin(), flash.end(), FLASH_ERASED);
+  Log log("HPP", kBase, kLength);
+  mu_assert("error, empty init", log.init() == CIRC_LOG_ERR_NONE);
+  {
+    auto cur = log.open(CIRC_FLAGS_OLDEST);
+    mu_assert("error, empty open", cur && cur.error() == CIRC_LOG_ERR_NONE);
+    auto range = cur.lines();
+    mu_assert("error, empty forward", range.begin() == range.end());
+  }
+  {
+    auto cur = log.open(CIRC_FLAGS_NEWEST);
+    mu_assert("error, empty open newest", cur);
+    auto back = cur.reverseLines();
+    mu_assert("error, empty reverse", back.begin() == back.end());
+  }
+  mu_assert("error, empty mutex", mutexCount == 0);
+  return 0;
+}
+
+const char *test_hppIterate() {
+  std::fill(flash.begin(), flash.end(), FLASH_ERASED);
+  Log log("HPP", kBase, kLength);
+  char line[32];
+  mu_assert("error, iterate init", log.init() == CIRC_LOG_ERR_NONE);
+  /* Opening at the oldest skips the first line */
+  log.write(std::string_view("Skipped\r\n"));
+  for (int i = 0; i < kLines; i++) {
+    int len = snprintf(line, sizeof(line), "Line %i\r\n", i);
+    mu_assert("error, iterate write",
+              log.write(std::string_view(line, len)) == (uint32_t)len);
+  }
+
+  int expect = 0;
+  {
+    auto cur = log.open(CIRC_FLAGS_OLDEST);
+    mu_assert("error, forward open", cur);
+    for (std::string_view got : cur.lines()) {
+      mu_assert("error, forward line", lineNumber(got) == expect);
+      expect++;
+    }
+  }
+  mu_assert("error, forward count", expect == kLines);
+
+  expect = kLines - 1;
+  {
+    auto cur = log.open(CIRC_FLAGS_NEWEST);
+    mu_assert("error, reverse open", cur);
+    for (std::string_view got : cur.reverseLines()) {
+      mu_assert("error, reverse line", lineNumber(got) == expect);
+      expect--;
+    }
+  }
+  /* Walking back stops at the same oldest line */
+  mu_assert("error, reverse count", expect == -1);
+
+  /* An iterator past the end stays at the end */
+  {
+    auto cur = log.open(CIRC_FLAGS_NEWEST);
+    auto range = cur.lines();
+    mu_assert("error, newest forward", range.begin() == range.end());
+  }
+  mu_assert("error, iterate mutex", mutexCount == 0);
+  return 0;
+}
+
+const char *all_tests() {
+  mu_run_test(test_hppOpenFail);
+  mu_run_test(test_hppEmpty);
+  mu_run_test(test_hppIterate);
+  return 0;
+}
+
+} // namespace
+
+int main() {
+  const char *result = all_tests();
+  if (result != 0) {
+    printf("%s\r\n", result);
+  } else {
+    printf("ALL TESTS PASSED\r\n");
+  }
+  printf("Tests run: %d\r\n", tests_run);
+  return result != 0;
+}
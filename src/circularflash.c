@@ -23,14 +23,98 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include "circularFlashConfig.h"
 #include "circularflash.h"
 #include <stdlib.h>
+#if CIRC_LOG_PARALLEL
+#include <pthread.h>
+#endif
 
 #define FILE_MAGIC_MARKER 0xA1B2C3D4
 
+/* Geometry access, constants unless CIRC_LOG_RUNTIME_GEOMETRY */
+#if CIRC_LOG_RUNTIME_GEOMETRY
+#define SECTOR_SIZE(log) ((log)->geometry.sectorSize)
+#define WRITE_SIZE(log) ((log)->geometry.writeSize)
+#define LINE_ESTIMATE(log) ((log)->geometry.lineEstimate)
+#define SECTOR_OF(log, x)                                                      \
+  ((log)->geometry.sectorShift ? (uint32_t)(x) >> (log)->geometry.sectorShift  \
+                               : (uint32_t)(x) / SECTOR_SIZE(log))
+#define SECTOR_OFFSET(log, x)                                                  \
+  ((log)->geometry.sectorShift ? (uint32_t)(x) & (SECTOR_SIZE(log) - 1)        \
+                               : (uint32_t)(x) % SECTOR_SIZE(log))
+#define WRITE_OF(log, x)                                                       \
+  ((log)->geometry.writeShift ? (uint32_t)(x) >> (log)->geometry.writeShift    \
+                              : (uint32_t)(x) / WRITE_SIZE(log))
+#define WRITE_OFFSET(log, x)                                                   \
+  ((log)->geometry.writeShift ? (uint32_t)(x) & (WRITE_SIZE(log) - 1)          \
+                              : (uint32_t)(x) % WRITE_SIZE(log))
+#else
+#define SECTOR_SIZE(log) FLASH_SECTOR_SIZE
+#define WRITE_SIZE(log) FLASH_WRITE_SIZE
+#define LINE_ESTIMATE(log) LINE_ESTIMATE_FACTOR
+#define SECTOR_OF(log, x) ((uint32_t)(x) / FLASH_SECTOR_SIZE)
+#define SECTOR_OFFSET(log, x) ((uint32_t)(x) % FLASH_SECTOR_SIZE)
+#define WRITE_OF(log, x) ((uint32_t)(x) / FLASH_WRITE_SIZE)
+#define WRITE_OFFSET(log, x) ((uint32_t)(x) % FLASH_WRITE_SIZE)
+#endif
+#define SECTOR_COUNT(log) SECTOR_OF(log, (log)->logsLength)
+#if CIRC_LOG_RUNTIME_GEOMETRY
+#define ERASE_SIZES(log) ((log)->geometry.eraseSizes)
+#define WRITE_MAX(log) ((log)->geometry.writeMax)
+#else
+#define ERASE_SIZES(log) FLASH_ERASE_SIZES
+#define WRITE_MAX(log) (FLASH_WRITE_MAX ? FLASH_WRITE_MAX : FLASH_WRITE_SIZE)
+#endif
+
+/* Index slots, indexGranularity bytes each */
+#define INDEX_SLOT_SIZE(log) ((log)->indexGranularity)
+#define INDEX_SLOT_OF(log, x)                                                  \
+  ((log)->indexShift ? (uint32_t)(x) >> (log)->indexShift                      \
+                     : (uint32_t)(x) / INDEX_SLOT_SIZE(log))
+#define INDEX_SLOTS(log) INDEX_SLOT_OF(log, (log)->logsLength)
+
+#define RECORD_NO_TIME 0xFFFFFFFF
+#define RECORD_FIELD_LEN 6
+
+/* Largest erase of ERASE_SIZES aligned at addr within len, at least a
+ * sector */
+static uint32_t eraseSize(circ_log_t *log, uint32_t addr, uint32_t len) {
+  uint32_t size, best = SECTOR_SIZE(log), sizes = ERASE_SIZES(log);
+#if !CIRC_LOG_RUNTIME_GEOMETRY
+  (void)log;
+#endif
+  while (sizes) {
+    size = sizes & (0 - sizes);
+    sizes &= sizes - 1;
+    if (size > best && size <= len && addr % size == 0) {
+      best = size;
+    }
+  }
+  return best;
+}
+
+/* Erases whole sectors at addr, in the largest aligned blocks. Without
+ * ERASE_SIZES the range goes to the driver in one call */
+static uint32_t eraseRange(circ_log_t *log, uint32_t addr, uint32_t len) {
+  uint32_t size;
+  if (!ERASE_SIZES(log)) {
+    return log->erase(addr, len) == len ? CIRC_LOG_ERR_NONE : CIRC_LOG_ERR_IO;
+  }
+  while (len) {
+    size = eraseSize(log, addr, len);
+    if (log->erase(addr, size) != size) {
+      return CIRC_LOG_ERR_IO;
+    }
+    addr += size;
+    len -= size;
+  }
+  return CIRC_LOG_ERR_NONE;
+}
+
 static int32_t calculateErasedSpace(circ_log_t * log) {
   if (log->LogFlashTailPtr == 0 && log->LogFlashHeadPtr == 0) {
     return log->logsLength; // Never written, new flash
@@ -38,12 +122,14 @@ static int32_t calculateErasedSpace(circ_log_t * log) {
     FLASH_DEBUG("FLASH: (%s) Log corrupted\r\n", log->name);
     return 0;
   } else if (log->LogFlashHeadPtr > log->LogFlashTailPtr) {
-    //     FlashLength     - (used space)
-    return log->logsLength - (log->LogFlashHeadPtr - log->LogFlashTailPtr);
+    //     FlashLength     - (used space)  - trimmed, not yet erased
+    return log->logsLength - (log->LogFlashHeadPtr - log->LogFlashTailPtr) -
+           log->trimPending * SECTOR_SIZE(log);
   } else if (log->LogFlashHeadPtr < log->LogFlashTailPtr) {
     //       Wrapped
     //     FlashLength     - (  Used               + (     used                             ))
-    return log->logsLength - (log->LogFlashHeadPtr + (log->logsLength - log->LogFlashTailPtr));
+    return log->logsLength - (log->LogFlashHeadPtr + (log->logsLength - log->LogFlashTailPtr)) -
+           log->trimPending * SECTOR_SIZE(log);
   } else {
     FLASH_DEBUG("FLASH: (%s) Log corrupted\r\n", log->name);
     return 0;
@@ -66,719 +152,4226 @@ static int32_t calculateSpace(circ_log_t *log, int32_t tailPtr, int32_t headPtr)
   }
 }
 
-static void findFirstLine(circ_log_t *log, circ_log_index_t *index,
-                          uint32_t sector) {
-  uint32_t res, i, j;
-  for (i = 0; i < (FLASH_SECTOR_SIZE - FLASH_WRITE_SIZE);
-       i += FLASH_WRITE_SIZE) {
-    res = log->read(log->baseAddress + (sector * FLASH_SECTOR_SIZE), log->wBuff,
-                    FLASH_WRITE_SIZE + FLASH_MAX_DATE_LEN);
-    if (res != FLASH_WRITE_SIZE + FLASH_MAX_DATE_LEN) {
-      return;
-    }
-    for (j = 0; j < res - FLASH_MAX_DATE_LEN; j++) {
-      if (log->wBuff[j] == '\n') {
-        index->time = log->parseTime((const char *)&log->wBuff[j + 1]);
-        index->firstLine = j + 1;
-        return;
-      }
-    }
+/* Record header field, 6 bits per byte in 0x80..0xBF */
+static uint32_t recordFieldDecode(const uint8_t *p) {
+  uint32_t i, v = 0;
+  for (i = 0; i < RECORD_FIELD_LEN; i++) {
+    v = (v << 6) | (p[i] & 0x3F);
   }
+  return v;
 }
 
-static void buildIndex(circ_log_t *log) {
+static void recordFieldEncode(uint8_t *p, uint32_t v) {
   int32_t i;
-  memset(log->index, 0xFF,
-         log->logsLength / FLASH_SECTOR_SIZE * sizeof(circ_log_index_t));
-  // Loop through open buffers reading
-  for (i = 0; i < (int32_t)log->logsLength / FLASH_SECTOR_SIZE; i++) {
-    if (log->LogFlashHeadPtr > log->LogFlashTailPtr) {
-      /* Normal */
-      if (i * FLASH_SECTOR_SIZE >= log->LogFlashTailPtr &&
-          i * FLASH_SECTOR_SIZE < log->LogFlashHeadPtr) {
-        findFirstLine(log, &log->index[i], i);
-      }
-    } else {
-      /* Wrapped */
-      if (i * FLASH_SECTOR_SIZE >= log->LogFlashTailPtr ||
-          i * FLASH_SECTOR_SIZE < log->LogFlashHeadPtr) {
-        findFirstLine(log, &log->index[i], i);
-      }
+  for (i = RECORD_FIELD_LEN - 1; i >= 0; i--) {
+    p[i] = 0x80 | (v & 0x3F);
+    v >>= 6;
+  }
+}
+
+static uint32_t recordHeaderEncode(uint8_t *hdr, uint8_t flags, uint32_t time,
+                                   uint32_t seq, uint32_t total, uint8_t tag) {
+  uint32_t len = 2;
+  hdr[0] = CIRC_REC_MARKER;
+  hdr[1] = 0x80 | flags;
+  if (flags & CIRC_REC_TIME) {
+    recordFieldEncode(&hdr[len], time);
+    len += RECORD_FIELD_LEN;
+  }
+  if (flags & CIRC_REC_SEQ) {
+    recordFieldEncode(&hdr[len], seq);
+    len += RECORD_FIELD_LEN;
+  }
+  if (flags & CIRC_REC_LEN) {
+    recordFieldEncode(&hdr[len], total);
+    len += RECORD_FIELD_LEN;
+  }
+  if (flags & CIRC_REC_TAG) {
+    hdr[len++] = 0x80 | tag;
+  }
+  return len;
+}
+
+/* return : header length, 0 if the line has no (complete) header */
+static uint32_t recordHeaderLen(const uint8_t *line, uint32_t avail) {
+  uint32_t i, len = 2;
+  if (avail < 2 || line[0] != CIRC_REC_MARKER || (line[1] & 0xC0) != 0x80) {
+    return 0;
+  }
+  if (line[1] & CIRC_REC_TIME) {
+    len += RECORD_FIELD_LEN;
+  }
+  if (line[1] & CIRC_REC_SEQ) {
+    len += RECORD_FIELD_LEN;
+  }
+  if (line[1] & CIRC_REC_LEN) {
+    len += RECORD_FIELD_LEN;
+  }
+  if (line[1] & CIRC_REC_TAG) {
+    len++;
+  }
+  if (len > avail) {
+    return 0;
+  }
+  for (i = 2; i < len; i++) {
+    if ((line[i] & 0xC0) != 0x80) {
+      return 0;
     }
   }
+  return len;
 }
 
-static int32_t calculateLogSpace(circ_log_t *log) {
-  return calculateSpace(log, log->LogFlashTailPtr, log->LogFlashHeadPtr);
+/* Stamp from the record header, else parseTime, else RECORD_NO_TIME */
+static uint32_t recordTime(circ_log_t *log, const uint8_t *line,
+                           uint32_t avail) {
+  uint32_t hdrLen = recordHeaderLen(line, avail);
+  if (hdrLen && (line[1] & CIRC_REC_LEN)) {
+    /* Large records are not indexed */
+    return RECORD_NO_TIME;
+  }
+  if (hdrLen && (line[1] & CIRC_REC_TIME)) {
+    return recordFieldDecode(&line[2]);
+  }
+  if (log->parseTime) {
+    return log->parseTime((const char *)&line[hdrLen]);
+  }
+  return RECORD_NO_TIME;
 }
 
-/* This function inserts, assuming that writing 1's won't change anything*/
-static uint32_t circFlashInsertWrite(circ_log_t *log, uint32_t FlashAddress,
-                                     unsigned char *buff, uint32_t len) {
-  uint32_t i, rem, end, begin, WriteLen, res;
-  rem = FlashAddress % FLASH_WRITE_SIZE;
-  begin = FlashAddress - rem;
-  end = FlashAddress + len; // Extend up to boundary
-  if (end % FLASH_WRITE_SIZE) {
-    WriteLen = (((end - begin) / FLASH_WRITE_SIZE) + 1) * FLASH_WRITE_SIZE;
-  } else {
-    WriteLen = (((end - begin) / FLASH_WRITE_SIZE)) * FLASH_WRITE_SIZE;
-  }
-  if (WriteLen > log->wBuffLen) {
-    uint32_t startLen = len;
-    if (rem) {
-      memset(log->wBuff, FLASH_ERASED, FLASH_WRITE_SIZE);
-      memcpy(&log->wBuff[rem], buff, FLASH_WRITE_SIZE - rem);
-      res = log->write(begin, log->wBuff, FLASH_WRITE_SIZE);
-      if (res != FLASH_WRITE_SIZE) {
-        return 0;
-      }
-      len -= (FLASH_WRITE_SIZE - rem);
-      buff += (FLASH_WRITE_SIZE - rem);
-      begin += FLASH_WRITE_SIZE;
-      WriteLen -= FLASH_WRITE_SIZE;
-    }
-    // Send the rest
-    for (i = 0; i < WriteLen; i += FLASH_WRITE_SIZE) {
-      memset(log->wBuff, FLASH_ERASED, FLASH_WRITE_SIZE);
-      memcpy(log->wBuff, &buff[i],
-             len > FLASH_WRITE_SIZE ? FLASH_WRITE_SIZE : len);
-      res = log->write(begin + i, log->wBuff, FLASH_WRITE_SIZE);
-      if (res != FLASH_WRITE_SIZE) {
-        return 0;
-      }
-      len -= FLASH_WRITE_SIZE;
+/* Tag bit of a line with header length hdrLen, untagged lines are tag 0 */
+static uint32_t recordTagBit(const uint8_t *line, uint32_t hdrLen) {
+  if (hdrLen && (line[1] & CIRC_REC_TAG)) {
+    return CIRC_TAG_BIT(line[hdrLen - 1] & (CIRC_TAG_COUNT - 1));
+  }
+  return CIRC_TAG_BIT(0);
+}
+
+/* Whole length of a large record from its header, 0 for other lines */
+static uint32_t recordLargeLen(const uint8_t *line, uint32_t hdrLen) {
+  if (!hdrLen || !(line[1] & CIRC_REC_LEN)) {
+    return 0;
+  }
+  return recordFieldDecode(&line[hdrLen - RECORD_FIELD_LEN -
+                                 ((line[1] & CIRC_REC_TAG) ? 1 : 0)]);
+}
+
+/* Whole length of the large record ending in foot, 0 if it is no footer */
+static uint32_t recordFooterLen(const uint8_t *foot) {
+  uint32_t i;
+  if (foot[0] != CIRC_REC_END || foot[CIRC_REC_FOOTER - 1] != '\n') {
+    return 0;
+  }
+  for (i = 1; i <= RECORD_FIELD_LEN; i++) {
+    if ((foot[i] & 0xC0) != 0x80) {
+      return 0;
     }
-    return startLen;
-  } else {
-    memset(log->wBuff, FLASH_ERASED, WriteLen);
-    memcpy(&log->wBuff[rem], buff, len);
-    res = log->write(begin, log->wBuff, WriteLen);
-    return res == WriteLen ? len : 0;
   }
+  return recordFieldDecode(&foot[1]);
 }
 
+/* Where a byte range starts, for stripRecordHeaders */
+#define STRIP_LINE 0  /* At a line start */
+#define STRIP_TEXT 1  /* Inside a text line */
+#define STRIP_LARGE 2 /* Inside a large record */
+
 /*
- * param log : log file
- * param buff : data buffer
- * param tailPtr : pinned tail
- * param headPtr : pinned head
- * param seek : postion from start of file
- * param space : total size of file
- * param desiredLen : read length
- * param remaining : updated to remaining in file
+ * Removes record headers and large records from a byte range in place.
+ * lead bytes of a header begun before the range go first, a header the
+ * range end cuts goes with the rest, return : new length
  */
-static uint32_t circularReadSection(circ_log_t *log, uint8_t *buff,
-                                    int32_t tailPtr, int32_t headPtr,
-                                    uint32_t seek, int32_t space,
-                                    uint32_t desiredlen, uint32_t *remaining) {
-  uint32_t ret = 0;
-  uint32_t res, firstlen, secondlen;
-  if (space > 0 && desiredlen > 0) {
-    if (headPtr > tailPtr) {
-      res = log->read(log->baseAddress + tailPtr + seek, buff,
-                      desiredlen);
-      if (res != desiredlen) {
-        FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
-        ret = 0;
-        *remaining = 0;
-        goto badexit;
+static uint32_t stripRecordHeaders(uint8_t *buff, uint32_t len, uint32_t lead,
+                                   uint8_t state) {
+  uint32_t in = lead < len ? lead : len, out = 0, hdrLen;
+  uint8_t keep = state != STRIP_LARGE, start = state == STRIP_LINE;
+  while (in < len) {
+    if (start) {
+      hdrLen = recordHeaderLen(&buff[in], len - in);
+      if (hdrLen == 0 && buff[in] == CIRC_REC_MARKER &&
+          memchr(&buff[in], '\n', len - in) == NULL) {
+        break;
       }
-      *remaining = (space - seek - desiredlen);
-      ret = desiredlen;
-    } else if (headPtr < tailPtr) {
-      // See which part the caller wants
-      firstlen = log->logsLength - tailPtr;
-      if (seek > firstlen) {
-        // The upper half of the request
-        res = log->read(log->baseAddress + (seek - firstlen), buff, desiredlen);
-        if (res != desiredlen) {
-          FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
-          ret = 0;
-          *remaining = 0;
-          goto badexit;
-        }
-        ret = desiredlen;
-        *remaining = (space - seek - desiredlen);
-      } else {
-        // Lower half first from end of address space
-        if (seek + desiredlen + tailPtr > log->logsLength) {
-          secondlen = log->logsLength - (tailPtr + seek);
-          if (secondlen > 0) {
-            res = log->read(log->baseAddress + tailPtr + seek, buff, secondlen);
-            if (res != secondlen) {
-              FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
-              ret = 0;
-              *remaining = 0;
-              goto badexit;
-            }
-          }
-          res = log->read(log->baseAddress, &buff[secondlen],
-                          desiredlen - secondlen);
-          if (res != desiredlen - secondlen) {
-            FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
-            ret = 0;
-            *remaining = 0;
-            goto badexit;
-          }
-          ret = desiredlen;
-          *remaining = (space - seek - desiredlen);
-        } else {
-          res = log->read(log->baseAddress + tailPtr + seek, buff,
-                          desiredlen);
-          if (res != desiredlen) {
-            FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
-          }
-          ret = res;
-          *remaining = (space - seek - desiredlen);
-        }
+      /* Line readers pass over large records, byte reads too */
+      keep = recordLargeLen(&buff[in], hdrLen) == 0;
+      in += hdrLen;
+    }
+    start = 1;
+    while (in < len) {
+      uint8_t c = buff[in++];
+      if (keep) {
+        buff[out++] = c;
+      }
+      if (c == '\n') {
+        break;
       }
     }
-  } else {
-    ret = 0;
-    *remaining = 0;
   }
-badexit:
-  return ret;
+  return out;
 }
 
-/**
-* seek = Bytes from start of log
+/*
+ * Formatted records, a body of CIRC_FMT_MARKER then the format id and the
+ * arguments. Values are zigzag coded so small negatives stay short, then go
+ * 5 bits per byte in 0x80..0xBF, low bits first, with FMT_MORE set on all
+ * but the last
  */
-uint32_t circularReadLogPartial(circ_log_t *log, uint8_t *buff,
-                               uint32_t seek, uint32_t desiredlen,
-                               uint32_t *remaining) {
-  CIRCULAR_LOG_ASSERT(log != NULL);
-  CIRCULAR_LOG_ASSERT(buff != NULL);
-  uint32_t ret = 0;
-  if (!log->circLogInit) {
-    return 0;
+#define FMT_MORE 0x20
+#define FMT_MAX_VALUE 7
+
+static uint32_t fmtPut(uint8_t *p, uint32_t v) {
+  uint32_t len = 0;
+  v = (v << 1) ^ (uint32_t)((int32_t)v >> 31);
+  while (v >= FMT_MORE) {
+    p[len++] = 0x80 | FMT_MORE | (v & (FMT_MORE - 1));
+    v >>= 5;
   }
-  FLASH_MUTEX_ENTER(log->osMutex);
-  int32_t space = calculateLogSpace(log);
-  if (desiredlen > (space - seek)) {
-    desiredlen = (space - seek);
+  p[len++] = 0x80 | v;
+  return len;
+}
+
+/* return : 0 at the end of the values */
+static uint32_t fmtGet(const uint8_t *body, uint32_t len, uint32_t *pos,
+                       uint32_t *v) {
+  uint32_t shift = 0;
+  *v = 0;
+  while (*pos < len && (body[*pos] & 0xC0) == 0x80 && shift < 35) {
+    *v |= (uint32_t)(body[*pos] & (FMT_MORE - 1)) << shift;
+    shift += 5;
+    if (!(body[(*pos)++] & FMT_MORE)) {
+      *v = (*v >> 1) ^ (0 - (*v & 1));
+      return 1;
+    }
   }
-  ret =
-      circularReadSection(log, buff, log->LogFlashTailPtr, log->LogFlashHeadPtr,
-                          seek, space, desiredlen, remaining);
-  FLASH_MUTEX_EXIT(log->osMutex);
-  return ret;
+  return 0;
 }
 
-uint32_t circularFileOpen(circ_log_t *log, CIRC_FLAGS flags,
-                          circular_FILE *file) {
-  CIRCULAR_LOG_ASSERT(log != NULL);
-  if (!log->circLogInit) {
-    return CIRC_LOG_ERR_INIT;
+/* One byte of fmtText output, counted past avail */
+static char fmtChar(uint8_t *out, uint32_t avail, uint32_t *n, char c) {
+  if (*n < avail) {
+    out[*n] = c;
   }
-  FLASH_MUTEX_ENTER(log->osMutex);
-  file->headPtr = log->LogFlashHeadPtr;
-  file->tailPtr = log->LogFlashTailPtr;
-  file->flags = flags;
-  /* Forward one sector if low space remaining */
-  int32_t EraseSpace = calculateErasedSpace(log);
-  uint32_t ret = 0;
-  uint32_t i, remaining;
-  if (EraseSpace < ((FLASH_SECTOR_SIZE * 2) + (FLASH_SECTOR_SIZE / 2))) {
-    file->tailPtr += FLASH_SECTOR_SIZE;
+  (*n)++;
+  return c;
+}
+
+/* Expands a formatted body with log->formats, writing up to avail bytes.
+ * Integer conversions only, %s and floats print '?'.
+ * return : full text length */
+static uint32_t fmtText(circ_log_t *log, const uint8_t *body, uint32_t len,
+                        uint8_t *out, uint32_t avail) {
+  uint32_t args[CIRC_FMT_MAX_ARGS], id, count = 0, pos = 1, n = 0, arg = 0;
+  uint32_t i, specLen;
+  char spec[16], piece[48], last = 0;
+  const char *f = NULL, *p;
+  if (fmtGet(body, len, &pos, &id) && id < log->formatCount) {
+    f = log->formats[id];
   }
-  int32_t space = calculateSpace(log, file->tailPtr, file->headPtr);
-  FLASH_MUTEX_EXIT(log->osMutex);
-  switch (flags) {
-  default:
-  case CIRC_FLAGS_NEWEST:
-    file->seekPos = space;
-    break;
-  case CIRC_FLAGS_OLDEST:
-    /* Align with first line */
-    ret = circularReadSection(log, file->wBuff, file->tailPtr, file->headPtr, 0,
-                              space, SEARCH_BUFF_SIZE, &remaining);
-    for (i = 0; i < ret; i++) {
-      if (file->wBuff[i] == '\n') {
-        file->seekPos = i + 1;
+  while (count < CIRC_FMT_MAX_ARGS && fmtGet(body, len, &pos, &args[count])) {
+    count++;
+  }
+  if (f == NULL) {
+    /* No table entry, the raw values */
+    snprintf(piece, sizeof(piece), "format %u", (unsigned)id);
+    for (i = 0;; i++) {
+      for (p = piece; *p; p++) {
+        last = fmtChar(out, avail, &n, *p);
+      }
+      if (i == count) {
         break;
       }
+      snprintf(piece, sizeof(piece), " %u", (unsigned)args[i]);
     }
-    if (file->seekPos == (uint32_t)space) {
-      file->seekPos = 0;
+  }
+  while (f != NULL && *f) {
+    if (*f != '%' || f[1] == '%') {
+      last = fmtChar(out, avail, &n, *f);
+      f += *f == '%' ? 2 : 1;
+      continue;
     }
-    break;
+    /* Flags and width, length modifiers dropped */
+    specLen = 0;
+    spec[specLen++] = *f++;
+    while (*f && strchr("-+ #0123456789", *f) && specLen < sizeof(spec) - 2) {
+      spec[specLen++] = *f++;
+    }
+    while (*f == 'l' || *f == 'h' || *f == 'z') {
+      f++;
+    }
+    if (!*f) {
+      break;
+    }
+    spec[specLen++] = *f;
+    spec[specLen] = 0;
+    i = arg < count ? args[arg] : 0;
+    arg++;
+    if (strchr("di", *f)) {
+      snprintf(piece, sizeof(piece), spec, (int)i);
+    } else if (strchr("uxXoc", *f)) {
+      snprintf(piece, sizeof(piece), spec, (unsigned)i);
+    } else {
+      snprintf(piece, sizeof(piece), "?");
+    }
+    for (p = piece; *p; p++) {
+      last = fmtChar(out, avail, &n, *p);
+    }
+    f++;
   }
-  
-  file->valid = FILE_MAGIC_MARKER;
-  return CIRC_LOG_ERR_NONE;
+  /* Lines end as text lines do */
+  if (last != '\n') {
+    last = fmtChar(out, avail, &n, '\r');
+    last = fmtChar(out, avail, &n, '\n');
+  }
+  return n;
 }
 
-static int32_t readForward(circ_log_t* log, circular_FILE* file, void* buff,
-                            uint32_t buffLen, int32_t lines, char * filter) {
-  int32_t ret = 0;
-  int32_t totalRet = 0;
-  uint32_t filtered = 0;
-  int32_t space;
-  int32_t i;
-  uint32_t remaining;
-  uint32_t filterLen = filter == NULL ? 0 : strlen(filter);
-  space = calculateSpace(log, file->tailPtr, file->headPtr);
-  /* Set seek to position */
-  if ((uint32_t)space == file->seekPos) {
-    return 0;
+/*
+ * Copies a line body to out as text unless its start differs from filter.
+ * param outLen : set to the bytes copied
+ * return : 1 copied, 0 filtered out, -1 matching but out of room
+ */
+static int32_t lineEmit(circ_log_t *log, const uint8_t *body, uint32_t len,
+                        const char *filter, uint32_t filterLen, uint8_t *out,
+                        uint32_t avail, uint32_t *outLen) {
+  uint32_t n;
+  if (body[0] != CIRC_FMT_MARKER) {
+    if (filter != NULL && memcmp(body, filter, filterLen) != 0) {
+      return 0;
+    }
+    if (len > avail) {
+      return -1;
+    }
+    memmove(out, body, len);
+    *outLen = len;
+    return 1;
+  }
+  n = fmtText(log, body, len, out, avail);
+  if (filter != NULL) {
+    if ((n < avail ? n : avail) < filterLen) {
+      return n < filterLen ? 0 : -1;
+    }
+    if (memcmp(out, filter, filterLen) != 0) {
+      return 0;
+    }
+  }
+  if (n > avail) {
+    return -1;
   }
+  *outLen = n;
+  return 1;
+}
 
-  if (LINES_READ_ALL == lines) {
-    if ((space - file->seekPos) < buffLen) {
-      buffLen = space - file->seekPos;
-      if (!buffLen) {
-        return 0;
+/*
+ * Replaces the whole lines at buff with their text in place, formats
+ * expanded and large records dropped. The lines move to the end of size
+ * first, the oldest text goes when expanding leaves no room
+ * return : new length
+ */
+static uint32_t linesEmit(circ_log_t *log, uint8_t *buff, uint32_t len,
+                          uint32_t size) {
+  uint32_t in = size - len, out = 0, end, hdrLen, room, n;
+  uint8_t *nl;
+  memmove(&buff[in], buff, len);
+  for (; in < size; in = end) {
+    nl = memchr(&buff[in], '\n', size - in);
+    end = nl ? (uint32_t)(nl - buff) + 1 : size;
+    hdrLen = recordHeaderLen(&buff[in], end - in);
+    if (recordLargeLen(&buff[in], hdrLen)) {
+      continue;
+    }
+    /* Formats expand ahead of their body, text moves down over its own */
+    room = buff[in + hdrLen] == CIRC_FMT_MARKER ? in + hdrLen : end;
+    while (lineEmit(log, &buff[in + hdrLen], end - in - hdrLen, NULL, 0,
+                    &buff[out], room - out, &n) < 0) {
+      if (!out) {
+        /* Longer than the buffer alone */
+        n = 0;
+        break;
       }
+      nl = memchr(buff, '\n', out);
+      n = nl ? (uint32_t)(nl - buff) + 1 : out;
+      memmove(buff, &buff[n], out - n);
+      out -= n;
     }
-    ret = circularReadSection(log, (uint8_t *)buff, file->tailPtr, file->headPtr,
-        file->seekPos, space, buffLen, &remaining);
-    file->seekPos += ret;
-    return ret;
-  } else {
-    /* Read forward by line count, always staying line aligned */
-    while (lines) {
+    out += n;
+  }
+  return out;
+}
 
-      ret = circularReadSection(log, file->wBuff, file->tailPtr, file->headPtr,
-                                file->seekPos, space, SEARCH_BUFF_SIZE,
-                                &remaining);
-      if (ret == 0) {
-        goto shortExit;
-      }
-      uint8_t *line = file->wBuff;
-      for (i = 0; i < ret; i++) {
-        if (file->wBuff[i] == '\n') {
+/*
+ * Index accessors, flat circ_log_index_t array or compact groups
+ */
+#define RAM_INDEX(log) ((log)->index != NULL || (log)->compactIndex != NULL)
+#define INDEX_ENABLED(log) (RAM_INDEX(log) || (log)->flashIndex != NULL)
+#define CINDEX_EMPTY 0xFFFFFFFF
+#define CINDEX_LINE_BITS 12
+#define CINDEX_LINE_MASK ((1UL << CINDEX_LINE_BITS) - 1)
+/* Largest delta, one below all ones so a slot never reads as empty */
+#define CINDEX_MAX_DELTA ((CINDEX_EMPTY >> CINDEX_LINE_BITS) - 1)
+#define HINT_HASH_BASIS 2166136261UL /* FNV-1a */
+
+static uint32_t hintHash(uint32_t hash, const void *data, uint32_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (len--) {
+    hash = (hash ^ *p++) * 16777619UL;
+  }
+  return hash;
+}
+
+/* Warm boot check of one RAM index unit, an entry or a compact group. The
+ * hint keeps their sum, so a change costs one unit rather than the index */
+static uint32_t hintUnitSum(circ_log_t *log, uint32_t unit) {
+  uint32_t hash = hintHash(HINT_HASH_BASIS, &unit, sizeof(unit));
+  if (log->index) {
+    return hintHash(hash, &log->index[unit], sizeof(circ_log_index_t));
+  }
+  return hintHash(hash, &log->compactIndex[unit], sizeof(circ_log_cindex_t));
+}
+
+/* Takes the units holding count slots from slot out of indexSum, or with
+ * add puts them back */
+static void hintIndexUnits(circ_log_t *log, uint32_t slot, uint32_t count,
+                           uint8_t add) {
+  uint32_t unit, end;
+  if (log->hint == NULL || !log->hintIndex) {
+    return;
+  }
+  unit = log->index ? slot : slot / CIRC_CINDEX_GROUP;
+  end = log->index ? slot + count
+                   : (slot + count + CIRC_CINDEX_GROUP - 1) / CIRC_CINDEX_GROUP;
+  for (; unit < end; unit++) {
+    if (add) {
+      log->indexSum += hintUnitSum(log, unit);
+    } else {
+      log->indexSum -= hintUnitSum(log, unit);
+    }
+  }
+}
+
+static uint32_t indexTime(circ_log_t *log, uint32_t slot) {
+  if (log->index) {
+    return log->index[slot].time;
+  }
+  circ_log_cindex_t *g = &log->compactIndex[slot / CIRC_CINDEX_GROUP];
+  uint32_t v = g->slot[slot % CIRC_CINDEX_GROUP];
+  return v == CINDEX_EMPTY ? RECORD_NO_TIME : g->base + (v >> CINDEX_LINE_BITS);
+}
+
+static uint32_t indexFirstLine(circ_log_t *log, uint32_t slot) {
+  if (log->index) {
+    return log->index[slot].firstLine;
+  }
+  return log->compactIndex[slot / CIRC_CINDEX_GROUP]
+             .slot[slot % CIRC_CINDEX_GROUP] &
+         CINDEX_LINE_MASK;
+}
+
+/* Moves a group base, dropping entries that no longer fit */
+static void cindexRebase(circ_log_cindex_t *g, uint32_t base) {
+  uint32_t i, t;
+  for (i = 0; i < CIRC_CINDEX_GROUP; i++) {
+    if (g->slot[i] == CINDEX_EMPTY) {
+      continue;
+    }
+    t = g->base + (g->slot[i] >> CINDEX_LINE_BITS);
+    if (t < base || t - base > CINDEX_MAX_DELTA) {
+      g->slot[i] = CINDEX_EMPTY;
+    } else {
+      g->slot[i] = ((t - base) << CINDEX_LINE_BITS) |
+                   (g->slot[i] & CINDEX_LINE_MASK);
+    }
+  }
+  g->base = base;
+}
+
+static void cindexSet(circ_log_cindex_t *g, uint32_t slot, uint32_t time,
+                      uint32_t firstLine) {
+  uint32_t i;
+  for (i = 0; i < CIRC_CINDEX_GROUP; i++) {
+    if (g->slot[i] != CINDEX_EMPTY) {
+      break;
+    }
+  }
+  if (i == CIRC_CINDEX_GROUP) {
+    g->base = time;
+  } else if (time < g->base) {
+    cindexRebase(g, time);
+  } else if (time - g->base > CINDEX_MAX_DELTA) {
+    cindexRebase(g, time - CINDEX_MAX_DELTA);
+  }
+  g->slot[slot % CIRC_CINDEX_GROUP] =
+      ((time - g->base) << CINDEX_LINE_BITS) | firstLine;
+}
+
+static void indexSet(circ_log_t *log, uint32_t slot, uint32_t time,
+                     uint32_t firstLine) {
+  hintIndexUnits(log, slot, 1, 0);
+  if (log->index) {
+    log->index[slot].time = time;
+    log->index[slot].firstLine = firstLine;
+  } else {
+    cindexSet(&log->compactIndex[slot / CIRC_CINDEX_GROUP], slot, time,
+              firstLine);
+  }
+  hintIndexUnits(log, slot, 1, 1);
+}
+
+static void indexClear(circ_log_t *log, uint32_t slot, uint32_t count) {
+  uint32_t i;
+  hintIndexUnits(log, slot, count, 0);
+  if (log->index) {
+    memset(&log->index[slot], 0xFF, count * sizeof(circ_log_index_t));
+  } else {
+    for (i = slot; i < slot + count; i++) {
+      log->compactIndex[i / CIRC_CINDEX_GROUP].slot[i % CIRC_CINDEX_GROUP] =
+          CINDEX_EMPTY;
+    }
+  }
+  hintIndexUnits(log, slot, count, 1);
+}
+
+/* Reads count segments, in one log->readv call when set.
+ * return : 1 when all were read whole */
+static uint32_t readSegments(circ_log_t *log, const circ_log_seg_t *seg,
+                             uint32_t count) {
+  uint32_t i, len = 0;
+  if (log->readv) {
+    for (i = 0; i < count; i++) {
+      len += seg[i].len;
+    }
+    return log->readv(seg, count) == len;
+  }
+  for (i = 0; i < count; i++) {
+    if (log->read(seg[i].addr, seg[i].buff, seg[i].len) != seg[i].len) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Time of the first line starting inside the slot, offset in firstLine
+ */
+static uint32_t findFirstLine(circ_log_t *log, uint32_t slot,
+                              uint32_t *firstLine) {
+  uint32_t res, i, j, readLen;
+  uint32_t slotAddr = slot * INDEX_SLOT_SIZE(log);
+  for (i = 0; i < INDEX_SLOT_SIZE(log); i += WRITE_SIZE(log)) {
+    readLen = WRITE_SIZE(log) + FLASH_MAX_DATE_LEN;
+    if (slotAddr + i + readLen > log->logsLength) {
+      readLen = log->logsLength - (slotAddr + i);
+    }
+    res = log->read(log->baseAddress + slotAddr + i, log->wBuff, readLen);
+    if (res != readLen) {
+      return RECORD_NO_TIME;
+    }
+    for (j = 0; j < WRITE_SIZE(log) && j < res; j++) {
+      if (log->wBuff[j] == '\n') {
+        if (i + j + 1 >= INDEX_SLOT_SIZE(log)) {
+          return RECORD_NO_TIME;
+        }
+        uint32_t time = recordTime(log, &log->wBuff[j + 1], res - j - 1);
+        if (time != RECORD_NO_TIME) {
+          *firstLine = i + j + 1;
+          return time;
+        }
+      }
+    }
+  }
+  return RECORD_NO_TIME;
+}
+
+/* Log offset of the indexed line in a RAM index slot */
+static uint32_t slotLine(circ_log_t *log, uint32_t slot) {
+  return (slot * INDEX_SLOT_SIZE(log)) + indexFirstLine(log, slot);
+}
+
+static void indexSlot(circ_log_t *log, uint32_t slot) {
+  uint32_t firstLine;
+  uint32_t time = findFirstLine(log, slot, &firstLine);
+  if (time != RECORD_NO_TIME) {
+    indexSet(log, slot, time, firstLine);
+  }
+}
+
+/* Start of each slot buildIndex reads ahead through readv, room for a
+ * first line start, its header and time */
+#define INDEX_PROBE_LEN(log)                                                   \
+  (2 * LINE_ESTIMATE(log) + CIRC_REC_MAX_HEADER + FLASH_MAX_DATE_LEN)
+
+/* Time of the first timed line in a slot's probe, RECORD_NO_TIME when
+ * the probe is too short to tell */
+static uint32_t probeFirstLine(circ_log_t *log, const uint8_t *probe,
+                               uint32_t len, uint32_t *firstLine) {
+  uint32_t j, time;
+  for (j = 0; j + 1 + CIRC_REC_MAX_HEADER + FLASH_MAX_DATE_LEN <= len &&
+              j + 1 < INDEX_SLOT_SIZE(log);
+       j++) {
+    if (probe[j] == '\n') {
+      time = recordTime(log, &probe[j + 1], len - j - 1);
+      if (time != RECORD_NO_TIME) {
+        *firstLine = j + 1;
+        return time;
+      }
+    }
+  }
+  return RECORD_NO_TIME;
+}
+
+/* Indexes n slots from the starts of all of them read in one readv call,
+ * slots whose first line is further in are searched one by one */
+static void indexSlots(circ_log_t *log, const uint32_t *slot, uint32_t n) {
+  circ_log_seg_t seg[CIRC_READV_MAX] = {{0}};
+  uint32_t k, time, firstLine, pending = 0;
+  for (k = 0; k < n; k++) {
+    seg[k].addr = log->baseAddress + slot[k] * INDEX_SLOT_SIZE(log);
+    seg[k].buff = &log->wBuff[k * INDEX_PROBE_LEN(log)];
+    seg[k].len = INDEX_PROBE_LEN(log);
+    if (slot[k] * INDEX_SLOT_SIZE(log) + seg[k].len > log->logsLength) {
+      seg[k].len = log->logsLength - slot[k] * INDEX_SLOT_SIZE(log);
+    }
+  }
+  if (!readSegments(log, seg, n)) {
+    pending = (1U << n) - 1;
+  } else {
+    for (k = 0; k < n; k++) {
+      time = probeFirstLine(log, seg[k].buff, seg[k].len, &firstLine);
+      if (time != RECORD_NO_TIME) {
+        indexSet(log, slot[k], time, firstLine);
+      } else {
+        pending |= 1U << k;
+      }
+    }
+  }
+  /* wBuff is reused from here */
+  for (k = 0; k < n; k++) {
+    if (pending & (1U << k)) {
+      indexSlot(log, slot[k]);
+    }
+  }
+}
+
+static void buildIndex(circ_log_t *log) {
+  uint32_t slot[CIRC_READV_MAX];
+  uint32_t i, live, n = 0, batch = 0;
+  indexClear(log, 0, INDEX_SLOTS(log));
+  if (log->readv) {
+    batch = log->wBuffLen / INDEX_PROBE_LEN(log);
+    if (batch > CIRC_READV_MAX) {
+      batch = CIRC_READV_MAX;
+    }
+  }
+  // Loop through open buffers reading
+  for (i = 0; i < INDEX_SLOTS(log); i++) {
+    int32_t addr = (int32_t)(i * INDEX_SLOT_SIZE(log));
+    if (log->LogFlashHeadPtr > log->LogFlashTailPtr) {
+      /* Normal */
+      live = addr >= log->LogFlashTailPtr && addr < log->LogFlashHeadPtr;
+    } else {
+      /* Wrapped */
+      live = addr >= log->LogFlashTailPtr || addr < log->LogFlashHeadPtr;
+    }
+    if (live && batch < 2) {
+      indexSlot(log, i);
+    } else if (live) {
+      slot[n++] = i;
+      if (n == batch) {
+        indexSlots(log, slot, n);
+        n = 0;
+      }
+    }
+  }
+  if (n) {
+    indexSlots(log, slot, n);
+  }
+}
+
+/*
+ * First sector from from on whose first byte is written, SECTOR_COUNT if
+ * none. With log->readv the probes go CIRC_READV_MAX sectors a call.
+ * return : 0 on IO error
+ */
+static uint32_t firstWrittenSector(circ_log_t *log, uint32_t from,
+                                   uint32_t *sector) {
+  circ_log_seg_t seg[CIRC_READV_MAX];
+  uint32_t i, n, batch = log->readv ? CIRC_READV_MAX : 1;
+  for (*sector = from; *sector < SECTOR_COUNT(log); *sector += n) {
+    n = SECTOR_COUNT(log) - *sector < batch ? SECTOR_COUNT(log) - *sector
+                                            : batch;
+    for (i = 0; i < n; i++) {
+      seg[i].addr = log->baseAddress + (*sector + i) * SECTOR_SIZE(log);
+      seg[i].buff = &log->wBuff[i * 4];
+      seg[i].len = 4;
+    }
+    if (!readSegments(log, seg, n)) {
+      return 0;
+    }
+    for (i = 0; i < n; i++) {
+      if (log->wBuff[i * 4] != FLASH_ERASED) {
+        *sector += i;
+        return 1;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Shift for power of 2 sizes, 0 selects the divide path */
+static uint8_t circLog2(uint32_t size) {
+  uint8_t shift = 0;
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return 0;
+  }
+  while ((1UL << shift) != size) {
+    shift++;
+  }
+  return shift;
+}
+
+static int32_t calculateLogSpace(circ_log_t *log) {
+  return calculateSpace(log, log->LogFlashTailPtr, log->LogFlashHeadPtr);
+}
+
+/* Programs the bytes stagePut left in wBuff, padded to whole pages */
+static uint32_t stageFlush(circ_log_t *log) {
+  uint32_t len = log->stageLen, pad = WRITE_OFFSET(log, len);
+  if (len == 0) {
+    return CIRC_LOG_ERR_NONE;
+  }
+  log->stageLen = 0;
+  if (pad) {
+    pad = WRITE_SIZE(log) - pad;
+    memset(&log->wBuff[len], FLASH_ERASED, pad);
+    len += pad;
+  }
+  if (log->write(log->stageAddr, log->wBuff, len) != len) {
+    FLASH_DEBUG("FLASH: (%s) Write IO error\r\n", log->name);
+    return CIRC_LOG_ERR_IO;
+  }
+  return CIRC_LOG_ERR_NONE;
+}
+
+/* Empty stage from addr, bytes ahead of it in its page left as they are */
+static void stageStart(circ_log_t *log, uint32_t addr) {
+  log->stageLen = WRITE_OFFSET(log, addr);
+  log->stageAddr = addr - log->stageLen;
+  memset(log->wBuff, FLASH_ERASED, log->stageLen);
+}
+
+/*
+ * Copies len bytes for addr into wBuff, programming it when full or when
+ * addr does not follow the staged bytes. stageFlush programs the rest, so
+ * lines written together share page programs. Whole pages after the first
+ * page boundary go to the driver from buf itself, WRITE_MAX bytes a call
+ */
+static uint32_t stagePut(circ_log_t *log, uint32_t addr, const uint8_t *buf,
+                         uint32_t len) {
+  uint32_t n, off, done, room = WRITE_OF(log, log->wBuffLen) * WRITE_SIZE(log);
+  for (done = 0; done < len; done += n) {
+    n = len - done;
+    off = WRITE_OFFSET(log, addr + done);
+    if (off == 0 && n >= WRITE_SIZE(log)) {
+      /* Earlier bytes first, then whole pages in place */
+      if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+        return 0;
+      }
+      n = WRITE_OF(log, n) * WRITE_SIZE(log);
+      if (n > WRITE_MAX(log)) {
+        n = WRITE_MAX(log);
+      }
+      if (log->write(addr + done, (uint8_t *)&buf[done], n) != n) {
+        FLASH_DEBUG("FLASH: (%s) Write IO error\r\n", log->name);
+        return 0;
+      }
+      continue;
+    }
+    if (log->stageLen && log->stageAddr + log->stageLen != addr + done &&
+        stageFlush(log) != CIRC_LOG_ERR_NONE) {
+      return 0;
+    }
+    if (log->stageLen == 0) {
+      stageStart(log, addr + done);
+    }
+    /* Stop at the page boundary when a whole page follows */
+    if (off && n >= 2 * WRITE_SIZE(log) - off) {
+      n = WRITE_SIZE(log) - off;
+    }
+    if (n > room - log->stageLen) {
+      n = room - log->stageLen;
+    }
+    memcpy(&log->wBuff[log->stageLen], &buf[done], n);
+    log->stageLen += n;
+    if (log->stageLen == room && stageFlush(log) != CIRC_LOG_ERR_NONE) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+/* This function inserts, assuming that writing 1's won't change anything*/
+static uint32_t circFlashInsertWrite(circ_log_t *log, uint32_t FlashAddress,
+                                     unsigned char *buff, uint32_t len) {
+  if (stagePut(log, FlashAddress, buff, len) != len ||
+      stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    return 0;
+  }
+  return len;
+}
+
+/*
+ * Flash resident index. Entries {time, log offset of the line} are appended
+ * in log order to a circular area of whole sectors, keeping the sector under
+ * the head erased. Entries validFrom .. head describe live data, summary
+ * holds the first time of each index page so a lookup reads one page.
+ * New entries collect in the cached head page, programmed once it fills or
+ * another page is read. Those lost to a reset are indexed again by init.
+ */
+#define FINDEX_NONE 0xFFFFFFFF
+#define FINDEX_CAPACITY(fi) ((fi)->length / CIRC_FINDEX_ENTRY_SIZE)
+#define FINDEX_PER_PAGE(log) (WRITE_SIZE(log) / CIRC_FINDEX_ENTRY_SIZE)
+#define FINDEX_PER_SECTOR(log) (SECTOR_SIZE(log) / CIRC_FINDEX_ENTRY_SIZE)
+
+static uint32_t flashIndexPrev(circ_log_findex_t *fi, uint32_t n) {
+  return n ? n - 1 : FINDEX_CAPACITY(fi) - 1;
+}
+
+/* Programs the entries appended to the cached page since its last program */
+static void flashIndexProgram(circ_log_t *log) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t end, start;
+  if (fi->pending == 0) {
+    return;
+  }
+  end = (flashIndexPrev(fi, fi->head) % FINDEX_PER_PAGE(log) + 1) *
+        CIRC_FINDEX_ENTRY_SIZE;
+  start = end - fi->pending * CIRC_FINDEX_ENTRY_SIZE;
+  fi->pending = 0;
+  if (circFlashInsertWrite(log,
+                           fi->baseAddress + fi->cachePage * WRITE_SIZE(log) +
+                               start,
+                           &fi->cache[start], end - start) != end - start) {
+    FLASH_DEBUG("FLASH: (%s) Index write IO error\r\n", log->name);
+  }
+}
+
+/* Caches an index page, unprogrammed entries go to flash first */
+static uint32_t flashIndexLoad(circ_log_t *log, uint32_t page) {
+  circ_log_findex_t *fi = log->flashIndex;
+  if (fi->cachePage == page) {
+    return 1;
+  }
+  flashIndexProgram(log);
+  if (log->read(fi->baseAddress + page * WRITE_SIZE(log), fi->cache,
+                WRITE_SIZE(log)) != WRITE_SIZE(log)) {
+    fi->cachePage = FINDEX_NONE;
+    return 0;
+  }
+  fi->cachePage = page;
+  return 1;
+}
+
+/* Returns entry time, RECORD_NO_TIME if erased or unreadable */
+static uint32_t flashIndexRead(circ_log_t *log, uint32_t n, uint32_t *pos) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t entry[2];
+  if (!flashIndexLoad(log, n / FINDEX_PER_PAGE(log))) {
+    return RECORD_NO_TIME;
+  }
+  memcpy(entry,
+         &fi->cache[(n % FINDEX_PER_PAGE(log)) * CIRC_FINDEX_ENTRY_SIZE],
+         sizeof(entry));
+  *pos = entry[1];
+  return entry[0];
+}
+
+/* Erases the index sector the head just entered */
+static void flashIndexEraseHead(circ_log_t *log) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t first = fi->head - (fi->head % FINDEX_PER_SECTOR(log));
+  uint32_t page = first / FINDEX_PER_PAGE(log);
+  uint32_t i;
+  if (log->erase(fi->baseAddress + first * CIRC_FINDEX_ENTRY_SIZE,
+                 SECTOR_SIZE(log)) != SECTOR_SIZE(log)) {
+    FLASH_DEBUG("FLASH: (%s) Index erase IO error\r\n", log->name);
+  }
+  for (i = 0; i < FINDEX_PER_SECTOR(log) / FINDEX_PER_PAGE(log); i++) {
+    fi->summary[page + i] = FINDEX_NONE;
+    if (fi->cachePage == page + i) {
+      fi->cachePage = FINDEX_NONE;
+    }
+  }
+  /* Only reached with an undersized area, oldest entries are lost */
+  if (fi->validFrom != fi->head && fi->validFrom >= first &&
+      fi->validFrom < first + FINDEX_PER_SECTOR(log)) {
+    fi->validFrom = (first + FINDEX_PER_SECTOR(log)) % FINDEX_CAPACITY(fi);
+  }
+}
+
+static void flashIndexAppend(circ_log_t *log, uint32_t time, uint32_t pos) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t entry[2] = {time, pos};
+  uint32_t page = fi->head / FINDEX_PER_PAGE(log);
+  uint32_t off = fi->head % FINDEX_PER_PAGE(log);
+  if (fi->cachePage != page) {
+    if (off) {
+      if (!flashIndexLoad(log, page)) {
+        FLASH_DEBUG("FLASH: (%s) Index read IO error\r\n", log->name);
+        return;
+      }
+    } else {
+      /* A fresh page, erased with its sector */
+      flashIndexProgram(log);
+      memset(fi->cache, FLASH_ERASED, WRITE_SIZE(log));
+      fi->cachePage = page;
+    }
+  }
+  memcpy(&fi->cache[off * CIRC_FINDEX_ENTRY_SIZE], entry, sizeof(entry));
+  fi->pending++;
+  if (off == 0) {
+    fi->summary[page] = time;
+  }
+  fi->lastSlot = INDEX_SLOT_OF(log, pos);
+  fi->head = (fi->head + 1) % FINDEX_CAPACITY(fi);
+  if (off == FINDEX_PER_PAGE(log) - 1) {
+    flashIndexProgram(log);
+  }
+  if (fi->head % FINDEX_PER_SECTOR(log) == 0) {
+    flashIndexEraseHead(log);
+  }
+}
+
+/* Drops leading entries that point into an erased log sector */
+static void flashIndexDropSector(circ_log_t *log, uint32_t sector) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t pos;
+  while (fi->validFrom != fi->head) {
+    if (flashIndexRead(log, fi->validFrom, &pos) == RECORD_NO_TIME ||
+        SECTOR_OF(log, pos) != sector) {
+      break;
+    }
+    fi->validFrom = (fi->validFrom + 1) % FINDEX_CAPACITY(fi);
+  }
+  if (fi->validFrom == fi->head) {
+    fi->lastSlot = FINDEX_NONE;
+  }
+}
+
+/* Newest live entry at or before time, 0 if none */
+static uint32_t flashIndexFind(circ_log_t *log, uint32_t time,
+                               uint32_t *pos) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t perPage = FINDEX_PER_PAGE(log);
+  uint32_t last, page, n, start, t;
+  if (fi->validFrom == fi->head) {
+    return 0;
+  }
+  last = flashIndexPrev(fi, fi->head);
+  page = last / perPage;
+  /* Page choice from RAM, the oldest page may start with a stale entry */
+  while (page != fi->validFrom / perPage && fi->summary[page] > time) {
+    page = page ? page - 1 : CIRC_FINDEX_PAGES(fi->length, WRITE_SIZE(log)) - 1;
+  }
+  n = page == last / perPage ? last : page * perPage + perPage - 1;
+  start = page == fi->validFrom / perPage ? fi->validFrom : page * perPage;
+  for (;;) {
+    t = flashIndexRead(log, n, pos);
+    if (t != RECORD_NO_TIME && t <= time) {
+      return 1;
+    }
+    if (n == start) {
+      return 0;
+    }
+    n--;
+  }
+}
+
+/*
+ * Finds the head and the live entries, then indexes any slots written
+ * after the last entry. A blank area is rebuilt from the log.
+ */
+static void flashIndexInit(circ_log_t *log) {
+  circ_log_findex_t *fi = log->flashIndex;
+  uint32_t pages = CIRC_FINDEX_PAGES(fi->length, WRITE_SIZE(log));
+  uint32_t i, n, t, pos = 0, age, prevAge, live, addr, firstLine;
+  fi->cachePage = FINDEX_NONE;
+  fi->pending = 0;
+  fi->head = 0;
+  for (i = 0; i < pages; i++) {
+    if (log->read(fi->baseAddress + i * WRITE_SIZE(log),
+                  (uint8_t *)&fi->summary[i],
+                  sizeof(uint32_t)) != sizeof(uint32_t)) {
+      fi->summary[i] = FINDEX_NONE;
+    }
+  }
+  for (i = 0; i < pages; i++) {
+    if (fi->summary[i] != FINDEX_NONE &&
+        fi->summary[(i + 1) % pages] == FINDEX_NONE) {
+      for (n = i * FINDEX_PER_PAGE(log); n < (i + 1) * FINDEX_PER_PAGE(log);
+           n++) {
+        if (flashIndexRead(log, n, &pos) == RECORD_NO_TIME) {
+          break;
+        }
+      }
+      fi->head = n % FINDEX_CAPACITY(fi);
+      break;
+    }
+  }
+  if (i == pages && fi->summary[0] != FINDEX_NONE) {
+    /* No erased head sector, start over */
+    if (eraseRange(log, fi->baseAddress, fi->length) != CIRC_LOG_ERR_NONE) {
+      FLASH_DEBUG("FLASH: (%s) Index erase IO error\r\n", log->name);
+    }
+    memset(fi->summary, 0xFF, pages * sizeof(uint32_t));
+    fi->cachePage = FINDEX_NONE;
+  }
+  fi->validFrom = fi->head;
+  fi->lastSlot = FINDEX_NONE;
+  if (log->LogFlashHeadPtr < 0) {
+    return;
+  }
+  /* Live entries run back from the head with falling log position */
+  live = (uint32_t)calculateLogSpace(log);
+  prevAge = live;
+  n = fi->head;
+  for (i = 0; i < FINDEX_CAPACITY(fi); i++) {
+    n = flashIndexPrev(fi, n);
+    t = flashIndexRead(log, n, &pos);
+    if (t == RECORD_NO_TIME || pos >= log->logsLength) {
+      break;
+    }
+    age = (pos + log->logsLength - log->LogFlashTailPtr) % log->logsLength;
+    if (age >= prevAge) {
+      break;
+    }
+    prevAge = age;
+    fi->validFrom = n;
+  }
+  if (fi->validFrom != fi->head) {
+    flashIndexRead(log, flashIndexPrev(fi, fi->head), &pos);
+    fi->lastSlot = INDEX_SLOT_OF(log, pos);
+    addr = (fi->lastSlot + 1) * INDEX_SLOT_SIZE(log);
+  } else {
+    addr = (uint32_t)log->LogFlashTailPtr;
+  }
+  /* Catch up on slots written after the last entry */
+  for (addr %= log->logsLength;
+       (addr + log->logsLength - log->LogFlashTailPtr) % log->logsLength <
+       live;
+       addr = (addr + INDEX_SLOT_SIZE(log)) % log->logsLength) {
+    t = findFirstLine(log, INDEX_SLOT_OF(log, addr), &firstLine);
+    if (t != RECORD_NO_TIME) {
+      flashIndexAppend(log, t, addr + firstLine);
+    }
+  }
+}
+
+/* Index updates shared by the RAM and flash forms */
+static uint32_t indexHasSlot(circ_log_t *log, uint32_t slot) {
+  if (log->flashIndex) {
+    return log->flashIndex->lastSlot == slot;
+  }
+  return indexTime(log, slot) != RECORD_NO_TIME;
+}
+
+static void indexAddLine(circ_log_t *log, uint32_t time, uint32_t pos) {
+  uint32_t slot = INDEX_SLOT_OF(log, pos);
+  if (log->flashIndex) {
+    flashIndexAppend(log, time, pos);
+  } else {
+    indexSet(log, slot, time, pos - (slot * INDEX_SLOT_SIZE(log)));
+  }
+}
+
+static void indexReset(circ_log_t *log) {
+  if (log->flashIndex) {
+    log->flashIndex->validFrom = log->flashIndex->head;
+    log->flashIndex->lastSlot = FINDEX_NONE;
+  } else {
+    indexClear(log, 0, INDEX_SLOTS(log));
+  }
+}
+
+/* Drops the index slots covering an erased sector */
+static void indexDropSector(circ_log_t *log, uint32_t sector) {
+  if (log->flashIndex) {
+    flashIndexDropSector(log, sector);
+  } else {
+    indexClear(log, INDEX_SLOT_OF(log, sector * SECTOR_SIZE(log)),
+               INDEX_SLOT_OF(log, SECTOR_SIZE(log)));
+  }
+}
+
+/*
+ * Warm boot hint
+ */
+/* Sum of the unit checks over the whole RAM index */
+static uint32_t hintIndexSum(circ_log_t *log) {
+  uint32_t unit, sum = 0;
+  uint32_t units = log->index ? INDEX_SLOTS(log)
+                              : CIRC_CINDEX_GROUPS(INDEX_SLOTS(log));
+  for (unit = 0; unit < units; unit++) {
+    sum += hintUnitSum(log, unit);
+  }
+  return sum;
+}
+
+/* Check over a hint and the layout of the log it was saved for */
+static uint32_t hintCheck(circ_log_t *log, const circ_log_hint_t *h) {
+  uint32_t v[8] = {(uint32_t)h->head,   (uint32_t)h->tail,
+                   h->trimPending,      h->indexSum,
+                   log->baseAddress,    log->logsLength,
+                   SECTOR_SIZE(log),    log->indexGranularity};
+  return hintHash(HINT_HASH_BASIS, v, sizeof(v));
+}
+
+/* Records head and tail in the retained hint, mutex held */
+static void hintSave(circ_log_t *log) {
+  circ_log_hint_t *h = log->hint;
+  if (h == NULL) {
+    return;
+  }
+  h->head = log->LogFlashHeadPtr;
+  h->tail = log->LogFlashTailPtr;
+  h->trimPending = log->trimPending;
+  if (log->hintIndex && RAM_INDEX(log)) {
+    h->indexSum = log->indexSum;
+  }
+  h->check = hintCheck(log, h);
+}
+
+/*
+ * Head and tail from a hint the flash agrees with: the head byte erased,
+ * the byte before it and the tail sector written, one readv call when set
+ * return : 1 when taken
+ */
+static uint32_t hintLoad(circ_log_t *log) {
+  circ_log_hint_t *h = log->hint;
+  circ_log_seg_t seg[3];
+  uint8_t b[3];
+  uint32_t i, n = 1;
+  if (h->check != hintCheck(log, h) || h->head < 0 || h->tail < 0 ||
+      (uint32_t)h->head >= log->logsLength ||
+      (uint32_t)h->tail >= log->logsLength ||
+      SECTOR_OFFSET(log, h->tail) != 0 ||
+      h->trimPending >= SECTOR_COUNT(log)) {
+    return 0;
+  }
+  seg[0].addr = log->baseAddress + h->head;
+  if (h->head == h->tail) {
+    /* Only a new log is empty */
+    if (h->head != 0 || h->trimPending) {
+      return 0;
+    }
+  } else {
+    seg[1].addr =
+        log->baseAddress + (h->head + log->logsLength - 1) % log->logsLength;
+    seg[2].addr = log->baseAddress + h->tail;
+    n = 3;
+  }
+  for (i = 0; i < n; i++) {
+    seg[i].buff = &b[i];
+    seg[i].len = 1;
+  }
+  if (!readSegments(log, seg, n) || b[0] != FLASH_ERASED) {
+    return 0;
+  }
+  for (i = 1; i < n; i++) {
+    if (b[i] == FLASH_ERASED) {
+      return 0;
+    }
+  }
+  log->LogFlashHeadPtr = h->head;
+  log->LogFlashTailPtr = h->tail;
+  log->trimPending = h->trimPending;
+  log->emptyFlag = h->head == h->tail;
+  return 1;
+}
+
+/*
+ * param log : log file
+ * param buff : data buffer
+ * param tailPtr : pinned tail
+ * param headPtr : pinned head
+ * param seek : postion from start of file
+ * param space : total size of file
+ * param desiredLen : read length
+ * param remaining : updated to remaining in file
+ */
+static uint32_t circularReadSection(circ_log_t *log, uint8_t *buff,
+                                    int32_t tailPtr, int32_t headPtr,
+                                    uint32_t seek, int32_t space,
+                                    uint32_t desiredlen, uint32_t *remaining) {
+  uint32_t ret = 0;
+  uint32_t res, firstlen, secondlen;
+  if (space > 0 && desiredlen > 0) {
+    if (headPtr > tailPtr) {
+      res = log->read(log->baseAddress + tailPtr + seek, buff,
+                      desiredlen);
+      if (res != desiredlen) {
+        FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
+        ret = 0;
+        *remaining = 0;
+        goto badexit;
+      }
+      *remaining = (space - seek - desiredlen);
+      ret = desiredlen;
+    } else if (headPtr < tailPtr) {
+      // See which part the caller wants
+      firstlen = log->logsLength - tailPtr;
+      if (seek > firstlen) {
+        // The upper half of the request
+        res = log->read(log->baseAddress + (seek - firstlen), buff, desiredlen);
+        if (res != desiredlen) {
+          FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
+          ret = 0;
+          *remaining = 0;
+          goto badexit;
+        }
+        ret = desiredlen;
+        *remaining = (space - seek - desiredlen);
+      } else {
+        // Lower half first from end of address space
+        if (seek + desiredlen + tailPtr > log->logsLength) {
+          secondlen = log->logsLength - (tailPtr + seek);
+          circ_log_seg_t seg[2] = {
+              {log->baseAddress + tailPtr + seek, buff, secondlen},
+              {log->baseAddress, &buff[secondlen], desiredlen - secondlen}};
+          /* Both pieces in one readv call */
+          if (!readSegments(log, secondlen ? seg : &seg[1],
+                            secondlen ? 2 : 1)) {
+            FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
+            ret = 0;
+            *remaining = 0;
+            goto badexit;
+          }
+          ret = desiredlen;
+          *remaining = (space - seek - desiredlen);
+        } else {
+          res = log->read(log->baseAddress + tailPtr + seek, buff,
+                          desiredlen);
+          if (res != desiredlen) {
+            FLASH_DEBUG("FLASH: (%s) IO error\r\n", log->name);
+          }
+          ret = res;
+          *remaining = (space - seek - desiredlen);
+        }
+      }
+    }
+  } else {
+    ret = 0;
+    *remaining = 0;
+  }
+badexit:
+  return ret;
+}
+
+/* Start of the line holding seek, looked for up to a sector back, longer
+ * lines being large records, return : 0 if not found */
+static uint32_t lineStartBefore(circ_log_t *log, int32_t tailPtr,
+                                int32_t headPtr, uint32_t seek, int32_t space,
+                                uint32_t *start) {
+  uint8_t b[32];
+  uint32_t pos = seek, n, i, remaining;
+  while (pos > 0) {
+    if (seek - pos > SECTOR_SIZE(log)) {
+      return 0;
+    }
+    n = pos < sizeof(b) ? pos : sizeof(b);
+    pos -= n;
+    if (circularReadSection(log, b, tailPtr, headPtr, pos, space, n,
+                            &remaining) != n) {
+      return 0;
+    }
+    for (i = n; i > 0; i--) {
+      if (b[i - 1] == '\n') {
+        *start = pos + i;
+        return 1;
+      }
+    }
+  }
+  *start = 0;
+  return 1;
+}
+
+/*
+ * Text of len bytes read from seek, record headers and large records
+ * dropped. The line the range starts in is read from its start for its
+ * header, return : text bytes left in buff
+ */
+static uint32_t stripSection(circ_log_t *log, uint8_t *buff, uint32_t len,
+                             int32_t tailPtr, int32_t headPtr, uint32_t seek,
+                             int32_t space) {
+  uint8_t hdr[CIRC_REC_MAX_HEADER];
+  uint32_t start, n, left, lead = 0;
+  uint8_t state = STRIP_LINE;
+  if (len && seek) {
+    if (!lineStartBefore(log, tailPtr, headPtr, seek, space, &start)) {
+      state = STRIP_LARGE;
+    } else if (start < seek) {
+      n = space - start < sizeof(hdr) ? space - start : sizeof(hdr);
+      n = circularReadSection(log, hdr, tailPtr, headPtr, start, space, n,
+                              &left);
+      n = recordHeaderLen(hdr, n);
+      state = recordLargeLen(hdr, n) ? STRIP_LARGE : STRIP_TEXT;
+      lead = start + n > seek ? start + n - seek : 0;
+    }
+  }
+  return stripRecordHeaders(buff, len, lead, state);
+}
+
+/*
+ * Keyword bloom filters. Bits of a sector are kept in RAM while the head is
+ * in it, then programmed to the side area once. An erased slot reads as all
+ * ones and never skips, a programmed one is erased with the log sector.
+ */
+#define BLOOM_NONE 0xFFFFFFFF
+#define BLOOM_TOKEN(c)                                                         \
+  (((c) >= '0' && (c) <= '9') || ((c) >= 'A' && (c) <= 'Z') ||                 \
+   ((c) >= 'a' && (c) <= 'z') || (c) == '_')
+
+typedef struct {
+  uint32_t hash;
+  uint32_t prefixHash;
+  uint32_t len;
+} bloom_token_t;
+
+/* Sector skip test, bloom keys and tag mask */
+typedef struct {
+  uint32_t hash[CIRC_BLOOM_MAX_KEYS];
+  uint32_t count;
+  uint32_t tags;
+} sector_query_t;
+
+static void bloomTokenStart(bloom_token_t *tok) {
+  tok->hash = 2166136261UL; /* FNV-1a */
+  tok->len = 0;
+}
+
+static void bloomTokenChar(bloom_token_t *tok, uint8_t c) {
+  tok->hash = (tok->hash ^ c) * 16777619UL;
+  if (++tok->len == CIRC_BLOOM_PREFIX) {
+    tok->prefixHash = tok->hash;
+  }
+}
+
+static uint32_t bloomBit(uint32_t hash, uint32_t k, uint32_t bits) {
+  return (hash + k * ((hash >> 17) | 1)) % bits;
+}
+
+static void bloomAddHash(uint8_t *bits, uint32_t bytes, uint32_t hash) {
+  uint32_t k, bit;
+  for (k = 0; k < CIRC_BLOOM_HASHES; k++) {
+    bit = bloomBit(hash, k, bytes * 8);
+    bits[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+  }
+}
+
+/* Adds the tokens of text, tok carries a token across calls */
+static void bloomAddText(uint8_t *bits, uint32_t bytes, bloom_token_t *tok,
+                         const uint8_t *text, uint32_t len) {
+  uint32_t i;
+  for (i = 0; i < len; i++) {
+    if (BLOOM_TOKEN(text[i])) {
+      bloomTokenChar(tok, text[i]);
+      continue;
+    }
+    if (tok->len) {
+      bloomAddHash(bits, bytes, tok->hash);
+      if (tok->len > CIRC_BLOOM_PREFIX) {
+        bloomAddHash(bits, bytes, tok->prefixHash);
+      }
+    }
+    bloomTokenStart(tok);
+  }
+}
+
+/* 0 when no line in sector can match */
+static uint32_t bloomTest(circ_log_t *log, uint32_t sector,
+                          const sector_query_t *q) {
+  circ_log_bloom_t *bl = log->bloom;
+  uint32_t i, k, bit;
+  uint8_t b;
+  for (i = 0; i < q->count; i++) {
+    for (k = 0; k < CIRC_BLOOM_HASHES; k++) {
+      bit = bloomBit(q->hash[i], k, bl->bytes * 8);
+      if (sector == bl->sector) {
+        b = bl->head[bit >> 3];
+      } else if (log->read(bl->baseAddress + sector * bl->bytes + (bit >> 3), &b,
+                           1) != 1) {
+        return 1;
+      }
+      if (!(b & (1 << (bit & 7)))) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Erases the side sector holding a programmed slot */
+static void bloomEraseSlot(circ_log_t *log, uint32_t sector) {
+  circ_log_bloom_t *bl = log->bloom;
+  uint32_t i, addr = sector * bl->bytes;
+  if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    return;
+  }
+  if (log->read(bl->baseAddress + addr, log->wBuff, bl->bytes) != bl->bytes) {
+    return;
+  }
+  for (i = 0; i < bl->bytes; i++) {
+    if (log->wBuff[i] != FLASH_ERASED) {
+      break;
+    }
+  }
+  if (i < bl->bytes &&
+      log->erase(bl->baseAddress + addr - SECTOR_OFFSET(log, addr),
+                 SECTOR_SIZE(log)) != SECTOR_SIZE(log)) {
+    FLASH_DEBUG("FLASH: (%s) Bloom erase IO error\r\n", log->name);
+  }
+}
+
+/* Adds the first len bytes of the line held in iov */
+static void bloomLine(circ_log_t *log, uint32_t start,
+                      const circ_log_iov_t *iov, uint32_t count,
+                      uint32_t len) {
+  circ_log_bloom_t *bl = log->bloom;
+  bloom_token_t tok;
+  uint8_t end = '\n';
+  uint32_t i, n;
+  if (SECTOR_OF(log, start) != bl->sector) {
+    memset(bl->head, 0, bl->bytes);
+    bl->sector = SECTOR_OF(log, start);
+  }
+  if (len && iov[0].len && iov[0].buf[0] == CIRC_FMT_MARKER) {
+    /* Formatted text is not known here, never skip the sector */
+    memset(bl->head, 0xFF, bl->bytes);
+  } else {
+    /* Tokens run on across fragments */
+    bloomTokenStart(&tok);
+    for (i = 0; i < count && len; i++) {
+      n = iov[i].len < len ? iov[i].len : len;
+      bloomAddText(bl->head, bl->bytes, &tok, iov[i].buf, n);
+      len -= n;
+    }
+    bloomAddText(bl->head, bl->bytes, &tok, &end, 1);
+  }
+}
+
+/* Writes the head filter once the head has left its sector */
+static void bloomHead(circ_log_t *log) {
+  circ_log_bloom_t *bl = log->bloom;
+  if (SECTOR_OF(log, log->LogFlashHeadPtr) == bl->sector) {
+    return;
+  }
+  /* Its last line included */
+  bloomEraseSlot(log, bl->sector);
+  if (circFlashInsertWrite(log, bl->baseAddress + bl->sector * bl->bytes,
+                           bl->head, bl->bytes) != bl->bytes) {
+    FLASH_DEBUG("FLASH: (%s) Bloom write IO error\r\n", log->name);
+  }
+  memset(bl->head, 0, bl->bytes);
+  bl->sector = SECTOR_OF(log, log->LogFlashHeadPtr);
+}
+
+static void bloomReset(circ_log_t *log) {
+  circ_log_bloom_t *bl = log->bloom;
+  if (eraseRange(log, bl->baseAddress, bl->length) != CIRC_LOG_ERR_NONE) {
+    FLASH_DEBUG("FLASH: (%s) Bloom erase IO error\r\n", log->name);
+  }
+  memset(bl->head, 0, bl->bytes);
+  bl->sector = 0;
+}
+
+/* Head sector bits from everything written in it, partial line included */
+static void bloomInit(circ_log_t *log) {
+  circ_log_bloom_t *bl = log->bloom;
+  bloom_token_t tok;
+  uint32_t addr, len;
+  memset(bl->head, 0, bl->bytes);
+  bl->sector = BLOOM_NONE;
+  if (log->LogFlashHeadPtr < 0) {
+    return;
+  }
+  bl->sector = SECTOR_OF(log, log->LogFlashHeadPtr);
+  bloomTokenStart(&tok);
+  for (addr = bl->sector * SECTOR_SIZE(log);
+       addr < (uint32_t)log->LogFlashHeadPtr; addr += len) {
+    len = log->LogFlashHeadPtr - addr;
+    if (len > log->wBuffLen) {
+      len = log->wBuffLen;
+    }
+    if (log->read(log->baseAddress + addr, log->wBuff, len) != len) {
+      /* Unknown content, never skip it */
+      memset(bl->head, 0xFF, bl->bytes);
+      return;
+    }
+    bloomAddText(bl->head, bl->bytes, &tok, log->wBuff, len);
+  }
+}
+
+/*
+ * Offset of the first line starting at or after seek, 0 if not found
+ * in one search buffer
+ */
+static uint32_t lineStartFrom(circ_log_t *log, circular_FILE *file,
+                              uint32_t seek, int32_t space) {
+  uint32_t i, remaining, ret, len, pos = seek - 1;
+  /* Search buffer reused, drop the line window */
+  file->winLen = 0;
+  /* A line estimate at a time, most lines end in the first read */
+  while (pos < seek - 1 + file->buffLen && pos < (uint32_t)space) {
+    len = LINE_ESTIMATE(log);
+    if (len > space - pos) {
+      len = space - pos;
+    }
+    ret = circularReadSection(log, file->buff, file->tailPtr, file->headPtr,
+                              pos, space, len, &remaining);
+    if (ret == 0) {
+      return 0;
+    }
+    for (i = 0; i < ret; i++) {
+      if (file->buff[i] == '\n') {
+        return pos + i + 1;
+      }
+    }
+    pos += ret;
+  }
+  return 0;
+}
+
+/*
+ * Stored length of the large record starting at pos, checked against its
+ * footer, 0 for other lines. The footer is the first CIRC_REC_END past the
+ * length in the header, after as many bytes as the payload has escapes
+ */
+static uint32_t largeRecordAt(circ_log_t *log, circular_FILE *file,
+                              uint32_t pos, int32_t space) {
+  uint8_t hdr[CIRC_REC_MAX_HEADER], foot[CIRC_REC_FOOTER];
+  const uint8_t *end = NULL;
+  uint32_t len, at, remaining, n = space - pos;
+  if (n > CIRC_REC_MAX_HEADER) {
+    n = CIRC_REC_MAX_HEADER;
+  }
+  if (pos >= (uint32_t)space ||
+      circularReadSection(log, hdr, file->tailPtr, file->headPtr, pos, space,
+                          n, &remaining) != n) {
+    return 0;
+  }
+  len = recordLargeLen(hdr, recordHeaderLen(hdr, n));
+  if (len < CIRC_REC_FOOTER || len > space - pos) {
+    return 0;
+  }
+  /* Escapes at most double the payload */
+  for (at = pos + len - CIRC_REC_FOOTER; !end && at < (uint32_t)space &&
+                                         at - pos < 2 * len;
+       at += n) {
+    n = space - at < sizeof(foot) ? space - at : sizeof(foot);
+    if (circularReadSection(log, foot, file->tailPtr, file->headPtr, at,
+                            space, n, &remaining) != n) {
+      return 0;
+    }
+    if ((end = memchr(foot, CIRC_REC_END, n)) != NULL) {
+      n = end - foot;
+    }
+  }
+  if (!end ||
+      circularReadSection(log, foot, file->tailPtr, file->headPtr, at, space,
+                          CIRC_REC_FOOTER, &remaining) != CIRC_REC_FOOTER ||
+      recordFooterLen(foot) != at + CIRC_REC_FOOTER - pos) {
+    return 0;
+  }
+  return at + CIRC_REC_FOOTER - pos;
+}
+
+/* Length of the large record ending at end, checked against its header,
+ * 0 for other lines */
+static uint32_t largeRecordBefore(circ_log_t *log, circular_FILE *file,
+                                  uint32_t end, int32_t space) {
+  uint8_t foot[CIRC_REC_FOOTER];
+  uint32_t len, remaining;
+  if (end < CIRC_REC_FOOTER ||
+      circularReadSection(log, foot, file->tailPtr, file->headPtr,
+                          end - CIRC_REC_FOOTER, space, CIRC_REC_FOOTER,
+                          &remaining) != CIRC_REC_FOOTER) {
+    return 0;
+  }
+  len = recordFooterLen(foot);
+  if (len > end || largeRecordAt(log, file, end - len, space) != len) {
+    return 0;
+  }
+  return len;
+}
+
+/*
+ * Tests each sector once per file, tag map first. A sector that passed
+ * the bloom test and gave no line is counted false on leaving it.
+ */
+static uint32_t sectorExcludes(circ_log_t *log, circular_FILE *file,
+                               const sector_query_t *q, uint32_t pos) {
+  uint32_t sector =
+      SECTOR_OF(log, (file->tailPtr + pos) % log->logsLength);
+  if (sector == file->skipSector) {
+    return 0;
+  }
+  if (file->skipSector != BLOOM_NONE && !file->skipMatched) {
+    log->stats.bloomFalse++;
+  }
+  file->skipSector = sector;
+  file->skipMatched = 1;
+  if (q->tags && log->tagMap && !(log->tagMap[sector] & q->tags)) {
+    log->stats.tagSkipped++;
+    return 1;
+  }
+  if (!q->count) {
+    return 0;
+  }
+  log->stats.bloomChecked++;
+  if (!bloomTest(log, sector, q)) {
+    log->stats.bloomSkipped++;
+    return 1;
+  }
+  file->skipMatched = 0;
+  return 0;
+}
+
+/* Moves seekPos, a line start, past the lines starting in its sector */
+static uint32_t sectorSkipForward(circ_log_t *log, circular_FILE *file,
+                                  const sector_query_t *q, int32_t space) {
+  uint32_t next, start;
+  if ((!q->count && !q->tags) || file->seekPos >= (uint32_t)space ||
+      !sectorExcludes(log, file, q, file->seekPos)) {
+    return 0;
+  }
+  next = file->seekPos - SECTOR_OFFSET(log, file->seekPos) + SECTOR_SIZE(log);
+  start = next < (uint32_t)space ? lineStartFrom(log, file, next, space)
+                                 : (uint32_t)space;
+  if (!start) {
+    return 0;
+  }
+  file->seekPos = start;
+  return 1;
+}
+
+/* Moves seekPos, a line end, back over the lines starting in the sector
+ * holding it */
+static uint32_t sectorSkipBack(circ_log_t *log, circular_FILE *file,
+                               const sector_query_t *q, int32_t space) {
+  uint32_t first, start, skipped = 0;
+  uint32_t pos = file->seekPos;
+  if (!q->count && !q->tags) {
+    return 0;
+  }
+  while (pos && sectorExcludes(log, file, q, pos - 1)) {
+    start = (pos - 1) - SECTOR_OFFSET(log, pos - 1);
+    first = start ? lineStartFrom(log, file, start, space) : 0;
+    if ((start && !first) || first >= file->seekPos) {
+      break;
+    }
+    file->seekPos = first;
+    skipped = 1;
+    /* The line ending here started in an earlier sector */
+    pos = start;
+  }
+  return skipped;
+}
+
+/* Histogram query, see circularHistogram */
+typedef struct {
+  uint32_t start;
+  uint32_t width;
+  uint32_t *out;
+  uint32_t count;
+  uint8_t flags;
+} hist_query_t;
+
+/* Bytes of a line start read for its header and time */
+#define LINE_HEAD_LEN (CIRC_REC_MAX_HEADER + FLASH_MAX_DATE_LEN)
+
+static void statAdd(circ_log_t *log, uint32_t sector, uint32_t time,
+                    uint32_t tagBit) {
+  circ_log_sector_stat_t *st = &log->sectorStats[sector];
+  if (st->lines == 0 || time < st->first) {
+    st->first = time;
+  }
+  if (st->lines == 0 || time > st->last) {
+    st->last = time;
+  }
+  st->lines++;
+  if (tagBit & log->statTags) {
+    st->matched++;
+  }
+}
+
+/* Drops an erased or trimmed sector from the tag map and line counts */
+static void sectorMapsDrop(circ_log_t *log, uint32_t sector) {
+  if (log->mapsStale) {
+    return;
+  }
+  if (log->tagMap) {
+    log->tagMap[sector] = 0;
+  }
+  if (log->sectorStats) {
+    memset(&log->sectorStats[sector], 0, sizeof(circ_log_sector_stat_t));
+  }
+}
+
+static void sectorMapsReset(circ_log_t *log) {
+  log->mapsStale = 0;
+  if (log->tagMap) {
+    memset(log->tagMap, 0, SECTOR_COUNT(log) * sizeof(uint32_t));
+  }
+  if (log->sectorStats) {
+    memset(log->sectorStats, 0,
+           SECTOR_COUNT(log) * sizeof(circ_log_sector_stat_t));
+  }
+}
+
+/* One line start into the sector maps, or with q into its buckets. A line
+ * not counted may be cut at the tail, only its tag is kept */
+static void lineCount(circ_log_t *log, uint32_t addr, uint8_t *line,
+                      uint32_t n, uint32_t counted, hist_query_t *q) {
+  uint32_t tagBit = recordTagBit(line, recordHeaderLen(line, n));
+  uint32_t time, sector = SECTOR_OF(log, addr);
+  if (!q && log->tagMap) {
+    log->tagMap[sector] |= tagBit;
+  }
+  if (!counted || (!q && !log->sectorStats)) {
+    return;
+  }
+  line[n] = 0; /* parseTime reads a string */
+  time = recordTime(log, line, n);
+  if (time == RECORD_NO_TIME) {
+    return;
+  }
+  if (!q) {
+    statAdd(log, sector, time, tagBit);
+  } else if ((!(q->flags & CIRC_HIST_MATCHED) || (tagBit & log->statTags)) &&
+             time >= q->start && (time - q->start) / q->width < q->count) {
+    q->out[(time - q->start) / q->width]++;
+  }
+}
+
+/*
+ * Walks the lines starting in len bytes from log offset addr, reading on
+ * for the head of the last. The line at addr counts only when whole.
+ * return : 0 on IO error
+ */
+static uint32_t lineWalk(circ_log_t *log, uint32_t addr, uint32_t len,
+                         uint32_t whole, hist_query_t *q) {
+  uint8_t line[LINE_HEAD_LEN + 1];
+  uint32_t i, n, at, pos, lineLen = 0, inLine = 1, lineAddr = addr;
+  uint32_t end = calculateSpace(log, addr, log->LogFlashHeadPtr);
+  if (end > len + LINE_HEAD_LEN) {
+    end = len + LINE_HEAD_LEN;
+  }
+  for (pos = 0; pos < end; pos += n) {
+    at = (addr + pos) % log->logsLength;
+    n = end - pos;
+    if (n > log->wBuffLen) {
+      n = log->wBuffLen;
+    }
+    if (at + n > log->logsLength) {
+      n = log->logsLength - at;
+    }
+    if (log->read(log->baseAddress + at, log->wBuff, n) != n) {
+      return 0;
+    }
+    for (i = 0; i < n; i++) {
+      if (inLine) {
+        line[lineLen++] = log->wBuff[i];
+        if (lineLen == LINE_HEAD_LEN || log->wBuff[i] == '\n') {
+          lineCount(log, lineAddr, line, lineLen, whole, q);
+          inLine = 0;
+        }
+      }
+      if (log->wBuff[i] == '\n') {
+        if (pos + i + 1 >= len) {
+          return 1;
+        }
+        inLine = whole = 1;
+        lineLen = 0;
+        lineAddr = (at + i + 1) % log->logsLength;
+      }
+    }
+  }
+  if (inLine && lineLen) {
+    lineCount(log, lineAddr, line, lineLen, whole, q);
+  }
+  return 1;
+}
+
+/* Tag bits and timed line counts of every line starting in each live
+ * sector */
+static void sectorMapsBuild(circ_log_t *log) {
+  sectorMapsReset(log);
+  if (log->LogFlashHeadPtr < 0) {
+    return;
+  }
+  /* The line at the tail may be cut by the erase before it */
+  if (!lineWalk(log, (uint32_t)log->LogFlashTailPtr, calculateLogSpace(log),
+                0, NULL)) {
+    sectorMapsReset(log);
+    /* Unknown, never skip */
+    if (log->tagMap) {
+      memset(log->tagMap, 0xFF, SECTOR_COUNT(log) * sizeof(uint32_t));
+    }
+  }
+}
+
+/* Builds the sector maps a warm boot left, on their first use, mutex held.
+ * The walk reads through wBuff */
+static void sectorMapsEnsure(circ_log_t *log) {
+  if (log->mapsStale && stageFlush(log) == CIRC_LOG_ERR_NONE) {
+    sectorMapsBuild(log);
+  }
+}
+
+/* Keys a line must hold to start with filter, and the file tag mask */
+static void sectorQuery(circ_log_t *log, circular_FILE *file,
+                        sector_query_t *q, const char *filter) {
+  bloom_token_t tok;
+  const uint8_t *p = (const uint8_t *)filter;
+  q->count = 0;
+  q->tags = file->tagMask;
+  if (q->tags && log->mapsStale) {
+    FLASH_MUTEX_ENTER(log->osMutex);
+    sectorMapsEnsure(log);
+    FLASH_MUTEX_EXIT(log->osMutex);
+  }
+  if (!log->bloom || filter == NULL) {
+    return;
+  }
+  bloomTokenStart(&tok);
+  for (;; p++) {
+    if (*p && BLOOM_TOKEN(*p)) {
+      bloomTokenChar(&tok, *p);
+      continue;
+    }
+    if (tok.len && q->count < CIRC_BLOOM_MAX_KEYS) {
+      if (*p) {
+        q->hash[q->count++] = tok.hash; /* Whole token */
+      } else if (tok.len >= CIRC_BLOOM_PREFIX) {
+        q->hash[q->count++] = tok.prefixHash; /* May continue in the line */
+      }
+    }
+    if (!*p) {
+      return;
+    }
+    bloomTokenStart(&tok);
+  }
+}
+
+/* Sequence stamp of the line starting at addr, return : 1 if stamped */
+static uint32_t lineSeqRead(circ_log_t *log, uint32_t addr, uint32_t *seq) {
+  uint8_t hdr[CIRC_REC_MAX_HEADER];
+  uint32_t len = CIRC_REC_MAX_HEADER;
+  if (addr + len > log->logsLength) {
+    len = log->logsLength - addr;
+  }
+  if (log->read(log->baseAddress + addr, hdr, len) != len ||
+      !recordHeaderLen(hdr, len) || !(hdr[1] & CIRC_REC_SEQ)) {
+    return 0;
+  }
+  *seq = recordFieldDecode(
+      &hdr[(hdr[1] & CIRC_REC_TIME) ? 2 + RECORD_FIELD_LEN : 2]);
+  return 1;
+}
+
+/* Sequence stamp of the first line starting in sector, at its start or
+ * after its first line end, return : 1 if found */
+static uint32_t sectorSeqRead(circ_log_t *log, uint32_t sector, uint32_t *seq) {
+  uint32_t off, len, i;
+  uint32_t addr = sector * SECTOR_SIZE(log);
+  if (lineSeqRead(log, addr, seq)) {
+    return 1;
+  }
+  for (off = 0; off < SECTOR_SIZE(log); off += len) {
+    len = SECTOR_SIZE(log) - off;
+    if (len > log->wBuffLen) {
+      len = log->wBuffLen;
+    }
+    if (log->read(log->baseAddress + addr + off, log->wBuff, len) != len) {
+      return 0;
+    }
+    for (i = 0; i < len; i++) {
+      if (log->wBuff[i] == FLASH_ERASED) {
+        return 0;
+      } else if (log->wBuff[i] == '\n') {
+        return off + i + 1 < SECTOR_SIZE(log) &&
+               lineSeqRead(log, addr + off + i + 1, seq);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Head sector sequence from the newest stamp, normally in the head sector
+ * or the one before. Unstamped logs count from 0 at the tail */
+static void seqRecover(circ_log_t *log) {
+  uint32_t count = SECTOR_COUNT(log), back, live, head, seq;
+  log->headSeq = 0;
+  log->stampedSeq = 0xFFFFFFFF;
+  if (!log->sequenced || log->LogFlashHeadPtr < 0) {
+    return;
+  }
+  head = SECTOR_OF(log, log->LogFlashHeadPtr);
+  live = (head + count - SECTOR_OF(log, log->LogFlashTailPtr)) % count;
+  for (back = 0; back <= live; back++) {
+    if (sectorSeqRead(log, (head + count - back) % count, &seq)) {
+      log->headSeq = seq + back;
+      log->stampedSeq = back ? log->headSeq - 1 : log->headSeq;
+      return;
+    }
+  }
+  log->headSeq = live;
+  log->stampedSeq = live - 1;
+}
+
+/* Bytes of the log from seek, as stored or with text as text only */
+static uint32_t readLogRange(circ_log_t *log, uint8_t *buff, uint32_t seek,
+                             uint32_t desiredlen, uint32_t *remaining,
+                             uint8_t text) {
+  uint32_t ret = 0;
+  if (!log->circLogInit) {
+    return 0;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  int32_t space = calculateLogSpace(log);
+  if (desiredlen > (space - seek)) {
+    desiredlen = (space - seek);
+  }
+  ret =
+      circularReadSection(log, buff, log->LogFlashTailPtr, log->LogFlashHeadPtr,
+                          seek, space, desiredlen, remaining);
+  if (text) {
+    ret = stripSection(log, buff, ret, log->LogFlashTailPtr,
+                       log->LogFlashHeadPtr, seek, space);
+  }
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return ret;
+}
+
+/**
+* seek = Bytes from start of log
+* Record headers are dropped, those the range ends cut too, and large
+* records. The next range starts at seek + desiredlen
+ */
+uint32_t circularReadLogPartial(circ_log_t *log, uint8_t *buff,
+                               uint32_t seek, uint32_t desiredlen,
+                               uint32_t *remaining) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buff != NULL);
+  return readLogRange(log, buff, seek, desiredlen, remaining, 1);
+}
+
+/* Lends file a pool buffer when it has none, return : 0 if none free */
+static uint32_t fileBuffBorrow(circ_log_t *log, circular_FILE *file) {
+  circ_log_pool_t *pool = log->pool;
+  uint32_t i;
+  if (file->buff != NULL) {
+    return 1;
+  }
+  if (pool == NULL) {
+    return 0;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  for (i = 0; i < pool->count; i++) {
+    if (!(pool->busy & (1UL << i))) {
+      pool->busy |= 1UL << i;
+      file->buff = &pool->buff[i * pool->size];
+      file->buffLen = pool->size;
+      file->buffLent = 1;
+      break;
+    }
+  }
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return file->buff != NULL;
+}
+
+/* Returns a lent buffer to the pool, the line window goes with it */
+static void fileBuffRelease(circ_log_t *log, circular_FILE *file) {
+  if (!file->buffLent) {
+    return;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  log->pool->busy &= ~(1UL << ((file->buff - log->pool->buff) /
+                               log->pool->size));
+  FLASH_MUTEX_EXIT(log->osMutex);
+  file->buff = NULL;
+  file->buffLen = 0;
+  file->buffLent = 0;
+  file->winLen = 0;
+}
+
+/* Takes the log's head and tail for file, mutex held. return : space */
+static int32_t fileSnapshot(circ_log_t *log, circular_FILE *file) {
+  file->headPtr = log->LogFlashHeadPtr;
+  file->tailPtr = log->LogFlashTailPtr;
+  file->headSeq = log->headSeq;
+  /* Forward one sector if low space remaining, the writer erases trimmed
+   * sectors before the tail */
+  int32_t EraseSpace =
+      calculateErasedSpace(log) + log->trimPending * SECTOR_SIZE(log);
+  if (EraseSpace <
+      (int32_t)((SECTOR_SIZE(log) * 2) + (SECTOR_SIZE(log) / 2))) {
+    file->tailPtr += SECTOR_SIZE(log);
+  }
+  return calculateSpace(log, file->tailPtr, file->headPtr);
+}
+
+/*
+ * Moves a CIRC_FLAGS_FOLLOW file up to the log's head, keeping its place.
+ * Nothing is read while the head has not moved. A file overrun by the
+ * writer goes on from the oldest line
+ */
+static void fileFollow(circ_log_t *log, circular_FILE *file) {
+  uint32_t addr, behind;
+  int32_t space;
+  if (file->flags != CIRC_FLAGS_FOLLOW) {
+    return;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  if (file->headPtr == (uint32_t)log->LogFlashHeadPtr &&
+      file->headSeq == log->headSeq) {
+    FLASH_MUTEX_EXIT(log->osMutex);
+    return;
+  }
+  addr = (file->tailPtr + file->seekPos) % log->logsLength;
+  behind = log->headSeq - file->headSeq;
+  space = fileSnapshot(log, file);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  file->winLen = 0;
+  file->seekPos = (addr + log->logsLength - file->tailPtr) % log->logsLength;
+  if (file->seekPos > (uint32_t)space ||
+      behind >= SECTOR_COUNT(log) - 1) {
+    file->seekPos = space ? lineStartFrom(log, file, 1, space) : 0;
+  }
+}
+
+uint32_t circularFileOpen(circ_log_t *log, CIRC_FLAGS flags,
+                          circular_FILE *file) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  if (!log->circLogInit) {
+    return CIRC_LOG_ERR_INIT;
+  }
+  if (file->valid == FILE_MAGIC_MARKER) {
+    fileBuffRelease(log, file);
+  }
+  file->valid = 0;
+  file->buff = NULL;
+  file->buffLen = 0;
+  file->buffLent = 0;
+#if SEARCH_BUFF_SIZE
+  if (!log->pool) {
+    file->buff = file->wBuff;
+    file->buffLen = SEARCH_BUFF_SIZE;
+  }
+#endif
+  FLASH_MUTEX_ENTER(log->osMutex);
+  file->flags = flags;
+  uint32_t ret = 0;
+  uint32_t i, remaining;
+  int32_t space = fileSnapshot(log, file);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  file->seekPos = 0;
+  file->winPos = 0;
+  file->winLen = 0;
+  file->skipSector = BLOOM_NONE;
+  file->skipMatched = 0;
+  file->tagMask = 0;
+  file->recordLeft = 0;
+  switch (flags) {
+  default:
+  case CIRC_FLAGS_NEWEST:
+    file->seekPos = space;
+    break;
+  case CIRC_FLAGS_OLDEST:
+    /* Align with first line */
+    if (!fileBuffBorrow(log, file)) {
+      return CIRC_LOG_ERR_API;
+    }
+    ret = circularReadSection(log, file->buff, file->tailPtr, file->headPtr, 0,
+                              space, file->buffLen, &remaining);
+    for (i = 0; i < ret; i++) {
+      if (file->buff[i] == '\n') {
+        file->seekPos = i + 1;
+        break;
+      }
+    }
+    /* Tail inside a line longer than the buffer, a large record's */
+    for (i = ret + 1; !file->seekPos && ret && i < (uint32_t)space;
+         i += file->buffLen) {
+      file->seekPos = lineStartFrom(log, file, i, space);
+    }
+    if (file->seekPos == (uint32_t)space) {
+      file->seekPos = 0;
+    }
+    fileBuffRelease(log, file);
+    break;
+  }
+  
+  file->valid = FILE_MAGIC_MARKER;
+  return CIRC_LOG_ERR_NONE;
+}
+
+/*
+ * Position of the file's next forward line, valid across wraps and
+ * restarts. Needs log->sequenced
+ */
+uint32_t circularFileTell(circ_log_t *log, circular_FILE *file,
+                          circ_log_pos_t *pos) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(pos != NULL);
+  uint32_t count = SECTOR_COUNT(log);
+  uint32_t addr = (file->tailPtr + file->seekPos) % log->logsLength;
+  if (!log->sequenced || file->valid != FILE_MAGIC_MARKER) {
+    return CIRC_LOG_ERR_API;
+  }
+  pos->seq = file->headSeq - (SECTOR_OF(log, file->headPtr) + count -
+                              SECTOR_OF(log, addr)) %
+                                 count;
+  pos->offset = SECTOR_OFFSET(log, addr);
+  return CIRC_LOG_ERR_NONE;
+}
+
+/*
+ * Opens file at a position from circularFileTell. When it has been
+ * overwritten the file opens at the oldest line and lost holds the bytes
+ * skipped, 0 otherwise.
+ * return : CIRC_LOG_ERR_API, opened at the oldest line, when the position
+ * is ahead of the head, as after a clear and restart
+ */
+uint32_t circularFileOpenAt(circ_log_t *log, const circ_log_pos_t *pos,
+                            circular_FILE *file, uint32_t *lost) {
+  CIRCULAR_LOG_ASSERT(pos != NULL);
+  CIRCULAR_LOG_ASSERT(lost != NULL);
+  uint32_t ret = circularFileOpen(log, CIRC_FLAGS_OLDEST, file);
+  uint32_t headOff, back, sectors;
+  int32_t space;
+  *lost = 0;
+  if (ret != CIRC_LOG_ERR_NONE) {
+    return ret;
+  }
+  if (!log->sequenced) {
+    return CIRC_LOG_ERR_API;
+  }
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  headOff = SECTOR_OFFSET(log, file->headPtr);
+  sectors = file->headSeq - pos->seq;
+  if ((int32_t)sectors < 0 || pos->offset >= SECTOR_SIZE(log) ||
+      (sectors == 0 && pos->offset > headOff)) {
+    *lost = 0xFFFFFFFF;
+    return CIRC_LOG_ERR_API;
+  }
+  if (sectors > (0xFFFFFFFF - headOff) / SECTOR_SIZE(log)) {
+    *lost = 0xFFFFFFFF;
+    return CIRC_LOG_ERR_NONE;
+  }
+  /* Bytes back from the head */
+  back = sectors * SECTOR_SIZE(log) + headOff - pos->offset;
+  if (back <= (uint32_t)space) {
+    file->seekPos = space - back;
+  } else {
+    *lost = back - (space - file->seekPos);
+  }
+  return CIRC_LOG_ERR_NONE;
+}
+
+static int32_t readForward(circ_log_t* log, circular_FILE* file, void* buff,
+                            uint32_t buffLen, int32_t lines, char * filter) {
+  int32_t ret = 0;
+  int32_t totalRet = 0;
+  uint32_t filtered = 0;
+  int32_t space, emit;
+  int32_t i;
+  uint32_t remaining;
+  uint32_t filterLen = filter == NULL ? 0 : strlen(filter);
+  sector_query_t q;
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  /* Set seek to position */
+  if ((uint32_t)space == file->seekPos) {
+    return 0;
+  }
+
+  if (LINES_READ_ALL == lines) {
+    if ((space - file->seekPos) < buffLen) {
+      buffLen = space - file->seekPos;
+      if (!buffLen) {
+        return 0;
+      }
+    }
+    ret = circularReadSection(log, (uint8_t *)buff, file->tailPtr, file->headPtr,
+        file->seekPos, space, buffLen, &remaining);
+    file->seekPos += ret;
+    return stripSection(log, (uint8_t *)buff, ret, file->tailPtr,
+                        file->headPtr, file->seekPos - ret, space);
+  } else {
+    /* Read forward by line count, always staying line aligned */
+    sectorQuery(log, file, &q, filter);
+    while (lines) {
+      while (sectorSkipForward(log, file, &q, space)) {
+      }
+      if (file->seekPos >= (uint32_t)space) {
+        goto shortExit;
+      }
+
+      ret = circularReadSection(log, file->buff, file->tailPtr, file->headPtr,
+                                file->seekPos, space, file->buffLen,
+                                &remaining);
+      if (ret == 0) {
+        goto shortExit;
+      }
+      uint8_t *line = file->buff;
+      for (i = 0; i < ret; i++) {
+        if (file->buff[i] == '\n') {
           // Manage new line
-          uint32_t len = (&file->wBuff[i] - line + 1);
-          if (filter != NULL) {
-            if (memcmp((char *)line, filter, filterLen) == 0) {
-              filtered = 0;
-            } else {
-              filtered = 1;
-            }
-          } 
-          if (!filtered) {
-            if (len + totalRet > buffLen) {
+          uint32_t len = (&file->buff[i] - line + 1);
+          uint32_t hdrLen = recordHeaderLen(line, len);
+          uint32_t bodyLen = len - hdrLen;
+          if (recordLargeLen(line, hdrLen) ||
+              (q.tags && !(recordTagBit(line, hdrLen) & q.tags))) {
+            filtered = 1;
+          } else {
+            emit = lineEmit(log, &line[hdrLen], bodyLen, filter, filterLen,
+                            &((uint8_t *)buff)[totalRet], buffLen - totalRet,
+                            &bodyLen);
+            if (emit < 0) {
               goto shortExit;
             }
-            memcpy(&((uint8_t *)buff)[totalRet], line, len);
-            totalRet += len;
+            filtered = !emit;
+          }
+          if (!filtered) {
+            file->skipMatched = 1;
+            totalRet += bodyLen;
             lines--;
             if (lines == 0) {
               file->seekPos += len;
               break;
             }
           }
-
-          line = &file->wBuff[i + 1];
-          file->seekPos += len;
-          if (file->seekPos >= (uint32_t)space) {
-            goto shortExit;
+
+          line = &file->buff[i + 1];
+          file->seekPos += len;
+          if (file->seekPos >= (uint32_t)space) {
+            goto shortExit;
+          }
+          if (sectorSkipForward(log, file, &q, space)) {
+            /* Search buffer reused, read again from the new line */
+            break;
+          }
+        }
+      }
+      if (line == file->buff) {
+        /* Pass over a large record, else didn't find even one line so
+         * short circuit */
+        ret = largeRecordAt(log, file, file->seekPos, space);
+        if (!ret) {
+          goto shortExit;
+        }
+        file->seekPos += ret;
+      }
+    }
+  }
+shortExit:
+  return totalRet;
+}
+
+static uint32_t readBack(circ_log_t *log, circular_FILE *file, void *buff,
+                         uint32_t buffLen, int32_t lines, char *filter) {
+  uint32_t ret = 0;
+  int32_t totalRet = 0;
+  uint32_t filtered = 0;
+  uint32_t searchComplete = 0;
+  int32_t i, space, seekPos, seekLen, emit;
+  uint32_t remaining;
+  uint32_t filterLen = filter == NULL ? 0 : strlen(filter);
+  sector_query_t q;
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  sectorQuery(log, file, &q, filter);
+
+  /* Read reverse by line count, always staying line aligned */
+  while (lines && file->seekPos > 0 && !searchComplete) {
+    while (sectorSkipBack(log, file, &q, space)) {
+    }
+    if (file->seekPos == 0) {
+      break;
+    }
+    if (file->buffLen > file->seekPos) {
+      searchComplete = 1;
+      seekPos = 0;
+      seekLen = file->seekPos;
+    } else {
+      seekPos = file->seekPos - file->buffLen;
+      seekLen = file->buffLen;
+    }
+
+    ret = circularReadSection(log, file->buff, file->tailPtr, file->headPtr,
+                              seekPos, space, seekLen, &remaining);
+    if (ret == 0) {
+      goto shortExit;
+    }
+    uint32_t lineEnd = ret - 1;
+    for (i = ret - 2; i >= 0; i--) {
+      if (file->buff[i] == '\n') {
+        // Manage new line
+        uint32_t len = lineEnd - i;
+        uint32_t hdrLen = recordHeaderLen(&file->buff[i + 1], len);
+        uint32_t bodyLen = len - hdrLen;
+        if (recordLargeLen(&file->buff[i + 1], hdrLen) ||
+            (q.tags &&
+             !(recordTagBit(&file->buff[i + 1], hdrLen) & q.tags))) {
+          filtered = 1;
+        } else {
+          emit = lineEmit(log, &file->buff[i + 1 + hdrLen], bodyLen, filter,
+                          filterLen, &((uint8_t *)buff)[totalRet],
+                          buffLen - totalRet, &bodyLen);
+          if (emit < 0) {
+            goto shortExit;
+          }
+          filtered = !emit;
+        }
+        if (!filtered) {
+          file->skipMatched = 1;
+          totalRet += bodyLen;
+          lines--;
+        }
+        lineEnd = i;
+        file->seekPos -= len;
+        if (lines == 0) {
+          break;
+        }
+        if (sectorSkipBack(log, file, &q, space)) {
+          /* Search buffer reused, read again from the new line */
+          searchComplete = 0;
+          break;
+        }
+      }
+    }
+    if (lineEnd == ret - 1) {
+      /* Pass over a large record, else didn't find even one line so
+       * short circuit */
+      ret = largeRecordBefore(log, file, file->seekPos, space);
+      if (!ret) {
+        goto shortExit;
+      }
+      file->seekPos -= ret;
+      searchComplete = 0;
+    }
+  }
+shortExit:
+  return totalRet;
+}
+
+static uint32_t findLogAt(circ_log_t *log, void *buff, uint32_t buffLen,
+                          uint32_t time, uint32_t seekAddr) {
+  uint32_t ret, i;
+  uint32_t remaining;
+  uint32_t searchLen = 0;
+  int32_t space = calculateLogSpace(log);
+  uint32_t seekPos;
+  if ((int32_t)seekAddr >= log->LogFlashTailPtr) {
+    seekPos = seekAddr - log->LogFlashTailPtr;
+  } else { /* Wrap */
+    seekPos = (log->logsLength - log->LogFlashTailPtr) + seekAddr;
+  }
+
+  while (searchLen < INDEX_SLOT_SIZE(log) * 2) {
+    if ((uint32_t)space == seekPos) {
+      return 0;
+    }
+    ret = circularReadSection(log, log->wBuff, log->LogFlashTailPtr,
+                              log->LogFlashHeadPtr, seekPos, space,
+                              log->wBuffLen, &remaining);
+    if (ret == 0) {
+      return 0;
+    }
+    uint8_t *line = log->wBuff;
+    for (i = 0; i < ret; i++) {
+      if (log->wBuff[i] == '\n') {
+        uint32_t len = (&log->wBuff[i] - line + 1);
+        uint32_t logStamp = recordTime(log, line, len);
+        if (logStamp == time) {
+          uint32_t hdrLen = recordHeaderLen(line, len);
+          len = circularFormatLine(log, &line[hdrLen], len - hdrLen, buff,
+                                   buffLen);
+          return len > buffLen ? buffLen : len;
+        } else if (logStamp > time && logStamp != RECORD_NO_TIME) {
+          return 0; /* Didn't find */
+        }
+        line = &log->wBuff[i + 1];
+        seekPos += len;
+        searchLen += len;
+      }
+    }
+    if (line == log->wBuff) {
+      /* Not finding anything */
+      return 0;
+    }
+  }
+  return 0;
+}
+
+uint32_t indexedLogSearch(circ_log_t *log, void *buff, uint32_t buffLen,
+                          uint32_t time) {
+  int32_t sect;
+  uint32_t ret = 0;
+  uint32_t previous = 0xFFFFFFFF;
+  uint32_t pos;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buff != NULL);
+  CIRCULAR_LOG_ASSERT(INDEX_ENABLED(log));
+  if (!log->circLogInit) {
+    return 0;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  if (log->LogFlashHeadPtr < 0) {
+    goto found;
+  }
+  if (log->flashIndex) {
+    if (flashIndexFind(log, time, &pos)) {
+      ret = findLogAt(log, buff, buffLen, time, pos);
+    }
+    goto found;
+  }
+  int32_t headSect = (int32_t)INDEX_SLOT_OF(log, log->LogFlashHeadPtr);
+  int32_t tailSect = (int32_t)INDEX_SLOT_OF(log, log->LogFlashTailPtr);
+  // Search for enclosing log newest to oldest
+  if (log->LogFlashHeadPtr > log->LogFlashTailPtr) {
+    /* Normal */
+    for (sect = headSect; sect >= tailSect; sect--) {
+      if (time < previous && time >= indexTime(log, sect)) {
+        ret = findLogAt(log, buff, buffLen, time, slotLine(log, sect));
+        goto found;
+      }
+      previous = indexTime(log, sect);
+    }
+  } else {
+    /* Wrapped */
+    for (sect = headSect; sect >= 0; sect--) {
+      if (time < previous && time >= indexTime(log, sect)) {
+        ret = findLogAt(log, buff, buffLen, time, slotLine(log, sect));
+        goto found;
+      }
+      previous = indexTime(log, sect);
+    }
+    for (sect = (int32_t)INDEX_SLOTS(log) - 1; sect >= tailSect; sect--) {
+      if (time < previous && time >= indexTime(log, sect)) {
+        ret = findLogAt(log, buff, buffLen, time, slotLine(log, sect));
+        goto found;
+      }
+      previous = indexTime(log, sect);
+    }
+  }
+  found:
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return ret;
+}
+
+int32_t circularFileRead(circ_log_t *log, circular_FILE *file, void *buff,
+                          uint32_t buffLen, CIRC_DIR dir, int32_t lines,
+                          char *filter) {
+  int32_t ret;
+  if (file->valid != FILE_MAGIC_MARKER || !fileBuffBorrow(log, file)) {
+    return -CIRC_LOG_ERR_API;
+  }
+  /* Search buffer is reused below, drop the line window */
+  file->winLen = 0;
+  switch (dir) {
+  case CIRC_DIR_FORWARD:
+    fileFollow(log, file);
+    ret = readForward(log, file, buff, buffLen, lines, filter);
+    break;
+  case CIRC_DIR_REVERSE:
+    ret = readBack(log, file, buff, buffLen, lines, filter);
+    break;
+  default:
+    ret = -CIRC_LOG_ERR_API;
+    break;
+  }
+  fileBuffRelease(log, file);
+  return ret;
+}
+
+/*
+ * Returns the next line in place, pointing into the file search buffer,
+ * record header removed. The line is valid until the next call on this file.
+ * A buffer lent from the log pool is kept until circularFileRelease.
+ * return : line length including '\n', 0 at end of log
+ */
+int32_t circularFileGetLine(circ_log_t *log, circular_FILE *file, CIRC_DIR dir,
+                            const char **line) {
+  uint32_t remaining, i, end;
+  int32_t space;
+  sector_query_t q;
+  if (file->valid != FILE_MAGIC_MARKER || line == NULL ||
+      !fileBuffBorrow(log, file)) {
+    return -CIRC_LOG_ERR_API;
+  }
+  if (dir == CIRC_DIR_FORWARD) {
+    fileFollow(log, file);
+  }
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  sectorQuery(log, file, &q, NULL);
+  if (dir == CIRC_DIR_FORWARD) {
+    for (;;) {
+      while (sectorSkipForward(log, file, &q, space)) {
+      }
+      if (file->seekPos >= (uint32_t)space) {
+        return 0;
+      }
+      if (file->seekPos >= file->winPos &&
+          file->seekPos < file->winPos + file->winLen) {
+        const uint8_t *start = &file->buff[file->seekPos - file->winPos];
+        end = file->winPos + file->winLen;
+        const uint8_t *nl = memchr(start, '\n', end - file->seekPos);
+        if (nl != NULL) {
+          i = (uint32_t)(nl - start) + 1;
+          file->seekPos += i;
+          end = recordHeaderLen(start, i);
+          if (recordLargeLen(start, end) ||
+              (q.tags && !(recordTagBit(start, end) & q.tags))) {
+            continue;
+          }
+          *line = (const char *)&start[end];
+          return i - end;
+        }
+        if (file->winPos == file->seekPos) {
+          /* Line longer than search buffer, passed over when a large
+           * record, or unterminated */
+          i = largeRecordAt(log, file, file->seekPos, space);
+          if (!i) {
+            return 0;
+          }
+          file->seekPos += i;
+          continue;
+        }
+      }
+      file->winPos = file->seekPos;
+      file->winLen = space - file->seekPos;
+      if (file->winLen > file->buffLen) {
+        file->winLen = file->buffLen;
+      }
+      file->winLen =
+          circularReadSection(log, file->buff, file->tailPtr, file->headPtr,
+                              file->winPos, space, file->winLen, &remaining);
+      if (file->winLen == 0) {
+        return 0;
+      }
+    }
+  } else if (dir == CIRC_DIR_REVERSE) {
+    for (;;) {
+      uint32_t skipped = 0;
+      while (sectorSkipBack(log, file, &q, space)) {
+      }
+      if (file->seekPos < 2) {
+        return 0;
+      }
+      if (file->seekPos > file->winPos &&
+          file->seekPos <= file->winPos + file->winLen) {
+        for (i = file->seekPos - 1; i > file->winPos; i--) {
+          if (file->buff[i - 1 - file->winPos] == '\n') {
+            const uint8_t *start = &file->buff[i - file->winPos];
+            i = file->seekPos - i;
+            file->seekPos -= i;
+            end = recordHeaderLen(start, i);
+            if (recordLargeLen(start, end) ||
+                (q.tags && !(recordTagBit(start, end) & q.tags))) {
+              skipped = 1;
+              break;
+            }
+            *line = (const char *)&start[end];
+            return i - end;
+          }
+        }
+        if (skipped) {
+          continue;
+        }
+        if (file->winPos == 0 ||
+            file->seekPos - file->winPos >= file->buffLen) {
+          /* First partial line, or longer than search buffer unless a
+           * large record to pass over */
+          i = largeRecordBefore(log, file, file->seekPos, space);
+          if (!i) {
+            return 0;
           }
+          file->seekPos -= i;
+          continue;
+        }
+      }
+      file->winPos = file->seekPos > file->buffLen
+                         ? file->seekPos - file->buffLen
+                         : 0;
+      file->winLen =
+          circularReadSection(log, file->buff, file->tailPtr, file->headPtr,
+                              file->winPos, space,
+                              file->seekPos - file->winPos, &remaining);
+      if (file->winLen == 0) {
+        return 0;
+      }
+    }
+  }
+  return -CIRC_LOG_ERR_API;
+}
+
+/*
+ * Reads the log a record at a time from the file position, forward. A large
+ * record comes back in chunks of up to buffLen, escapes restored, with left
+ * holding its stored bytes still to come. Other lines come back whole, record
+ * header removed, or cut at buffLen
+ * return : bytes in buff, 0 at end of log
+ */
+int32_t circularFileReadRecord(circ_log_t *log, circular_FILE *file,
+                               void *buff, uint32_t buffLen, uint32_t *left) {
+  uint8_t *out = buff;
+  uint32_t remaining, i, j, n, hdrLen;
+  int32_t space;
+  if (file->valid != FILE_MAGIC_MARKER || buff == NULL || left == NULL ||
+      buffLen < CIRC_REC_MAX_HEADER) {
+    return -CIRC_LOG_ERR_API;
+  }
+  *left = 0;
+  if (!file->recordLeft && file->flags == CIRC_FLAGS_FOLLOW) {
+    if (!fileBuffBorrow(log, file)) {
+      return -CIRC_LOG_ERR_API;
+    }
+    fileFollow(log, file);
+    fileBuffRelease(log, file);
+  }
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  if (file->seekPos >= (uint32_t)space) {
+    return 0;
+  }
+  if (!file->recordLeft) {
+    n = space - file->seekPos < buffLen ? space - file->seekPos : buffLen;
+    n = circularReadSection(log, out, file->tailPtr, file->headPtr,
+                            file->seekPos, space, n, &remaining);
+    hdrLen = recordHeaderLen(out, n);
+    if (!recordLargeLen(out, hdrLen) ||
+        !(i = largeRecordAt(log, file, file->seekPos, space))) {
+      /* One line */
+      for (i = 0; i < n; i++) {
+        if (out[i] == '\n') {
+          n = i + 1;
+          break;
+        }
+      }
+      file->seekPos += n;
+      memmove(out, &out[hdrLen], n - hdrLen);
+      return n - hdrLen;
+    }
+    file->seekPos += hdrLen;
+    file->recordLeft = i - hdrLen - CIRC_REC_FOOTER;
+  }
+  n = file->recordLeft < buffLen ? file->recordLeft : buffLen;
+  n = circularReadSection(log, out, file->tailPtr, file->headPtr,
+                          file->seekPos, space, n, &remaining);
+  if (n > 1 && n < file->recordLeft && out[n - 1] == CIRC_REC_ESCAPE) {
+    /* Escapes come whole, this one with the next chunk */
+    n--;
+  }
+  file->seekPos += n;
+  file->recordLeft -= n;
+  if (!file->recordLeft) {
+    file->seekPos += CIRC_REC_FOOTER;
+  }
+  *left = file->recordLeft;
+  for (i = 0, j = 0; i < n; i++, j++) {
+    out[j] = out[i] == CIRC_REC_ESCAPE && i + 1 < n ? out[++i] ^ 0x20 : out[i];
+  }
+  return j;
+}
+
+#if CIRC_LOG_PARALLEL
+typedef struct {
+  uint32_t seek;   /* Line start */
+  uint32_t outEnd; /* Bytes of out up to and including the line */
+} search_match_t;
+
+/* One worker of circularFileSearch, lines starting in [start, end) */
+typedef struct {
+  circ_log_t *log;
+  circular_FILE *file;
+  int32_t space;
+  uint32_t start;
+  uint32_t end;
+  const char *filter;
+  uint32_t filterLen;
+  /* Matching lines, headers removed */
+  uint8_t *out;
+  uint32_t outLen;
+  uint32_t outSize;
+  search_match_t *match;
+  uint32_t count;
+  uint32_t matchSize;
+  /* Seek past the last whole line scanned */
+  uint32_t last;
+  uint32_t err;
+} search_chunk_t;
+
+/* Room for len more bytes of output, return : NULL out of memory */
+static uint8_t *searchReserve(search_chunk_t *c, uint32_t len) {
+  if (c->outLen + len > c->outSize) {
+    uint32_t size = c->outSize ? c->outSize * 2 : 1024;
+    uint8_t *out;
+    while (size < c->outLen + len) {
+      size *= 2;
+    }
+    out = realloc(c->out, size);
+    if (out == NULL) {
+      return NULL;
+    }
+    c->out = out;
+    c->outSize = size;
+  }
+  return &c->out[c->outLen];
+}
+
+/* Keeps the len bytes placed at the end of the output as a match */
+static uint32_t searchMatch(search_chunk_t *c, uint32_t len, uint32_t seek) {
+  if (c->count == c->matchSize) {
+    uint32_t size = c->matchSize ? c->matchSize * 2 : 64;
+    search_match_t *match = realloc(c->match, size * sizeof(search_match_t));
+    if (match == NULL) {
+      return 0;
+    }
+    c->match = match;
+    c->matchSize = size;
+  }
+  c->outLen += len;
+  c->match[c->count].seek = seek;
+  c->match[c->count++].outEnd = c->outLen;
+  return 1;
+}
+
+static uint32_t searchEmit(search_chunk_t *c, const uint8_t *line,
+                           uint32_t len, uint32_t seek) {
+  uint8_t *out = searchReserve(c, len);
+  if (out == NULL) {
+    return 0;
+  }
+  memcpy(out, line, len);
+  return searchMatch(c, len, seek);
+}
+
+/* Expands a formatted line into the output, kept if it passes the filter */
+static uint32_t searchEmitFormat(search_chunk_t *c, const uint8_t *body,
+                                 uint32_t len, uint32_t seek) {
+  uint32_t n = fmtText(c->log, body, len, NULL, 0);
+  uint8_t *out = searchReserve(c, n);
+  if (out == NULL) {
+    return 0;
+  }
+  fmtText(c->log, body, len, out, n);
+  if (c->filter != NULL &&
+      (n < c->filterLen || memcmp(out, c->filter, c->filterLen) != 0)) {
+    return 1;
+  }
+  return searchMatch(c, n, seek);
+}
+
+static void *searchWorker(void *arg) {
+  search_chunk_t *c = arg;
+  uint8_t *buf = malloc(CIRC_PARALLEL_READ_SIZE);
+  uint32_t pos = c->start, len, i, lineLen, hdrLen, remaining;
+  /* Chunks after the first start at a sector, maybe mid line */
+  uint32_t skip = c->start != c->file->seekPos;
+  const uint8_t *nl;
+  if (buf == NULL) {
+    c->err = CIRC_LOG_ERR_IO;
+    return NULL;
+  }
+  if (skip) {
+    pos--;
+  }
+  while (pos < c->end || (skip && pos < (uint32_t)c->space)) {
+    len = (uint32_t)c->space - pos;
+    if (len > CIRC_PARALLEL_READ_SIZE) {
+      len = CIRC_PARALLEL_READ_SIZE;
+    }
+    if (circularReadSection(c->log, buf, c->file->tailPtr, c->file->headPtr,
+                            pos, c->space, len, &remaining) != len) {
+      c->err = CIRC_LOG_ERR_IO;
+      break;
+    }
+    if (skip) {
+      /* Lines start after a '\n', the one in progress is the previous
+       * chunk's */
+      nl = memchr(buf, '\n', len);
+      pos += nl ? (uint32_t)(nl - buf) + 1 : len;
+      skip = nl == NULL;
+      c->last = pos;
+      continue;
+    }
+    for (i = 0; pos < c->end; i += lineLen, pos += lineLen) {
+      nl = memchr(&buf[i], '\n', len - i);
+      if (nl == NULL) {
+        break;
+      }
+      lineLen = (uint32_t)(nl - &buf[i]) + 1;
+      hdrLen = recordHeaderLen(&buf[i], lineLen);
+      if (recordLargeLen(&buf[i], hdrLen) ||
+          (c->file->tagMask &&
+           !(recordTagBit(&buf[i], hdrLen) & c->file->tagMask))) {
+        continue;
+      }
+      if (buf[i + hdrLen] == CIRC_FMT_MARKER) {
+        if (!searchEmitFormat(c, &buf[i + hdrLen], lineLen - hdrLen, pos)) {
+          c->err = CIRC_LOG_ERR_IO;
+          break;
+        }
+        continue;
+      }
+      if (c->filter != NULL &&
+          (lineLen - hdrLen < c->filterLen ||
+           memcmp(&buf[i + hdrLen], c->filter, c->filterLen) != 0)) {
+        continue;
+      }
+      if (!searchEmit(c, &buf[i + hdrLen], lineLen - hdrLen, pos)) {
+        c->err = CIRC_LOG_ERR_IO;
+        break;
+      }
+    }
+    c->last = pos;
+    if (c->err) {
+      break;
+    }
+    if (i == 0 && pos < c->end) {
+      if (len < CIRC_PARALLEL_READ_SIZE) {
+        /* Unterminated line at the head */
+        break;
+      }
+      /* Longer than the read buffer, pass over it */
+      pos += len;
+      skip = 1;
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Forward filtered read split over threads by sector, for hosted builds.
+ * Matches circularFileRead forward with the same filter, whole lines in log
+ * order. Stops when buff is full, seekPos is left at the first line not
+ * returned. log->read must be safe to call from several threads.
+ * return : bytes in buff, negative on error
+ */
+int32_t circularFileSearch(circ_log_t *log, circular_FILE *file, void *buff,
+                           uint32_t buffLen, char *filter, uint32_t threads) {
+  search_chunk_t chunk[CIRC_PARALLEL_MAX_THREADS];
+  pthread_t tid[CIRC_PARALLEL_MAX_THREADS];
+  uint8_t started[CIRC_PARALLEL_MAX_THREADS];
+  uint32_t n, t, k, per, base, totalRet = 0, full = 0;
+  int32_t space, err = 0;
+  if (file->valid != FILE_MAGIC_MARKER || buff == NULL) {
+    return -CIRC_LOG_ERR_API;
+  }
+  file->winLen = 0;
+  space = calculateSpace(log, file->tailPtr, file->headPtr);
+  if (file->seekPos >= (uint32_t)space) {
+    return 0;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (threads > CIRC_PARALLEL_MAX_THREADS) {
+    threads = CIRC_PARALLEL_MAX_THREADS;
+  }
+  /* Whole sectors per worker, boundaries on sector starts */
+  base = file->seekPos - SECTOR_OFFSET(log, file->seekPos);
+  per = (space - base + threads - 1) / threads;
+  per = (per + SECTOR_SIZE(log) - 1) / SECTOR_SIZE(log) * SECTOR_SIZE(log);
+  n = (space - base + per - 1) / per;
+  memset(chunk, 0, sizeof(chunk));
+  for (t = 0; t < n; t++) {
+    chunk[t].log = log;
+    chunk[t].file = file;
+    chunk[t].space = space;
+    chunk[t].start = t ? base + t * per : file->seekPos;
+    chunk[t].end = base + (t + 1) * per < (uint32_t)space
+                       ? base + (t + 1) * per
+                       : (uint32_t)space;
+    chunk[t].last = chunk[t].start;
+    chunk[t].filter = filter;
+    chunk[t].filterLen = filter == NULL ? 0 : strlen(filter);
+    /* The calling thread takes the first chunk */
+    started[t] =
+        t && pthread_create(&tid[t], NULL, searchWorker, &chunk[t]) == 0;
+  }
+  for (t = 0; t < n; t++) {
+    if (!started[t]) {
+      searchWorker(&chunk[t]);
+    }
+  }
+  for (t = 0; t < n; t++) {
+    if (started[t]) {
+      pthread_join(tid[t], NULL);
+    }
+  }
+  /* Merge in log order */
+  for (t = 0; t < n; t++) {
+    if (chunk[t].err) {
+      err = -(int32_t)chunk[t].err;
+    }
+    if (err || full) {
+      continue;
+    }
+    if (totalRet + chunk[t].outLen <= buffLen) {
+      memcpy(&((uint8_t *)buff)[totalRet], chunk[t].out, chunk[t].outLen);
+      totalRet += chunk[t].outLen;
+      file->seekPos = chunk[t].last;
+      continue;
+    }
+    /* Whole lines up to the buffer end, seek at the first one left */
+    for (k = 0; k < chunk[t].count &&
+                totalRet + chunk[t].match[k].outEnd <= buffLen;
+         k++) {
+    }
+    if (k) {
+      memcpy(&((uint8_t *)buff)[totalRet], chunk[t].out,
+             chunk[t].match[k - 1].outEnd);
+      totalRet += chunk[t].match[k - 1].outEnd;
+    }
+    file->seekPos = chunk[t].match[k].seek;
+    full = 1;
+  }
+  for (t = 0; t < n; t++) {
+    free(chunk[t].out);
+    free(chunk[t].match);
+  }
+  return err ? err : (int32_t)totalRet;
+}
+#endif
+
+uint32_t circularReadLines(circ_log_t *log, uint8_t *buff, uint32_t buffSize,
+                           uint32_t lines, char *filter,
+                           uint32_t estLineLength) {
+  uint32_t ret = 0;
+  uint32_t remaining;
+  int32_t space, seek, i;
+  uint32_t llen, searchLen;
+  uint32_t lastStart = 0;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buff != NULL);
+  if (estLineLength == 0) {
+    estLineLength = LINE_ESTIMATE(log);
+  }
+  if (buffSize < estLineLength) {
+    return 0;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  space = calculateLogSpace(log);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  searchLen = lines * estLineLength;
+  if (searchLen > buffSize - 1) {
+    searchLen = buffSize - 1;
+  }
+  seek = space - searchLen;
+  if (seek < 0) {
+    seek = 0;
+  }
+
+  ret = readLogRange(log, buff, seek, searchLen, &remaining, 0);
+  if (ret == 0) {
+    return 0;
+  }
+
+  // Search for "\n"
+  for (i = ret - 3; i >= 0; i--) {
+    if (buff[i] == '\n') {
+      lines--;
+      lastStart = i + 1;
+    }
+    if (lines == 0) {
+      ret -= (i + 1);
+      memcpy(buff, &buff[i + 1], ret);
+      buff[ret] = 0;
+      break;
+    }
+  }
+  if (lines && filter == NULL) {
+    // Finalize it
+    ret -= lastStart;
+    memmove(buff, &buff[lastStart], ret);
+  }
+  ret = linesEmit(log, buff, ret, buffSize - 1);
+  buff[ret] = 0;
+
+  if (filter != NULL) {
+    uint32_t FoundLength = 0;
+    uint8_t *LastLine = buff;
+    // Separate into lines
+    for (i = 0; i < (int32_t)ret; i++) {
+      if (buff[i] == '\n') {
+        buff[i] = 0;
+        if (strstr((char *)LastLine, filter) != NULL) {
+          buff[i] = '\n';
+          llen = (&buff[i] - LastLine) + 1;
+          memcpy(&buff[FoundLength], LastLine, llen);
+          FoundLength += llen;
+          buff[FoundLength] = 0;
+        }
+        buff[i] = '\n';
+        LastLine = &buff[i + 1];
+      }
+    }
+    if (FoundLength == 0) {
+      snprintf((char *)buff, buffSize,
+          "** Search item '%s' not found in %i lines **\r\n", filter,
+          lines);
+      ret = (uint32_t)strlen((char *)buff);
+    } else {
+      ret = FoundLength;
+      buff[FoundLength] = 0;
+    }
+  }
+  return ret;
+}
+
+uint32_t circularClearLog(circ_log_t *log) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  FLASH_MUTEX_ENTER(log->osMutex);
+  if (eraseRange(log, log->baseAddress, log->logsLength) !=
+      CIRC_LOG_ERR_NONE) {
+    FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
+    goto badexit;
+  }
+  FLASH_DEBUG("FLASH: (%s) Entire flash erased\r\n", log->name);
+  log->LogFlashTailPtr = log->LogFlashHeadPtr = 0;
+  log->trimPending = 0;
+  log->headSeq++;
+  if (INDEX_ENABLED(log)) {
+    indexReset(log);
+  }
+  if (log->bloom) {
+    bloomReset(log);
+  }
+  sectorMapsReset(log);
+  if (log->dedup) {
+    log->dedup->len = log->dedup->repeats = 0;
+  }
+  hintSave(log);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return CIRC_LOG_ERR_NONE;
+badexit:
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return CIRC_LOG_ERR_IO;
+}
+
+/* Stages len bytes at head, splitting at the end of the log */
+static uint32_t writeAtHead(circ_log_t *log, const uint8_t *buf,
+                            uint32_t len) {
+  uint32_t firstlen = len;
+  // Does it wrap?
+  if (log->LogFlashHeadPtr + len > log->logsLength) {
+    firstlen = log->logsLength - log->LogFlashHeadPtr;
+  }
+  if (stagePut(log, log->baseAddress + log->LogFlashHeadPtr, buf,
+               firstlen) != firstlen ||
+      stagePut(log, log->baseAddress, &buf[firstlen], len - firstlen) !=
+          len - firstlen) {
+    return 0;
+  }
+  log->LogFlashHeadPtr = (log->LogFlashHeadPtr + len) % log->logsLength;
+  return len;
+}
+
+/* Erases up to max trimmed sectors' worth of erase calls, oldest first,
+ * mutex held */
+static uint32_t trimErase(circ_log_t *log, uint32_t max) {
+  uint32_t addr, len, i;
+  while (max-- && log->trimPending) {
+    addr = (log->LogFlashTailPtr + log->logsLength -
+            log->trimPending * SECTOR_SIZE(log)) %
+           log->logsLength;
+    /* Up to the tail or the end of the log, whichever is first */
+    len = log->trimPending * SECTOR_SIZE(log);
+    if (addr + len > log->logsLength) {
+      len = log->logsLength - addr;
+    }
+    len = eraseSize(log, log->baseAddress + addr, len);
+    if (log->erase(log->baseAddress + addr, len) != len) {
+      FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
+      return CIRC_LOG_ERR_IO;
+    }
+    for (i = 0; i < len; i += SECTOR_SIZE(log)) {
+      if (log->bloom) {
+        bloomEraseSlot(log, SECTOR_OF(log, addr + i));
+      }
+      log->trimPending--;
+    }
+  }
+  return CIRC_LOG_ERR_NONE;
+}
+
+/* Bytes held in count fragments */
+static uint32_t iovLen(const circ_log_iov_t *iov, uint32_t count) {
+  uint32_t i, len = 0;
+  for (i = 0; i < count; i++) {
+    len += iov[i].len;
+  }
+  return len;
+}
+
+/* Longest large record, whole, leaving the head sector and two erased.
+ * 0 when the log is too short for large records */
+static uint32_t largeMax(circ_log_t *log) {
+  if (log->logsLength <= 4 * SECTOR_SIZE(log)) {
+    return 0;
+  }
+  return log->logsLength - 3 * SECTOR_SIZE(log);
+}
+
+/*
+ * Erases ahead of the head when it needs the space, mutex held. A record
+ * of len bytes over a sector has the sectors it spans erased first
+ */
+static uint32_t appendPrepare(circ_log_t *log, uint32_t len) {
+  int32_t EraseSpace;
+  int32_t need = SECTOR_SIZE(log) * 2;
+  uint32_t size, i;
+  if (len > SECTOR_SIZE(log)) {
+    need = len + SECTOR_SIZE(log);
+  }
+  do {
+    EraseSpace = calculateErasedSpace(log);
+    /* Staged lines go out ahead of any erase */
+    if (EraseSpace < need && stageFlush(log) != CIRC_LOG_ERR_NONE) {
+      return CIRC_LOG_ERR_IO;
+    }
+    if (EraseSpace == 0) {
+      // Erase it all
+      if (eraseRange(log, log->baseAddress, log->logsLength) !=
+          CIRC_LOG_ERR_NONE) {
+        FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
+        return CIRC_LOG_ERR_IO;
+      }
+      FLASH_DEBUG("FLASH: (%s) Entire flash erased\r\n", log->name);
+      log->LogFlashTailPtr = log->LogFlashHeadPtr = 0;
+      log->trimPending = 0;
+      log->headSeq++;
+      if (INDEX_ENABLED(log)) {
+        indexReset(log);
+      }
+      if (log->bloom) {
+        bloomReset(log);
+      }
+      sectorMapsReset(log);
+    } else if (EraseSpace < need && log->trimPending) {
+      // Trimmed sectors come before the tail
+      if (trimErase(log, 1) != CIRC_LOG_ERR_NONE) {
+        return CIRC_LOG_ERR_IO;
+      }
+    } else if (EraseSpace < need) {
+      // Erase next sectors in line, the shortfall at most, in the largest
+      // aligned block
+      size = (need - EraseSpace + SECTOR_SIZE(log) - 1) / SECTOR_SIZE(log) *
+             SECTOR_SIZE(log);
+      if (log->LogFlashTailPtr + size > log->logsLength) {
+        size = log->logsLength - log->LogFlashTailPtr;
+      }
+      size = eraseSize(log, log->baseAddress + log->LogFlashTailPtr, size);
+      if (log->erase(log->baseAddress + log->LogFlashTailPtr, size) != size) {
+        FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
+        return CIRC_LOG_ERR_IO;
+      }
+      FLASH_DEBUG("FLASH: (%s) 0x%X bytes at address 0x%X erased\r\n",
+                  log->name, size, log->baseAddress + log->LogFlashTailPtr);
+      for (i = 0; i < size; i += SECTOR_SIZE(log)) {
+        if (INDEX_ENABLED(log)) {
+          indexDropSector(log, SECTOR_OF(log, log->LogFlashTailPtr + i));
         }
+        if (log->bloom) {
+          bloomEraseSlot(log, SECTOR_OF(log, log->LogFlashTailPtr + i));
+        }
+        sectorMapsDrop(log, SECTOR_OF(log, log->LogFlashTailPtr + i));
       }
-      if (line == file->wBuff) {
-        /* Didn't find even one line so short circuit */
-        goto shortExit;
+      log->LogFlashTailPtr += size;
+      if (log->LogFlashTailPtr >= (int32_t)log->logsLength) {
+        log->LogFlashTailPtr = 0;
       }
     }
+    /* Large records loop until the space they span is erased */
+  } while (len > SECTOR_SIZE(log) && EraseSpace < need);
+  return CIRC_LOG_ERR_NONE;
+}
+
+/*
+ * Accounts a record staged from headStart to the head, mutex held
+ * param headSeq : sequence of the head sector when the header was made
+ * param text : line for parseTime, NULL when time is final
+ */
+static void appendDone(circ_log_t *log, uint8_t flags, uint32_t time,
+                       uint32_t tagBit, uint32_t headSeq, uint32_t headStart,
+                       const uint8_t *text) {
+  if (flags & CIRC_REC_SEQ) {
+    log->stampedSeq = headSeq;
+  }
+  log->headSeq += (SECTOR_OF(log, log->LogFlashHeadPtr) + SECTOR_COUNT(log) -
+                   SECTOR_OF(log, headStart)) %
+                  SECTOR_COUNT(log);
+
+  if (INDEX_ENABLED(log) &&
+      !indexHasSlot(log, INDEX_SLOT_OF(log, headStart))) {
+    if (time == RECORD_NO_TIME && log->parseTime && text) {
+      time = log->parseTime((const char *)text);
+    }
+    if (time != RECORD_NO_TIME) {
+      indexAddLine(log, time, headStart);
+    }
+  }
+  if (log->bloom) {
+    bloomHead(log);
+  }
+  if (log->mapsStale) {
+    return;
+  }
+  if (log->tagMap) {
+    log->tagMap[SECTOR_OF(log, headStart)] |= tagBit;
+  }
+  if (log->sectorStats) {
+    if (time == RECORD_NO_TIME && log->parseTime && text) {
+      time = log->parseTime((const char *)text);
+    }
+    if (time != RECORD_NO_TIME) {
+      statAdd(log, SECTOR_OF(log, headStart), time, tagBit);
+    }
   }
-shortExit:
-  return totalRet;
 }
 
-static uint32_t readBack(circ_log_t *log, circular_FILE *file, void *buff,
-                         uint32_t buffLen, int32_t lines, char *filter) {
-  uint32_t ret = 0;
-  int32_t totalRet = 0;
-  uint32_t filtered = 0;
-  uint32_t searchComplete = 0;
-  int32_t i, space, seekPos, seekLen;
-  uint32_t remaining;
-  uint32_t filterLen = filter == NULL ? 0 : strlen(filter);
-  space = calculateSpace(log, file->tailPtr, file->headPtr);
+/* Large record payload bytes stored as CIRC_REC_ESCAPE and the byte ^ 0x20 */
+#define REC_ESCAPED(c)                                                         \
+  ((c) == '\n' || (c) == FLASH_ERASED ||                                       \
+   ((c) >= CIRC_REC_END && (c) <= CIRC_REC_MARKER))
 
-  /* Read reverse by line count, always staying line aligned */
-  while (lines && file->seekPos > 0 && !searchComplete) {
-    if (SEARCH_BUFF_SIZE > file->seekPos) {
-      searchComplete = 1;
-      seekPos = 0;
-      seekLen = file->seekPos;
-    } else {
-      seekPos = file->seekPos - SEARCH_BUFF_SIZE;
-      seekLen = SEARCH_BUFF_SIZE;
+/* Escapes in the first *len bytes of buf, *len cut so that they take no
+ * more than room bytes escaped */
+static uint32_t escapeCount(const uint8_t *buf, uint32_t *len, uint32_t room) {
+  uint32_t i, esc = 0;
+  for (i = 0; i < *len; i++) {
+    if (i + esc + (REC_ESCAPED(buf[i]) ? 2 : 1) > room) {
+      *len = i;
+      break;
     }
+    esc += REC_ESCAPED(buf[i]);
+  }
+  return esc;
+}
 
-    ret = circularReadSection(log, file->wBuff, file->tailPtr, file->headPtr,
-                              seekPos, space, seekLen, &remaining);
-    if (ret == 0) {
-      goto shortExit;
+/* Stages large record payload escaped, the runs between escapes straight
+ * from buf */
+static uint32_t writeEscaped(circ_log_t *log, const uint8_t *buf,
+                             uint32_t len) {
+  uint8_t pair[2] = {CIRC_REC_ESCAPE, 0};
+  uint32_t n, done;
+  for (done = 0; done < len; done += n) {
+    for (n = 0; done + n < len && !REC_ESCAPED(buf[done + n]); n++) {
     }
-    uint32_t lineEnd = ret - 1;
-    for (i = ret - 2; i >= 0; i--) {
-      if (file->wBuff[i] == '\n') {
-        // Manage new line
-        uint32_t len = lineEnd - i;
-        char *lineStart = (char *)&file->wBuff[i + 1];
-        if (filter != NULL) {
-          if (memcmp(lineStart, filter, filterLen) == 0) {
-            filtered = 0;
-          } else {
-            filtered = 1;
-          }
-        } 
-        if (!filtered) {
-          if (len + totalRet > buffLen) {
-            goto shortExit;
-          }
-          memcpy(&((uint8_t *)buff)[totalRet], lineStart, len);
-          totalRet += len;
-          lines--;
-        }
-        lineEnd = i;
-        file->seekPos -= len;
-        if (lines == 0) {
-          break;
-        }
+    if (n && writeAtHead(log, &buf[done], n) != n) {
+      return 0;
+    }
+    if (done + n < len) {
+      pair[1] = buf[done + n] ^ 0x20;
+      if (writeAtHead(log, pair, 2) != 2) {
+        return 0;
       }
+      n++;
     }
-    if (lineEnd == ret - 1) {
-      /* Didn't find even one line so short circuit */
-      goto shortExit;
+  }
+  return len;
+}
+
+/* Stages the footer of a large record total bytes long, return : 1 */
+static uint32_t writeFooter(circ_log_t *log, uint32_t total) {
+  uint8_t foot[CIRC_REC_FOOTER];
+  foot[0] = CIRC_REC_END;
+  recordFieldEncode(&foot[1], total);
+  foot[CIRC_REC_FOOTER - 1] = '\n';
+  return writeAtHead(log, foot, CIRC_REC_FOOTER) == CIRC_REC_FOOTER;
+}
+
+/*
+ * Stages one record of count fragments at the head, mutex held, programmed
+ * by stageFlush. Records over a sector go out as one large record, up to
+ * largeMax. return : len or 0
+ */
+static uint32_t appendRecord(circ_log_t *log, uint8_t flags, uint32_t time,
+                             uint8_t tag, const circ_log_iov_t *iov,
+                             uint32_t count) {
+  uint8_t hdr[CIRC_REC_MAX_HEADER];
+  uint32_t hdrLen = 0, headSeq, len = iovLen(iov, count), left, n, i;
+  uint32_t esc = 0, room = largeMax(log) ? largeMax(log) -
+                                               CIRC_REC_MAX_HEADER -
+                                               CIRC_REC_FOOTER
+                                         : SECTOR_SIZE(log);
+  const uint8_t *text = iov[0].buf;
+  if (largeMax(log) && len + CIRC_REC_MAX_HEADER > SECTOR_SIZE(log)) {
+    /* Cut where the escaped payload fills room */
+    for (i = 0, len = 0; i < count; i++) {
+      n = iov[i].len;
+      esc += escapeCount(iov[i].buf, &n, room - len - esc);
+      len += n;
+      if (n < iov[i].len) {
+        break;
+      }
     }
+  } else if (len > room) {
+    len = room;
   }
-shortExit:
-  return totalRet;
+  if (appendPrepare(log, len + esc + CIRC_REC_MAX_HEADER + CIRC_REC_FOOTER) !=
+      CIRC_LOG_ERR_NONE) {
+    return 0;
+  }
+  /* The first line starting in each sector carries its sequence */
+  headSeq = log->headSeq;
+  if (log->sequenced && log->stampedSeq != headSeq) {
+    flags |= CIRC_REC_SEQ;
+  }
+  if (flags) {
+    hdrLen = recordHeaderEncode(hdr, flags, time, headSeq, 0, tag);
+  }
+  if (len + hdrLen > SECTOR_SIZE(log) && largeMax(log)) {
+    /* Length known once the header is, the record is not indexed */
+    flags |= CIRC_REC_LEN;
+    hdrLen = recordHeaderEncode(hdr, flags, time, headSeq, 0, tag);
+    hdrLen = recordHeaderEncode(hdr, flags, time, headSeq,
+                                hdrLen + len + CIRC_REC_FOOTER, tag);
+    time = RECORD_NO_TIME;
+    text = NULL;
+  } else if (len + hdrLen > SECTOR_SIZE(log)) {
+    len = SECTOR_SIZE(log) - hdrLen;
+  }
+  /* store write position */
+  uint32_t headStart = log->LogFlashHeadPtr;
+  if (hdrLen && writeAtHead(log, hdr, hdrLen) != hdrLen) {
+    return 0;
+  }
+  for (i = 0, left = len; i < count && left; i++, left -= n) {
+    n = iov[i].len < left ? iov[i].len : left;
+    if (((flags & CIRC_REC_LEN) ? writeEscaped(log, iov[i].buf, n)
+                                : writeAtHead(log, iov[i].buf, n)) != n) {
+      return 0;
+    }
+  }
+  if ((flags & CIRC_REC_LEN) &&
+      !writeFooter(log, hdrLen + len + esc + CIRC_REC_FOOTER)) {
+    return 0;
+  }
+  if (log->bloom) {
+    /* Line readers pass over large records, their words are not entered */
+    bloomLine(log, headStart, iov, count, text ? len : 0);
+  }
+  appendDone(log, flags, time, recordTagBit(hdr, hdrLen), headSeq, headStart,
+             text);
+  return len;
 }
 
-static uint32_t findLogAtSector(circ_log_t *log, void *buff, uint32_t buffLen,
-                                uint32_t time, int32_t sector) {
-  uint32_t ret, i;
-  uint32_t remaining;
-  uint32_t searchLen = 0;
-  int32_t space = calculateLogSpace(log);
-  uint32_t seekPos;
-  uint32_t seekAddr =
-      (sector * FLASH_SECTOR_SIZE) + log->index[sector].firstLine;
-  if ((int32_t)seekAddr >= log->LogFlashTailPtr) {
-    seekPos = seekAddr - log->LogFlashTailPtr;
-  } else { /* Wrap */
-    seekPos = (log->logsLength - log->LogFlashTailPtr) + seekAddr;
+/* Writes the pending repeat count after the last repeat's prefix */
+static void dedupFlush(circ_log_t *log) {
+  circ_log_dedup_t *d = log->dedup;
+  char line[FLASH_MAX_DATE_LEN + 48];
+  uint32_t len = d->prefixLen;
+  if (!d->repeats) {
+    return;
+  }
+  memcpy(line, d->prefix, len);
+  len += snprintf(&line[len], sizeof(line) - len,
+                  "last message repeated %u times\r\n", (unsigned)d->repeats);
+  d->repeats = 0;
+  circ_log_iov_t iov = {(uint8_t *)line, len};
+  appendRecord(log, d->flags, d->time, d->tag, &iov, 1);
+}
+
+/* Counts a line equal to the last one past its prefix, return : 1 if
+ * it is not to be written */
+static uint32_t dedupRepeat(circ_log_t *log, uint8_t flags, uint32_t time,
+                            uint8_t tag, const circ_log_iov_t *iov,
+                            uint32_t count) {
+  circ_log_dedup_t *d = log->dedup;
+  uint32_t i, j, n, len = iovLen(iov, count), skip = 0, same;
+  uint32_t hash = (2166136261u ^ tag) * 16777619u;
+  /* Formatted records keep their stamp in the header */
+  if (len > d->skip && !(iov[0].len && iov[0].buf[0] == CIRC_FMT_MARKER)) {
+    skip = d->skip;
+  }
+  for (i = 0, n = 0; i < count; n += iov[i++].len) {
+    for (j = n < skip ? skip - n : 0; j < iov[i].len; j++) {
+      hash = (hash ^ iov[i].buf[j]) * 16777619u;
+    }
+  }
+  same = d->len && hash == d->hash && len == d->len &&
+         len - skip == d->lastLen;
+  /* Lines the copy holds are compared byte for byte */
+  for (i = 0, n = 0; same && d->lastLen <= CIRC_DEDUP_LINE_MAX && i < count;
+       n += iov[i++].len) {
+    j = n < skip ? skip - n : 0;
+    if (j < iov[i].len && memcmp(&d->last[n + j - skip], &iov[i].buf[j],
+                                 iov[i].len - j) != 0) {
+      same = 0;
+    }
+  }
+  if (same) {
+    if (!d->repeats && d->now) {
+      d->first = d->now();
+    }
+    d->repeats++;
+    log->stats.repeatsCollapsed++;
+    /* Timestamp and stamp of the latest repeat go with the count */
+    for (i = 0, n = 0; n < skip; n += j, i++) {
+      j = iov[i].len < skip - n ? iov[i].len : skip - n;
+      memcpy(&d->prefix[n], iov[i].buf, j);
+    }
+    d->prefixLen = skip;
+    d->time = time;
+    if (d->timeout && d->now && d->now() - d->first >= d->timeout) {
+      dedupFlush(log);
+    }
+    return 1;
+  }
+  dedupFlush(log);
+  d->hash = hash;
+  d->len = len;
+  d->lastLen = len - skip;
+  for (i = 0, n = 0; d->lastLen <= CIRC_DEDUP_LINE_MAX && i < count;
+       n += iov[i++].len) {
+    j = n < skip ? skip - n : 0;
+    if (j < iov[i].len) {
+      memcpy(&d->last[n + j - skip], &iov[i].buf[j], iov[i].len - j);
+    }
   }
+  d->flags = flags;
+  d->tag = tag;
+  return 0;
+}
 
-  while (searchLen < FLASH_SECTOR_SIZE * 2) {
-    if ((uint32_t)space == seekPos) {
+/* First bucket of log->limit covering tag, NULL if none */
+static circ_log_limit_t *limitBucket(circ_log_t *log, uint8_t tag) {
+  uint32_t i;
+  for (i = 0; i < log->limitCount; i++) {
+    if (!log->limit[i].tags || (log->limit[i].tags & CIRC_TAG_BIT(tag))) {
+      return &log->limit[i];
+    }
+  }
+  return NULL;
+}
+
+/* Token bucket admission, return : 1 to write the line */
+static uint32_t limitAdmit(circ_log_t *log, circ_log_limit_t *b, uint8_t tag,
+                           uint32_t len) {
+  uint32_t now = b->now(), elapsed = now - b->last;
+  b->last = now;
+  /* Refill, capped at burst without overflowing */
+  if (b->rate && elapsed >= (b->burst - b->tokens) / b->rate + 1) {
+    b->tokens = b->burst;
+  } else {
+    b->tokens += elapsed * b->rate;
+  }
+  if (b->tokens >= (int32_t)len) {
+    b->tokens -= len;
+    return 1;
+  }
+  /* Over budget, critical lines always pass and sampled ones one in n */
+  if ((b->criticalTags & CIRC_TAG_BIT(tag)) ||
+      ((b->sampleTags & CIRC_TAG_BIT(tag)) && b->sampleEvery &&
+       ++b->sampled % b->sampleEvery == 0)) {
+    /* Debt limited to one burst */
+    b->tokens -= len;
+    if (b->tokens < -(int32_t)b->burst) {
+      b->tokens = -(int32_t)b->burst;
+    }
+    return 1;
+  }
+  b->dropped++;
+  log->stats.rateDropped++;
+  if (log->dedup) {
+    /* Never stored, its repeats are not to be counted */
+    log->dedup->len = 0;
+  }
+  return 0;
+}
+
+/* Records the lines b dropped, stamped and tagged like the line at hand so
+ * the index and filters place it alongside */
+static void limitReport(circ_log_t *log, circ_log_limit_t *b, uint8_t flags,
+                        uint32_t time, uint8_t tag, const uint8_t *buf) {
+  char line[48];
+  uint32_t len;
+  if (!(flags & CIRC_REC_TIME) && log->parseTime) {
+    time = log->parseTime((const char *)buf);
+    if (time != RECORD_NO_TIME) {
+      flags |= CIRC_REC_TIME;
+    }
+  }
+  len = snprintf(line, sizeof(line), "rate limit dropped %u lines\r\n",
+                 (unsigned)b->dropped);
+  b->dropped = 0;
+  b->reported = b->last;
+  circ_log_iov_t iov = {(uint8_t *)line, len};
+  appendRecord(log, flags, time, tag, &iov, 1);
+}
+
+/* Rate limit of the line in buf, the drops reported every reportEvery
+ * ticks whether it passes or not, return : 1 to write the line */
+static uint32_t limitLine(circ_log_t *log, uint8_t flags, uint32_t time,
+                          uint8_t tag, const uint8_t *buf, uint32_t len) {
+  circ_log_limit_t *b;
+  uint32_t admit;
+  if (!log->limit || (b = limitBucket(log, tag)) == NULL) {
+    return 1;
+  }
+  admit = limitAdmit(log, b, tag, len);
+  if (b->dropped && b->last - b->reported >= b->reportEvery) {
+    limitReport(log, b, flags, time, tag, buf);
+  }
+  return admit;
+}
+
+/*
+ * Mutex held, the line is left staged for stageFlush. The line start, for
+ * parseTime and parseTag, is in the first fragment
+ * param flags : CIRC_REC_ header fields to store, 0 for none
+ * param time : stamp for the index, RECORD_NO_TIME to parse the line
+ * param tag : with CIRC_REC_TAG, else from parseTag when set
+ * return : len, 0 on IO error or when dropped by the rate limit
+ */
+static uint32_t commitRecord(circ_log_t *log, uint8_t flags, uint32_t time,
+                             uint8_t tag, const circ_log_iov_t *iov,
+                             uint32_t count) {
+  uint32_t len = iovLen(iov, count);
+  if (!(flags & CIRC_REC_TAG) && log->parseTag) {
+    tag = log->parseTag((const char *)iov[0].buf);
+    flags |= CIRC_REC_TAG;
+  }
+  CIRCULAR_LOG_ASSERT(tag < CIRC_TAG_COUNT);
+  if (log->dedup && dedupRepeat(log, flags, time, tag, iov, count)) {
+    return len;
+  }
+  if (!limitLine(log, flags, time, tag, iov[0].buf, len)) {
+    return 0;
+  }
+  return appendRecord(log, flags, time, tag, iov, count);
+}
+
+/*
+ * Formats a line straight into the stage at the head, mutex held. Formats
+ * again when dedup or the rate limit write ahead of it. Lines are cut to
+ * the stage, wBuffLen less the head's offset in its page
+ * return : line length, 0 on IO error or when dropped by the rate limit
+ */
+static uint32_t printRecord(circ_log_t *log, const char *fmt, va_list ap) {
+  uint32_t room = WRITE_OF(log, log->wBuffLen) * WRITE_SIZE(log);
+  uint32_t head, headSeq, hdrLen, stageLen, avail, len, first, time;
+  uint8_t flags, tag = 0, decided = 0, *text;
+  circ_log_iov_t iov;
+  va_list aq;
+  int32_t n;
+  for (;;) {
+    if (appendPrepare(log, 0) != CIRC_LOG_ERR_NONE) {
       return 0;
     }
-    ret = circularReadSection(log, log->wBuff, log->LogFlashTailPtr,
-                              log->LogFlashHeadPtr, seekPos, space,
-                              log->wBuffLen, &remaining);
-    if (ret == 0) {
+    head = log->LogFlashHeadPtr;
+    if (log->stageLen &&
+        log->stageAddr + log->stageLen != log->baseAddress + head &&
+        stageFlush(log) != CIRC_LOG_ERR_NONE) {
       return 0;
     }
-    uint8_t *line = log->wBuff;
-    for (i = 0; i < ret; i++) {
-      if (log->wBuff[i] == '\n') {
-        uint32_t len = (&log->wBuff[i] - line + 1);
-        uint32_t logStamp = log->parseTime((const char *)line);
-        if (logStamp == time) {
-          len = len > buffLen ? buffLen : len;
-          memcpy(buff, line, len);
-          return len;
-        } else if (logStamp > time) {
-          return 0; /* Didn't find */
+    if (log->stageLen == 0) {
+      stageStart(log, log->baseAddress + head);
+    }
+    /* Room for the header, its tag filled in once the text is known */
+    headSeq = log->headSeq;
+    flags = log->parseTag ? CIRC_REC_TAG : 0;
+    if (log->sequenced && log->stampedSeq != headSeq) {
+      flags |= CIRC_REC_SEQ;
+    }
+    hdrLen = flags ? 2 + (flags & CIRC_REC_SEQ ? RECORD_FIELD_LEN : 0) +
+                         (flags & CIRC_REC_TAG ? 1 : 0)
+                   : 0;
+    stageLen = log->stageLen;
+    avail = room - stageLen > hdrLen ? room - stageLen - hdrLen : 0;
+    text = &log->wBuff[stageLen + hdrLen];
+    len = 0;
+    if (avail > 2) {
+      if (log->printPrefix) {
+        len = log->printPrefix((char *)text, avail);
+        if (len >= avail) {
+          len = avail - 1;
         }
-        line = &log->wBuff[i + 1];
-        seekPos += len;
-        searchLen += len;
       }
+      va_copy(aq, ap);
+      n = vsnprintf((char *)&text[len], avail - len, fmt, aq);
+      va_end(aq);
+      if (n < 0) {
+        return 0;
+      }
+      len += n;
     }
-    if (line == log->wBuff) {
-      /* Not finding anything */
+    if (avail <= 2 || len >= avail) {
+      /* Earlier lines out of the way for the whole stage */
+      if (stageLen > WRITE_OFFSET(log, head)) {
+        if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+          return 0;
+        }
+        continue;
+      }
+      if (avail <= 2) {
+        return 0;
+      }
+      len = avail - 1;
+      text[len - 1] = '\n';
+    }
+    if (len + hdrLen > SECTOR_SIZE(log)) {
+      len = SECTOR_SIZE(log) - hdrLen;
+    }
+    iov.buf = text;
+    iov.len = len;
+    if (decided) {
+      break;
+    }
+    /* As commitRecord, once */
+    decided = 1;
+    if (log->parseTag) {
+      tag = log->parseTag((const char *)text);
+    }
+    CIRCULAR_LOG_ASSERT(tag < CIRC_TAG_COUNT);
+    if (log->dedup && dedupRepeat(log, flags & CIRC_REC_TAG, RECORD_NO_TIME,
+                                  tag, &iov, 1)) {
+      return len;
+    }
+    if (!limitLine(log, flags & CIRC_REC_TAG, RECORD_NO_TIME, tag, text,
+                   len)) {
+      return 0;
+    }
+    /* Unless a line went ahead, over the text */
+    if (log->LogFlashHeadPtr == (int32_t)head && log->stageLen == stageLen) {
+      break;
+    }
+  }
+  if (hdrLen) {
+    recordHeaderEncode(&log->wBuff[stageLen], flags, 0, headSeq, 0, tag);
+  }
+  time = RECORD_NO_TIME;
+  if (((INDEX_ENABLED(log) && !indexHasSlot(log, INDEX_SLOT_OF(log, head))) ||
+       log->sectorStats) &&
+      log->parseTime) {
+    time = log->parseTime((const char *)text);
+  }
+  if (log->bloom) {
+    bloomLine(log, head, &iov, 1, len);
+  }
+  /* The line joins the stage, the part past the end of the log moved to
+   * the front for the base address */
+  first = hdrLen + len;
+  if (head + first > log->logsLength) {
+    first = log->logsLength - head;
+    log->stageLen += first;
+    if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
       return 0;
     }
+    memmove(log->wBuff, &log->wBuff[stageLen + first], hdrLen + len - first);
+    log->stageAddr = log->baseAddress;
+    log->stageLen = hdrLen + len - first;
+  } else {
+    log->stageLen += first;
+  }
+  log->LogFlashHeadPtr = (head + hdrLen + len) % log->logsLength;
+  appendDone(log, flags, time, CIRC_TAG_BIT(tag), headSeq, head, NULL);
+  if (log->stageLen == room && stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    return 0;
+  }
+  return len;
+}
+
+/* Releases the mutex after a write, waking followers if it moved the
+ * head from head */
+static void writeUnlock(circ_log_t *log, int32_t head) {
+  uint32_t moved = head != log->LogFlashHeadPtr;
+  hintSave(log);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  if (moved && log->onAppend) {
+    log->onAppend();
+  }
+}
+
+/* One line from one buffer, see commitRecord */
+static uint32_t writeRecord(circ_log_t *log, uint8_t flags, uint32_t time,
+                            uint8_t tag, uint8_t *buf, uint32_t len) {
+  circ_log_iov_t iov = {buf, len};
+  int32_t head;
+  FLASH_MUTEX_ENTER(log->osMutex);
+  head = log->LogFlashHeadPtr;
+  len = commitRecord(log, flags, time, tag, &iov, 1);
+  if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    len = 0;
+  }
+  writeUnlock(log, head);
+  return len;
+}
+
+/*
+ *
+ */
+uint32_t circularWriteLog(circ_log_t *log, uint8_t *buf, uint32_t len) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buf != NULL);
+  return writeRecord(log, 0, RECORD_NO_TIME, 0, buf, len);
+}
+
+/*
+ * Stores time in a binary record header, index build and
+ * indexedLogSearch then skip parseTime for this line
+ */
+uint32_t circularWriteLogStamped(circ_log_t *log, uint32_t time, uint8_t *buf,
+                                 uint32_t len) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buf != NULL);
+  CIRCULAR_LOG_ASSERT(time != RECORD_NO_TIME);
+  return writeRecord(log, CIRC_REC_TIME, time, 0, buf, len);
+}
+
+/*
+ * Stores a tag id (severity or module) in the record header, lines are
+ * then selected with circularFileSetTags without reading the text
+ */
+uint32_t circularWriteLogTagged(circ_log_t *log, uint8_t tag, uint8_t *buf,
+                                uint32_t len) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buf != NULL);
+  return writeRecord(log, CIRC_REC_TAG, RECORD_NO_TIME, tag, buf, len);
+}
+
+/*
+ * Writes count fragments as one line, such as a prefix, a message and its
+ * CRLF, without joining them first. The line start, for parseTime and
+ * parseTag, must be in the first fragment
+ * return : line length, 0 on IO error or when dropped by the rate limit
+ */
+uint32_t circularWriteLogV(circ_log_t *log, const circ_log_iov_t *iov,
+                           uint32_t count) {
+  uint32_t len;
+  int32_t head;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(iov != NULL && count > 0);
+  FLASH_MUTEX_ENTER(log->osMutex);
+  head = log->LogFlashHeadPtr;
+  len = commitRecord(log, 0, RECORD_NO_TIME, 0, iov, count);
+  if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    len = 0;
+  }
+  writeUnlock(log, head);
+  return len;
+}
+
+/*
+ * Formats a line with vsnprintf straight into the page staging buffer, no
+ * line buffer needed on the caller's stack. log->printPrefix, when set,
+ * writes the start of the line such as a timestamp. The line is held in
+ * wBuff, longer ones are cut to it and end in '\n'
+ * return : line length, 0 on IO error or when dropped by the rate limit
+ */
+uint32_t circularVPrintf(circ_log_t *log, const char *fmt, va_list ap) {
+  uint32_t len;
+  int32_t head;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(fmt != NULL);
+  FLASH_MUTEX_ENTER(log->osMutex);
+  head = log->LogFlashHeadPtr;
+  len = printRecord(log, fmt, ap);
+  if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    len = 0;
+  }
+  writeUnlock(log, head);
+  return len;
+}
+
+uint32_t circularPrintf(circ_log_t *log, const char *fmt, ...) {
+  uint32_t len;
+  va_list ap;
+  va_start(ap, fmt);
+  len = circularVPrintf(log, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+/*
+ * Writes count lines, each as from circularWriteLog, under one mutex hold.
+ * Lines are packed back to back into page programs of up to wBuffLen bytes
+ * return : lines written, those dropped by the rate limit not counted,
+ * 0 on IO error
+ */
+uint32_t circularWriteLogBatch(circ_log_t *log, const circ_log_iov_t *lines,
+                               uint32_t count) {
+  uint32_t i, written = 0;
+  int32_t head;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(lines != NULL || count == 0);
+  FLASH_MUTEX_ENTER(log->osMutex);
+  head = log->LogFlashHeadPtr;
+  for (i = 0; i < count; i++) {
+    if (commitRecord(log, 0, RECORD_NO_TIME, 0, &lines[i], 1)) {
+      written++;
+    }
+  }
+  if (stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    written = 0;
   }
-  return 0;
+  writeUnlock(log, head);
+  return written;
 }
 
-uint32_t indexedLogSearch(circ_log_t *log, void *buff, uint32_t buffLen,
-                          uint32_t time) {
-  int32_t sect;
-  uint32_t ret = 0;
-  uint32_t previous = 0xFFFFFFFF;
+/*
+ * Starts a large record of len payload bytes, any values, a crash dump or
+ * trace longer than a sector. The sectors it spans are erased first, the payload then
+ * streams through circularRecordWrite and wBuff, never held whole in RAM.
+ * The log stays locked until circularRecordEnd
+ * return : CIRC_LOG_ERR_API, not started, when len is over the log less
+ * 3 sectors
+ */
+uint32_t circularRecordBegin(circ_log_t *log, uint8_t tag, uint32_t len) {
+  uint8_t hdr[CIRC_REC_MAX_HEADER];
+  uint8_t flags = CIRC_REC_LEN | CIRC_REC_TAG;
+  uint32_t hdrLen;
   CIRCULAR_LOG_ASSERT(log != NULL);
-  CIRCULAR_LOG_ASSERT(buff != NULL);
-  CIRCULAR_LOG_ASSERT(log->parseTime != NULL);
-  CIRCULAR_LOG_ASSERT(log->index != NULL);
-  if (!log->circLogInit) {
-    return 0;
+  CIRCULAR_LOG_ASSERT(tag < CIRC_TAG_COUNT);
+  if (!largeMax(log) ||
+      len > largeMax(log) - CIRC_REC_MAX_HEADER - CIRC_REC_FOOTER) {
+    return CIRC_LOG_ERR_API;
   }
   FLASH_MUTEX_ENTER(log->osMutex);
-  
-  // Search for enclosing log newest to oldest
-  if (log->LogFlashHeadPtr > log->LogFlashTailPtr) {
-    /* Normal */
-    for (sect = log->LogFlashHeadPtr / FLASH_SECTOR_SIZE;
-         sect >= log->LogFlashTailPtr / FLASH_SECTOR_SIZE; sect--) {
-      if (time < previous && time >= log->index[sect].time) {
-        ret = findLogAtSector(log, buff, buffLen, time, sect);
-        goto found;
-      }
-      previous = log->index[sect].time;
+  if (log->dedup) {
+    /* Repeats go ahead, the next line starts a new run */
+    dedupFlush(log);
+    log->dedup->len = 0;
+  }
+  if (appendPrepare(log, len + CIRC_REC_MAX_HEADER + CIRC_REC_FOOTER) !=
+      CIRC_LOG_ERR_NONE) {
+    goto badexit;
+  }
+  if (log->sequenced && log->stampedSeq != log->headSeq) {
+    flags |= CIRC_REC_SEQ;
+    log->stampedSeq = log->headSeq;
+  }
+  hdrLen = recordHeaderEncode(hdr, flags, 0, log->headSeq, 0, tag);
+  hdrLen = recordHeaderEncode(hdr, flags, 0, log->headSeq,
+                              hdrLen + len + CIRC_REC_FOOTER, tag);
+  log->largeStart = log->LogFlashHeadPtr;
+  log->largeTag = tag;
+  if (writeAtHead(log, hdr, hdrLen) != hdrLen) {
+    goto badexit;
+  }
+  log->largeLeft = len;
+  log->largeSpare =
+      largeMax(log) - CIRC_REC_MAX_HEADER - CIRC_REC_FOOTER - len;
+  log->largeOpen = 1;
+  return CIRC_LOG_ERR_NONE;
+badexit:
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return CIRC_LOG_ERR_IO;
+}
+
+/*
+ * Next payload bytes of the record circularRecordBegin started, escaped
+ * bytes taking two. Sectors past those Begin erased are erased as escapes
+ * need them
+ * return : bytes written, short past the record length or once escapes
+ * would take it over the log less 3 sectors, 0 on IO error or with no
+ * record open
+ */
+uint32_t circularRecordWrite(circ_log_t *log, const uint8_t *buf,
+                             uint32_t len) {
+  uint32_t esc;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(buf != NULL);
+  if (!log->largeOpen) {
+    return 0;
+  }
+  if (len > log->largeLeft) {
+    len = log->largeLeft;
+  }
+  esc = escapeCount(buf, &len, len + log->largeSpare);
+  if ((esc && appendPrepare(log, log->largeLeft + esc + CIRC_REC_FOOTER) !=
+                  CIRC_LOG_ERR_NONE) ||
+      writeEscaped(log, buf, len) != len) {
+    return 0;
+  }
+  log->largeLeft -= len;
+  log->largeSpare -= esc;
+  return len;
+}
+
+/*
+ * Ends the record circularRecordBegin started and unlocks the log. Payload
+ * not written is padded with spaces
+ * return : CIRC_LOG_ERR_API, log untouched, with no record open
+ */
+uint32_t circularRecordEnd(circ_log_t *log) {
+  static const uint8_t pad[16] = "                ";
+  uint32_t n, total, ret = CIRC_LOG_ERR_NONE;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  if (!log->largeOpen) {
+    return CIRC_LOG_ERR_API;
+  }
+  log->largeOpen = 0;
+  for (; log->largeLeft; log->largeLeft -= n) {
+    n = log->largeLeft < sizeof(pad) ? log->largeLeft : sizeof(pad);
+    if (writeAtHead(log, pad, n) != n) {
+      ret = CIRC_LOG_ERR_IO;
+      break;
     }
+  }
+  log->largeLeft = 0;
+  total = (log->LogFlashHeadPtr + log->logsLength - log->largeStart) %
+              log->logsLength +
+          CIRC_REC_FOOTER;
+  if (ret != CIRC_LOG_ERR_NONE || !writeFooter(log, total) ||
+      stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    ret = CIRC_LOG_ERR_IO;
   } else {
-    /* Wrapped */
-    for (sect = log->LogFlashHeadPtr / FLASH_SECTOR_SIZE; sect >= 0; sect--) {
-      if (time < previous && time >= log->index[sect].time) {
-        ret = findLogAtSector(log, buff, buffLen, time, sect);
-        goto found;
-      }
-      previous = log->index[sect].time;
-    }
-    for (sect = (log->logsLength / FLASH_SECTOR_SIZE) - 1;
-         sect >= log->LogFlashTailPtr / FLASH_SECTOR_SIZE; sect--) {
-      if (time < previous && time >= log->index[sect].time) {
-        ret = findLogAtSector(log, buff, buffLen, time, sect);
-        goto found;
-      }
-      previous = log->index[sect].time;
+    if (log->bloom) {
+      bloomLine(log, log->largeStart, NULL, 0, 0);
     }
+    appendDone(log, 0, RECORD_NO_TIME, CIRC_TAG_BIT(log->largeTag), 0,
+               log->largeStart, NULL);
   }
-  found:
-  FLASH_MUTEX_EXIT(log->osMutex);
+  writeUnlock(log, log->largeStart);
   return ret;
 }
 
-int32_t circularFileRead(circ_log_t *log, circular_FILE *file, void *buff,
-                          uint32_t buffLen, CIRC_DIR dir, int32_t lines,
-                          char *filter) {
-  if (file->valid != FILE_MAGIC_MARKER) {
-    return -CIRC_LOG_ERR_API;
+/*
+ * Stores a format string id and its integer arguments in place of text,
+ * stamped and tagged. Readers expand it with log->formats, a host decoder
+ * with the same table
+ */
+uint32_t circularWriteLogFormat(circ_log_t *log, uint32_t time, uint8_t tag,
+                                uint16_t id, const uint32_t *args,
+                                uint32_t count) {
+  uint8_t rec[2 + (CIRC_FMT_MAX_ARGS + 1) * FMT_MAX_VALUE];
+  uint32_t i, len = 0;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(count <= CIRC_FMT_MAX_ARGS);
+  CIRCULAR_LOG_ASSERT(args != NULL || count == 0);
+  CIRCULAR_LOG_ASSERT(time != RECORD_NO_TIME);
+  rec[len++] = CIRC_FMT_MARKER;
+  len += fmtPut(&rec[len], id);
+  for (i = 0; i < count; i++) {
+    len += fmtPut(&rec[len], args[i]);
   }
-  switch (dir) {
-  case CIRC_DIR_FORWARD:
-    return readForward(log, file, buff, buffLen, lines, filter);
-  case CIRC_DIR_REVERSE:
-    return readBack(log, file, buff, buffLen, lines, filter);
-  default:
-    return -CIRC_LOG_ERR_API;
+  rec[len++] = '\n';
+  return writeRecord(log,
+                     CIRC_REC_TIME | (tag || log->parseTag ? CIRC_REC_TAG : 0),
+                     time, tag, rec, len);
+}
+
+/*
+ * Text of a line from circularFileGetLine or a raw image, formatted records
+ * expanded with log->formats. Writes up to outLen bytes.
+ * return : full text length
+ */
+uint32_t circularFormatLine(circ_log_t *log, const uint8_t *line, uint32_t len,
+                            uint8_t *out, uint32_t outLen) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(line != NULL);
+  uint32_t hdrLen = recordHeaderLen(line, len);
+  line += hdrLen;
+  len -= hdrLen;
+  if (len && line[0] == CIRC_FMT_MARKER) {
+    return fmtText(log, line, len, out, outLen);
   }
+  memcpy(out, line, len < outLen ? len : outLen);
+  return len;
 }
 
-uint32_t circularReadLines(circ_log_t *log, uint8_t *buff, uint32_t buffSize,
-                           uint32_t lines, char *filter,
-                           uint32_t estLineLength) {
-  uint32_t ret = 0;
-  uint32_t remaining;
-  int32_t space, seek, i;
-  uint32_t llen, searchLen;
-  uint32_t lastStart = 0;
+void circularFileSetTags(circular_FILE *file, uint32_t tagMask) {
+  CIRCULAR_LOG_ASSERT(file != NULL);
+  file->tagMask = tagMask;
+  file->skipSector = BLOOM_NONE;
+}
+
+/* Scans file with the caller's buffer from here on, after circularFileOpen */
+void circularFileSetBuffer(circular_FILE *file, uint8_t *buff, uint32_t len) {
+  CIRCULAR_LOG_ASSERT(file != NULL);
+  CIRCULAR_LOG_ASSERT(!file->buffLent);
+  file->buff = buff;
+  file->buffLen = len;
+  file->winLen = 0;
+}
+
+/* Gives back a pool buffer kept by circularFileGetLine */
+void circularFileRelease(circ_log_t *log, circular_FILE *file) {
   CIRCULAR_LOG_ASSERT(log != NULL);
-  CIRCULAR_LOG_ASSERT(buff != NULL);
-  if (estLineLength == 0) {
-    estLineLength = LINE_ESTIMATE_FACTOR;
+  if (file->valid == FILE_MAGIC_MARKER) {
+    fileBuffRelease(log, file);
   }
-  if (buffSize < estLineLength) {
-    return 0;
+}
+
+/*
+ * Writes the pending repeat count of dedup, from a periodic task once the
+ * timeout has passed or at once with force
+ */
+uint32_t circularFlushRepeats(circ_log_t *log, uint8_t force) {
+  circ_log_dedup_t *d;
+  uint32_t ret;
+  int32_t head;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  d = log->dedup;
+  if (d == NULL) {
+    return CIRC_LOG_ERR_API;
   }
   FLASH_MUTEX_ENTER(log->osMutex);
-  space = calculateLogSpace(log);
-  FLASH_MUTEX_EXIT(log->osMutex);
-  searchLen = lines * estLineLength;
-  if (searchLen > buffSize - 1) {
-    searchLen = buffSize - 1;
-  }
-  seek = space - searchLen;
-  if (seek < 0) {
-    seek = 0;
+  head = log->LogFlashHeadPtr;
+  if (d->repeats &&
+      (force || (d->timeout && d->now && d->now() - d->first >= d->timeout))) {
+    dedupFlush(log);
   }
+  ret = stageFlush(log);
+  writeUnlock(log, head);
+  return ret;
+}
 
-  ret = circularReadLogPartial(log, buff, seek, searchLen, &remaining);
-  if (ret == 0) {
+/* Newest indexed line start older than time, return : 1 if found */
+static uint32_t trimPoint(circ_log_t *log, uint32_t time, uint32_t *pos) {
+  uint32_t slot, t, found = 0;
+  uint32_t last = INDEX_SLOT_OF(log, log->LogFlashHeadPtr);
+  if (time == 0) {
     return 0;
   }
-
-  // Search for "\n"
-  for (i = ret - 3; i >= 0; i--) {
-    if (buff[i] == '\n') {
-      lines--;
-      lastStart = i + 1;
+  if (log->flashIndex) {
+    return flashIndexFind(log, time - 1, pos);
+  }
+  for (slot = INDEX_SLOT_OF(log, log->LogFlashTailPtr);;
+       slot = (slot + 1) % INDEX_SLOTS(log)) {
+    t = indexTime(log, slot);
+    if (t != RECORD_NO_TIME) {
+      if (t >= time) {
+        break;
+      }
+      *pos = slot * INDEX_SLOT_SIZE(log) + indexFirstLine(log, slot);
+      found = 1;
     }
-    if (lines == 0) {
-      ret -= (i + 1);
-      memcpy(buff, &buff[i + 1], ret);
-      buff[ret] = 0;
+    if (slot == last) {
       break;
     }
   }
+  return found;
+}
 
-  if (filter != NULL) {
-    uint32_t FoundLength = 0;
-    uint8_t *LastLine = buff;
-    // Separate into lines
-    for (i = 0; i < (int32_t)ret; i++) {
-      if (buff[i] == '\n') {
-        buff[i] = 0;
-        if (strstr((char *)LastLine, filter) != NULL) {
-          buff[i] = '\n';
-          llen = (&buff[i] - LastLine) + 1;
-          memcpy(&buff[FoundLength], LastLine, llen);
-          FoundLength += llen;
-          buff[FoundLength] = 0;
-        }
-        buff[i] = '\n';
-        LastLine = &buff[i + 1];
+/*
+ * Retention by time, moves the tail past whole sectors whose lines are all
+ * older than time, from the index alone. Their erases are left to
+ * circularMaintain or to the writer needing the space. Until erased, a
+ * restart brings them back
+ */
+uint32_t circularTrimBefore(circ_log_t *log, uint32_t time) {
+  uint32_t pos, stop;
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  if (!INDEX_ENABLED(log)) {
+    return CIRC_LOG_ERR_API;
+  }
+  FLASH_MUTEX_ENTER(log->osMutex);
+  if (log->LogFlashHeadPtr >= 0 && calculateLogSpace(log) > 0 &&
+      trimPoint(log, time, &pos)) {
+    /* Lines starting in the sector of pos may be newer */
+    stop = pos - SECTOR_OFFSET(log, pos);
+    while ((uint32_t)log->LogFlashTailPtr != stop) {
+      indexDropSector(log, SECTOR_OF(log, log->LogFlashTailPtr));
+      sectorMapsDrop(log, SECTOR_OF(log, log->LogFlashTailPtr));
+      log->LogFlashTailPtr += SECTOR_SIZE(log);
+      if (log->LogFlashTailPtr >= (int32_t)log->logsLength) {
+        log->LogFlashTailPtr = 0;
       }
+      log->trimPending++;
     }
-    if (FoundLength == 0) {
-      snprintf((char *)buff, buffSize,
-          "** Search item '%s' not found in %i lines **\r\n", filter,
-          lines);
-      ret = (uint32_t)strlen((char *)buff);
-    } else {
-      ret = FoundLength;
-      buff[FoundLength] = 0;
-    }
-  } else {
-    if (lines) {
-      // Finalize it
-      ret -= lastStart;
-      memcpy(buff, &buff[lastStart], ret);
-      buff[ret] = 0;
-    }
+    hintSave(log);
   }
-  return ret;
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return CIRC_LOG_ERR_NONE;
 }
 
-uint32_t circularClearLog(circ_log_t *log) {
+/* Background work, erases up to maxErases trimmed sectors */
+uint32_t circularMaintain(circ_log_t *log, uint32_t maxErases) {
+  uint32_t ret;
   CIRCULAR_LOG_ASSERT(log != NULL);
   FLASH_MUTEX_ENTER(log->osMutex);
-  if (log->erase(log->baseAddress, log->logsLength) !=
-      log->logsLength) {
-    FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
-    goto badexit;
+  ret = trimErase(log, maxErases);
+  hintSave(log);
+  FLASH_MUTEX_EXIT(log->osMutex);
+  return ret;
+}
+
+/* Lines of n spread evenly over first..last that are before time t */
+static uint32_t spreadBefore(uint64_t t, uint32_t first, uint32_t last,
+                             uint32_t n) {
+  if (t <= first) {
+    return 0;
   }
-  FLASH_DEBUG("FLASH: (%s) Entire flash erased\r\n", log->name);
-  log->LogFlashTailPtr = log->LogFlashHeadPtr = 0;
-  if (log->index && log->parseTime) {
-    memset(log->index, 0xFF, log->logsLength / FLASH_SECTOR_SIZE);
+  if (t > last) {
+    return n;
+  }
+  return (uint32_t)(n * (t - first) / ((uint64_t)last - first + 1));
+}
+
+/* Spreads a sector's n lines over the buckets its times span */
+static void histSpread(hist_query_t *q, uint32_t first, uint32_t last,
+                       uint32_t n) {
+  uint32_t b = first > q->start ? (first - q->start) / q->width : 0;
+  uint64_t from;
+  for (; b < q->count; b++) {
+    from = (uint64_t)q->start + (uint64_t)b * q->width;
+    if (from > last) {
+      break;
+    }
+    q->out[b] += spreadBefore(from + q->width, first, last, n) -
+                 spreadBefore(from, first, last, n);
   }
-  FLASH_MUTEX_EXIT(log->osMutex);
-  return CIRC_LOG_ERR_NONE;
-badexit:
-  FLASH_MUTEX_EXIT(log->osMutex);
-  return CIRC_LOG_ERR_IO;
 }
 
 /*
- *
+ * Timed lines in count buckets of width seconds from start, into out.
+ * Sectors whose lines fall in one bucket are counted from sectorStats
+ * alone. Those spanning a bucket edge are read with CIRC_HIST_EXACT, else
+ * spread evenly over their time range. The line at the tail, perhaps cut
+ * by the erase before it, may be left out
  */
-uint32_t circularWriteLog(circ_log_t *log, uint8_t *buf, uint32_t len) {
-  int32_t EraseSpace;
-  uint32_t res, firstlen;
+uint32_t circularHistogram(circ_log_t *log, uint32_t start, uint32_t width,
+                           uint32_t *out, uint32_t count, uint8_t flags) {
+  hist_query_t q = {start, width, out, count, flags};
+  circ_log_sector_stat_t *st;
+  uint32_t i, n, sector, live, addr, bucket, ret = CIRC_LOG_ERR_NONE;
   CIRCULAR_LOG_ASSERT(log != NULL);
-  CIRCULAR_LOG_ASSERT(buf != NULL);
-  if (len > FLASH_SECTOR_SIZE) {
-    len = FLASH_SECTOR_SIZE;
+  CIRCULAR_LOG_ASSERT(out != NULL);
+  if (!log->sectorStats || width == 0 || !log->circLogInit) {
+    return CIRC_LOG_ERR_API;
   }
+  memset(out, 0, count * sizeof(uint32_t));
   FLASH_MUTEX_ENTER(log->osMutex);
-  EraseSpace = calculateErasedSpace(log);
-  if (EraseSpace == 0) {
-    // Erase it all
-    if (log->erase(log->baseAddress, log->logsLength) != log->logsLength) {
-      FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
-      goto badexit;
-    }
-    FLASH_DEBUG("FLASH: (%s) Entire flash erased\r\n", log->name);
-    log->LogFlashTailPtr = log->LogFlashHeadPtr = 0;
-    if (log->index && log->parseTime) {
-      memset(log->index, 0xFF, log->logsLength / FLASH_SECTOR_SIZE);
-    }
-  } else if (EraseSpace < (FLASH_SECTOR_SIZE * 2)) {
-    // Erase next sector in line
-    if (log->erase(log->baseAddress + log->LogFlashTailPtr,
-                       FLASH_SECTOR_SIZE) != FLASH_SECTOR_SIZE) {
-      FLASH_DEBUG("FLASH: (%s) Erase IO error\r\n", log->name);
-      goto badexit;
-    }
-    FLASH_DEBUG("FLASH: (%s) Sector at address 0x%X erased\r\n", log->name,
-                log->baseAddress + log->LogFlashTailPtr);
-    if (log->index && log->parseTime) {
-      memset(&log->index[log->LogFlashTailPtr / FLASH_SECTOR_SIZE], 0xFF,
-             sizeof(circ_log_index_t));
-    }
-    log->LogFlashTailPtr += FLASH_SECTOR_SIZE;
-    if (log->LogFlashTailPtr >= (int32_t)log->logsLength) {
-      log->LogFlashTailPtr = 0;
-    }
+  sectorMapsEnsure(log);
+  if (log->LogFlashHeadPtr < 0 || calculateLogSpace(log) == 0) {
+    goto done;
   }
-  /* store write position */
-  uint32_t headStart = log->LogFlashHeadPtr;
-  // Does it wrap?
-  // The FLASH_WRITE_SIZE boundary will assume that writing FLASH_ERASED will
-  // leave existing alone
-  if (log->LogFlashHeadPtr + len > log->logsLength) {
-    // Wrapped
-    firstlen = log->logsLength - log->LogFlashHeadPtr;
-    if (firstlen) {
-      res = circFlashInsertWrite(log, log->baseAddress + log->LogFlashHeadPtr,
-                                 buf, firstlen);
-      if (res != firstlen) {
-        FLASH_DEBUG("FLASH: (%s) Write IO error\r\n", log->name);
-        goto badexit;
-      }
+  /* Exact reads go through wBuff */
+  if ((flags & CIRC_HIST_EXACT) && stageFlush(log) != CIRC_LOG_ERR_NONE) {
+    ret = CIRC_LOG_ERR_IO;
+    goto done;
+  }
+  sector = SECTOR_OF(log, log->LogFlashTailPtr);
+  live = (SECTOR_OF(log, log->LogFlashHeadPtr) + SECTOR_COUNT(log) - sector) %
+             SECTOR_COUNT(log) +
+         1;
+  for (i = 0; i < live; i++, sector = (sector + 1) % SECTOR_COUNT(log)) {
+    st = &log->sectorStats[sector];
+    n = (flags & CIRC_HIST_MATCHED) ? st->matched : st->lines;
+    if (n == 0 || st->last < start) {
+      continue;
     }
-    res = circFlashInsertWrite(log, log->baseAddress, &buf[firstlen],
-                               len - firstlen);
-    if (res != len - firstlen) {
-      FLASH_DEBUG("FLASH: (%s) Write IO error\r\n", log->name);
-      goto badexit;
+    bucket = st->first >= start ? (st->first - start) / width : count;
+    if (st->first >= start && bucket >= count) {
+      continue;
     }
-    log->LogFlashHeadPtr = len - firstlen;
-  } else {
-    res = circFlashInsertWrite(log, log->baseAddress + log->LogFlashHeadPtr,
-                               buf, len);
-    if (res != len) {
-      FLASH_DEBUG("FLASH: (%s) Write IO error\r\n", log->name);
-      goto badexit;
+    if (bucket < count && (st->last - start) / width == bucket) {
+      out[bucket] += n;
+    } else if (!(flags & CIRC_HIST_EXACT)) {
+      histSpread(&q, st->first, st->last, n);
+    } else {
+      /* From the byte before, a line starting on the sector edge counts */
+      addr = sector * SECTOR_SIZE(log);
+      if ((int32_t)addr == log->LogFlashTailPtr
+              ? !lineWalk(log, addr, SECTOR_SIZE(log), 0, &q)
+              : !lineWalk(log, (addr + log->logsLength - 1) % log->logsLength,
+                          SECTOR_SIZE(log) + 1, 0, &q)) {
+        ret = CIRC_LOG_ERR_IO;
+        break;
+      }
     }
-    log->LogFlashHeadPtr += len;
-  }
-
-  uint32_t headSector = headStart / FLASH_SECTOR_SIZE;
-  if (log->index && log->parseTime &&
-      log->index[headSector].time == 0xFFFFFFFF) {
-    log->index[headSector].firstLine = headStart % FLASH_SECTOR_SIZE;
-    log->index[headSector].time = log->parseTime((const char *)buf);
   }
+done:
   FLASH_MUTEX_EXIT(log->osMutex);
-  return len;
-badexit:
-  FLASH_MUTEX_EXIT(log->osMutex);
-  return 0;
+  return ret;
 }
 
 uint32_t circularLogInit(circ_log_t *log) {
-  uint32_t res, i, si;
+  uint32_t res, i, si, keepIndex = 0, warm = 0;
   CIRCULAR_LOG_ASSERT(log != NULL);
   CIRCULAR_LOG_ASSERT(log->wBuff != NULL);
   CIRCULAR_LOG_ASSERT(log->read);
   CIRCULAR_LOG_ASSERT(log->write);
   CIRCULAR_LOG_ASSERT(log->erase);
-  CIRCULAR_LOG_ASSERT((log->index && log->parseTime) ||
-                      (!log->index && !log->parseTime));
+  /* Index and sector count times come from parseTime or stamped records */
+  CIRCULAR_LOG_ASSERT(INDEX_ENABLED(log) || log->sectorStats ||
+                      !log->parseTime);
+  CIRCULAR_LOG_ASSERT(!log->index || !log->compactIndex);
+  CIRCULAR_LOG_ASSERT(!RAM_INDEX(log) || !log->flashIndex);
   FLASH_MUTEX_ENTER(log->osMutex);
   log->LogFlashTailPtr = -1;
   log->LogFlashHeadPtr = -1;
   log->emptyFlag = 0;
-  if (log->wBuffLen < FLASH_MIN_BUFF) {
-    FLASH_DEBUG("FLASH: (%s) Buffer size %u < %i\r\n", log->name, log->wBuffLen,
-                FLASH_MIN_BUFF);
+  log->trimPending = 0;
+  log->stageLen = 0;
+  log->largeLeft = 0;
+  log->largeOpen = 0;
+#if CIRC_LOG_RUNTIME_GEOMETRY
+  if (!log->geometry.sectorSize) {
+    log->geometry.sectorSize = FLASH_SECTOR_SIZE;
+  }
+  if (!log->geometry.writeSize) {
+    log->geometry.writeSize = FLASH_WRITE_SIZE;
+  }
+  if (!log->geometry.lineEstimate) {
+    log->geometry.lineEstimate = LINE_ESTIMATE_FACTOR;
+  }
+  if (!log->geometry.eraseSizes) {
+    log->geometry.eraseSizes = FLASH_ERASE_SIZES;
+  }
+  if (!log->geometry.writeMax) {
+    log->geometry.writeMax =
+        FLASH_WRITE_MAX ? FLASH_WRITE_MAX : log->geometry.writeSize;
+  }
+  CIRCULAR_LOG_ASSERT(log->geometry.writeSize > FLASH_MAX_DATE_LEN);
+  CIRCULAR_LOG_ASSERT(log->geometry.sectorSize % log->geometry.writeSize == 0);
+  CIRCULAR_LOG_ASSERT(log->logsLength % log->geometry.sectorSize == 0);
+  log->geometry.sectorShift = circLog2(log->geometry.sectorSize);
+  log->geometry.writeShift = circLog2(log->geometry.writeSize);
+#endif
+  if (!log->indexGranularity) {
+    log->indexGranularity = SECTOR_SIZE(log);
+  }
+  /* Block erases cover whole sectors */
+  for (i = ERASE_SIZES(log); i; i &= i - 1) {
+    CIRCULAR_LOG_ASSERT((i & (0 - i)) % SECTOR_SIZE(log) == 0);
+  }
+  CIRCULAR_LOG_ASSERT(log->indexGranularity % WRITE_SIZE(log) == 0);
+  CIRCULAR_LOG_ASSERT(WRITE_MAX(log) % WRITE_SIZE(log) == 0);
+  CIRCULAR_LOG_ASSERT(SECTOR_SIZE(log) % log->indexGranularity == 0);
+  log->indexShift = circLog2(log->indexGranularity);
+  /* Compact entries keep firstLine in CINDEX_LINE_BITS */
+  CIRCULAR_LOG_ASSERT(!log->compactIndex ||
+                      log->indexGranularity <= CINDEX_LINE_MASK + 1);
+  if (log->bloom) {
+    CIRCULAR_LOG_ASSERT(log->bloom->head);
+    CIRCULAR_LOG_ASSERT(log->bloom->bytes <= log->wBuffLen);
+    CIRCULAR_LOG_ASSERT(SECTOR_SIZE(log) % log->bloom->bytes == 0);
+    CIRCULAR_LOG_ASSERT(log->bloom->length >=
+                        CIRC_BLOOM_LENGTH(SECTOR_COUNT(log), log->bloom->bytes,
+                                          SECTOR_SIZE(log)));
+  }
+  if (log->flashIndex) {
+    CIRCULAR_LOG_ASSERT(log->flashIndex->summary && log->flashIndex->cache);
+    CIRCULAR_LOG_ASSERT(log->flashIndex->length >=
+                        CIRC_FINDEX_LENGTH(INDEX_SLOTS(log), SECTOR_SIZE(log)));
+    CIRCULAR_LOG_ASSERT(log->flashIndex->length % SECTOR_SIZE(log) == 0);
+  }
+  if (log->wBuffLen < WRITE_SIZE(log) + FLASH_MAX_DATE_LEN) {
+    FLASH_DEBUG("FLASH: (%s) Buffer size %u < %u\r\n", log->name, log->wBuffLen,
+                WRITE_SIZE(log) + FLASH_MAX_DATE_LEN);
+    FLASH_MUTEX_EXIT(log->osMutex);
     return CIRC_LOG_ERR_API;
   }
   uint32_t bufLen = log->wBuffLen;
   uint8_t *buf = log->wBuff;
+  if (log->hint && hintLoad(log)) {
+    FLASH_DEBUG("FLASH: (%s) Warm boot\r\n", log->name);
+    warm = 1;
+    keepIndex = log->hintIndex && RAM_INDEX(log) &&
+                log->hint->indexSum == hintIndexSum(log);
+    goto goodexit;
+  }
   res = log->read(log->baseAddress, buf, 4);
   if (res != 4) {
     goto badexit;
@@ -786,16 +4379,11 @@ uint32_t circularLogInit(circ_log_t *log) {
 
   if (buf[0] == FLASH_ERASED) {
     // Search for tail first
-    for (i = 1; i < FLASH_SECTORS(log->logsLength); i++) {
-      res = log->read(log->baseAddress + (FLASH_SECTOR_SIZE * i), buf, 4);
-      if (res != 4) {
-        goto badexit;
-      }
-
-      if (buf[0] != FLASH_ERASED) {
-        log->LogFlashTailPtr = i * FLASH_SECTOR_SIZE;
-        break;
-      }
+    if (!firstWrittenSector(log, 1, &i)) {
+      goto badexit;
+    }
+    if (i < SECTOR_COUNT(log)) {
+      log->LogFlashTailPtr = i * SECTOR_SIZE(log);
     }
     if (log->LogFlashTailPtr == -1) {
       // Device is empty
@@ -853,16 +4441,12 @@ uint32_t circularLogInit(circ_log_t *log) {
     }
 
     // Now search for tail
-    for (i = (log->LogFlashHeadPtr / FLASH_SECTOR_SIZE) + 1;
-         i < FLASH_SECTORS(log->logsLength); i++) {
-      res = log->read(log->baseAddress + (FLASH_SECTOR_SIZE * i), buf, 4);
-      if (res != 4) {
-        goto badexit;
-      }
-      if (buf[0] != FLASH_ERASED) {
-        log->LogFlashTailPtr = i * FLASH_SECTOR_SIZE;
-        break;
-      }
+    if (!firstWrittenSector(log, SECTOR_OF(log, log->LogFlashHeadPtr) + 1,
+                            &i)) {
+      goto badexit;
+    }
+    if (i < SECTOR_COUNT(log)) {
+      log->LogFlashTailPtr = i * SECTOR_SIZE(log);
     }
     if (log->LogFlashTailPtr == -1) {
       // This would only happen if tail is 0
@@ -871,13 +4455,40 @@ uint32_t circularLogInit(circ_log_t *log) {
   }
 goodexit:
   // Build index if necessary
-  if (log->index != NULL && log->parseTime != NULL) {
+  if (log->flashIndex) {
+    flashIndexInit(log);
+  } else if (INDEX_ENABLED(log) && !keepIndex) {
     buildIndex(log);
   }
+  if (log->bloom) {
+    bloomInit(log);
+  }
+  log->mapsStale = 0;
+  if ((log->tagMap || log->sectorStats) && warm) {
+    /* Built on first use, the boot does not wait for the walk */
+    log->mapsStale = 1;
+  } else if (log->tagMap || log->sectorStats) {
+    sectorMapsBuild(log);
+  }
+  seqRecover(log);
+  for (i = 0; i < log->limitCount; i++) {
+    CIRCULAR_LOG_ASSERT(log->limit[i].now);
+    log->limit[i].tokens = log->limit[i].burst;
+    log->limit[i].last = log->limit[i].reported = log->limit[i].now();
+    log->limit[i].dropped = log->limit[i].sampled = 0;
+  }
+  if (log->dedup) {
+    CIRCULAR_LOG_ASSERT(log->dedup->skip <= FLASH_MAX_DATE_LEN);
+    log->dedup->len = log->dedup->repeats = 0;
+  }
   FLASH_DEBUG("FLASH: V%s (%s) 0x%X .. 0x%X .. 0x%X\r\n",
               CIRCULAR_FLASH_VERSION, log->name, log->LogFlashTailPtr,
               log->LogFlashHeadPtr, calculateErasedSpace(log));
   log->circLogInit = 1;
+  if (log->hint && log->hintIndex && RAM_INDEX(log)) {
+    log->indexSum = hintIndexSum(log);
+  }
+  hintSave(log);
   FLASH_MUTEX_EXIT(log->osMutex);
   return CIRC_LOG_ERR_NONE;
 
@@ -885,4 +4496,26 @@ badexit:
   FLASH_MUTEX_EXIT(log->osMutex);
   FLASH_DEBUG("FLASH: (%s) Device error\r\n", log->name);
   return CIRC_LOG_ERR_IO;
+}
+
+void circularGetStats(circ_log_t *log, circ_log_stats_t *stats) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(stats != NULL);
+  FLASH_MUTEX_ENTER(log->osMutex);
+  *stats = log->stats;
+  FLASH_MUTEX_EXIT(log->osMutex);
+}
+
+/*
+ * Header length and time of a raw line as stored on flash, for tools that
+ * read images directly. time is 0xFFFFFFFF when the line carries none
+ */
+uint32_t circularRecordInfo(circ_log_t *log, const uint8_t *line, uint32_t len,
+                            uint32_t *time) {
+  CIRCULAR_LOG_ASSERT(log != NULL);
+  CIRCULAR_LOG_ASSERT(line != NULL);
+  if (time != NULL) {
+    *time = recordTime(log, line, len);
+  }
+  return recordHeaderLen(line, len);
 }
\ No newline at end of file
@@ -25,7 +25,13 @@
 #ifndef __CIRCULARFLASH_H
 #define __CIRCULARFLASH_H
 
+#include <stdarg.h>
 #include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include "circularFlashConfig.h"
 
 #define CIRCULAR_FLASH_VERSION "1.05"
@@ -46,6 +52,8 @@
 #define LINE_ESTIMATE_FACTOR 64
 #endif
 
+/* Scan buffer held in each circular_FILE. 0 leaves files only their
+ * position, scans then use circularFileSetBuffer or a circ_log_pool_t */
 #ifndef SEARCH_BUFF_SIZE
 #define SEARCH_BUFF_SIZE 1024
 #endif
@@ -58,18 +66,263 @@
 #define FLASH_WRITE_SIZE 0x100
 #endif
 
+/* Erase sizes the part offers beyond a sector, one bit per power of 2 size,
+ * e.g. 0x8000 | 0x10000. Clears, recovery and circularMaintain use the
+ * largest aligned one that fits. 0 leaves whole ranges to the driver */
+#ifndef FLASH_ERASE_SIZES
+#define FLASH_ERASE_SIZES 0
+#endif
+
+/* Most bytes the write driver programs in one call, a multiple of
+ * FLASH_WRITE_SIZE, for parts or drivers that program across pages in one
+ * transaction. Whole pages of long lines are passed from the caller's
+ * buffer, which the driver must not modify. 0 for one page */
+#ifndef FLASH_WRITE_MAX
+#define FLASH_WRITE_MAX 0
+#endif
+
+/* Set to 1 to carry flash geometry per log, otherwise FLASH_SECTOR_SIZE and
+ * FLASH_WRITE_SIZE are fixed for every log at compile time */
+#ifndef CIRC_LOG_RUNTIME_GEOMETRY
+#define CIRC_LOG_RUNTIME_GEOMETRY 0
+#endif
+
+/* Set to 1 on hosted platforms with pthreads for circularFileSearch */
+#ifndef CIRC_LOG_PARALLEL
+#define CIRC_LOG_PARALLEL 0
+#endif
+
+#ifndef CIRC_PARALLEL_MAX_THREADS
+#define CIRC_PARALLEL_MAX_THREADS 16
+#endif
+
+/* Read size of each circularFileSearch worker, heap allocated */
+#ifndef CIRC_PARALLEL_READ_SIZE
+#define CIRC_PARALLEL_READ_SIZE 0x4000
+#endif
+
+/* Most segments in one readv call, on the stack */
+#ifndef CIRC_READV_MAX
+#define CIRC_READV_MAX 16
+#endif
+
 #if FLASH_MAX_DATE_LEN >= FLASH_WRITE_SIZE
 #error "FLASH_MAX_DATE_LEN too long"
 #endif
 
 #define FLASH_MIN_BUFF (FLASH_WRITE_SIZE + FLASH_MAX_DATE_LEN)
 
-/* Optional index, must be sector count */
+/* Binary record header, a line may start with the marker, 0x80 | flags,
+ * then the flagged fields. Field bytes hold 6 bits each in 0x80..0xBF so
+ * they are never '\n' or FLASH_ERASED. Readers strip the header */
+#define CIRC_REC_MARKER 0x1E
+#define CIRC_REC_TIME 0x01
+#define CIRC_REC_TAG 0x02
+#define CIRC_REC_SEQ 0x04
+#define CIRC_REC_LEN 0x08
+#define CIRC_REC_MAX_HEADER 21
+
+/* Large records, longer than a sector, carry CIRC_REC_LEN with the record
+ * length before escaping and end in CIRC_REC_END, the whole stored length
+ * and '\n'. Payload '\n', FLASH_ERASED and 0x1C..0x1E are stored as
+ * CIRC_REC_ESCAPE and the byte ^ 0x20, so any bytes fit, the record stays
+ * one line and its first CIRC_REC_END is the footer */
+#define CIRC_REC_END 0x1C
+#define CIRC_REC_ESCAPE 0x1D
+#define CIRC_REC_FOOTER 8
+
+/* Formatted records, circularWriteLogFormat. The line body starts with the
+ * marker, then a format id and up to CIRC_FMT_MAX_ARGS integers */
+#define CIRC_FMT_MARKER 0x1F
+#ifndef CIRC_FMT_MAX_ARGS
+#define CIRC_FMT_MAX_ARGS 8
+#endif
+
+/* Record tags, a severity level or module id stored as 0x80 | tag. Files
+ * select them by mask, CIRC_TAGS_FROM(tag) takes tag and above */
+#define CIRC_TAG_COUNT 32
+#define CIRC_TAG_BIT(tag) (1UL << (tag))
+#define CIRC_TAGS_FROM(tag) ((uint32_t)~(CIRC_TAG_BIT(tag) - 1))
+
+/* Per log geometry, only with CIRC_LOG_RUNTIME_GEOMETRY.
+ * Zero fields take the compile time defaults */
+typedef struct {
+  uint32_t sectorSize;
+  uint32_t writeSize;
+  uint32_t lineEstimate;
+  uint32_t eraseSizes; /* See FLASH_ERASE_SIZES */
+  uint32_t writeMax;   /* See FLASH_WRITE_MAX */
+  /* Filled in by circularLogInit, 0 when not a power of 2 */
+  uint8_t sectorShift;
+  uint8_t writeShift;
+} circ_log_geometry_t;
+
+/* Optional index, one entry per indexGranularity bytes of log */
+#define CIRC_INDEX_ENTRIES(logLength, granularity) ((logLength) / (granularity))
+
 typedef struct {
   uint32_t time;
   uint32_t firstLine;
 } circ_log_index_t;
 
+/* Compact alternative to circ_log_index_t for large parts. A group of
+ * slots shares a base time, each slot packs a 20 bit time delta over
+ * a 12 bit first line offset (granularity up to 4 KB). Entries too far
+ * from the rest of their group are dropped, which only costs search IO */
+#define CIRC_CINDEX_GROUP 16
+#define CIRC_CINDEX_GROUPS(entries)                                            \
+  (((entries) + CIRC_CINDEX_GROUP - 1) / CIRC_CINDEX_GROUP)
+typedef struct {
+  uint32_t base;
+  uint32_t slot[CIRC_CINDEX_GROUP];
+} circ_log_cindex_t;
+
+/* Index kept in a reserved area of whole sectors on the same device, for
+ * parts where even the compact form is too big. RAM holds only the first
+ * time of each index page and one cached page, lookups read one index page.
+ * Size the area with CIRC_FINDEX_LENGTH(entries, sectorSize) */
+#define CIRC_FINDEX_ENTRY_SIZE 8
+#define CIRC_FINDEX_LENGTH(entries, sectorSize)                                \
+  ((((entries) * CIRC_FINDEX_ENTRY_SIZE + (sectorSize) - 1) / (sectorSize) +   \
+    1) *                                                                       \
+   (sectorSize))
+#define CIRC_FINDEX_PAGES(length, writeSize) ((length) / (writeSize))
+typedef struct {
+  uint32_t baseAddress;
+  uint32_t length;
+  uint32_t *summary; /* CIRC_FINDEX_PAGES(length, writeSize) long */
+  uint8_t *cache;    /* One write page */
+  /* Internal */
+  uint32_t head;
+  uint32_t validFrom;
+  uint32_t cachePage;
+  uint32_t lastSlot;
+  uint32_t pending; /* Entries in cache not yet programmed */
+} circ_log_findex_t;
+
+/* Optional per sector keyword filters for filtered circularFileRead. Each
+ * sector gets a Bloom filter of bytes over its alphanumeric tokens, written
+ * to a side area of whole sectors once the head leaves it. The area must
+ * start erased, CIRC_BLOOM_LENGTH(sectors, bytes, sectorSize) long */
+#ifndef CIRC_BLOOM_HASHES
+#define CIRC_BLOOM_HASHES 3
+#endif
+/* Tokens are also entered by their first CIRC_BLOOM_PREFIX characters, so a
+ * filter ending mid token can still be tested */
+#ifndef CIRC_BLOOM_PREFIX
+#define CIRC_BLOOM_PREFIX 4
+#endif
+#define CIRC_BLOOM_MAX_KEYS 4
+#define CIRC_BLOOM_LENGTH(sectors, bytes, sectorSize)                          \
+  ((((sectors) * (bytes) + (sectorSize) - 1) / (sectorSize)) * (sectorSize))
+typedef struct {
+  uint32_t baseAddress;
+  uint32_t length;
+  uint32_t bytes; /* Per sector, divides the sector size */
+  uint8_t *head;  /* bytes long, filter of the sector being written */
+  /* Internal */
+  uint32_t sector;
+} circ_log_bloom_t;
+
+/* Optional collapsing of repeated lines. A line equal to the previous one
+ * past its first skip bytes, a timestamp, is counted instead of written.
+ * The count goes out as "<prefix>last message repeated N times" before the
+ * next different line, once timeout has passed on the now clock, or from
+ * circularFlushRepeats. Lines up to CIRC_DEDUP_LINE_MAX past skip are
+ * compared with a copy of the previous one, longer ones by hash */
+#ifndef CIRC_DEDUP_LINE_MAX
+#define CIRC_DEDUP_LINE_MAX 128
+#endif
+typedef struct {
+  uint32_t skip; /* Up to FLASH_MAX_DATE_LEN */
+  uint32_t timeout;
+  uint32_t (*now)(void);
+  /* Internal */
+  uint32_t hash;
+  uint32_t len;
+  uint32_t lastLen;
+  uint8_t last[CIRC_DEDUP_LINE_MAX];
+  uint32_t repeats;
+  uint32_t first;
+  uint32_t time;
+  uint8_t flags;
+  uint8_t tag;
+  uint8_t prefixLen;
+  uint8_t prefix[FLASH_MAX_DATE_LEN];
+} circ_log_dedup_t;
+
+/* Optional write rate limit, a token bucket of bytes refilled by rate per
+ * tick of now up to burst. Over budget, lines are dropped unless their tag
+ * is in criticalTags, or in sampleTags where one in sampleEvery passes.
+ * The dropped count is written with the first line, admitted or not, once
+ * reportEvery ticks have passed since the last report. Lines take the first bucket whose tags hold
+ * theirs, tags 0 covering all */
+typedef struct {
+  uint32_t tags;
+  uint32_t rate;
+  uint32_t burst;
+  uint32_t (*now)(void);
+  uint32_t criticalTags;
+  uint32_t sampleTags;
+  uint32_t sampleEvery;
+  uint32_t reportEvery;
+  /* Internal */
+  int32_t tokens;
+  uint32_t last;
+  uint32_t reported;
+  uint32_t dropped;
+  uint32_t sampled;
+} circ_log_limit_t;
+
+/* Optional scan buffers shared by the log's files, count buffers of size
+ * bytes, count up to 32. Files without a buffer of their own borrow one for
+ * each read call, larger buffers mean fewer, larger flash reads. Takes the
+ * place of the SEARCH_BUFF_SIZE buffer in each file */
+typedef struct {
+  uint8_t *buff;
+  uint32_t size;
+  uint32_t count;
+  /* Internal, a bit per buffer lent */
+  uint32_t busy;
+} circ_log_pool_t;
+
+/* One piece of a scatter-gather read, see readv */
+typedef struct {
+  uint32_t addr;
+  uint8_t *buff;
+  uint32_t len;
+} circ_log_seg_t;
+
+/* Head and tail kept in RAM retained over soft resets, see circ_log_t hint */
+typedef struct {
+  int32_t head;
+  int32_t tail;
+  uint32_t trimPending;
+  uint32_t indexSum; /* Of the RAM index, when hintIndex is set */
+  uint32_t check;    /* Over the fields above and the log layout */
+} circ_log_hint_t;
+
+/* Timed lines starting in a sector, for circularHistogram */
+typedef struct {
+  uint32_t first;   /* Earliest time */
+  uint32_t last;    /* Latest time */
+  uint32_t lines;   /* 0 when the sector holds none */
+  uint32_t matched; /* Of those, with a tag in statTags */
+} circ_log_sector_stat_t;
+
+/* circularHistogram flags */
+#define CIRC_HIST_EXACT 0x01   /* Read sectors spanning a bucket edge */
+#define CIRC_HIST_MATCHED 0x02 /* Only lines with a tag in statTags */
+
+typedef struct {
+  uint32_t bloomChecked;     /* Sectors tested against a filter */
+  uint32_t bloomSkipped;     /* Of those, passed over without reading */
+  uint32_t bloomFalse;       /* Read on a filter match, no line matched */
+  uint32_t tagSkipped;       /* Sectors passed over holding no wanted tag */
+  uint32_t repeatsCollapsed; /* Lines counted by dedup, not written */
+  uint32_t rateDropped;      /* Lines over a rate limit budget */
+} circ_log_stats_t;
+
 typedef struct {
   const char *name;
   const uint32_t baseAddress;
@@ -86,8 +339,89 @@ typedef struct {
   uint32_t (*write)(uint32_t FlashAddress, uint8_t *buff, uint32_t len);
   uint32_t (*erase)(uint32_t FlashAddress, uint32_t len);
   uint32_t (*parseTime)(const char * line);
+#if CIRC_LOG_RUNTIME_GEOMETRY
+  circ_log_geometry_t geometry;
+#endif
+  /* Bytes per index entry, 0 for one per sector. Multiple of the write
+   * size dividing the sector, indexedLogSearch reads at most 2 of these */
+  uint32_t indexGranularity;
+  uint8_t indexShift;
+  /* Used in place of index, CIRC_CINDEX_GROUPS(entries) long */
+  circ_log_cindex_t *compactIndex;
+  /* Used in place of index, see circ_log_findex_t */
+  circ_log_findex_t *flashIndex;
+  circ_log_bloom_t *bloom;
+  circ_log_stats_t stats;
+  /* Tag of untagged writes, from the line text */
+  uint8_t (*parseTag)(const char *line);
+  /* Tags present per sector, SECTOR_COUNT long, rebuilt at init */
+  uint32_t *tagMap;
+  circ_log_dedup_t *dedup;
+  circ_log_limit_t *limit;
+  uint32_t limitCount;
+  /* Sectors behind the tail left by circularTrimBefore, not yet erased */
+  uint32_t trimPending;
+  /* Set to stamp the first line starting in each sector with a sequence
+   * number, for circularFileTell positions */
+  uint8_t sequenced;
+  /* Internal, sequence of the head sector and of the last stamp */
+  uint32_t headSeq;
+  uint32_t stampedSeq;
+  circ_log_pool_t *pool;
+  /* printf formats by id for formatted records, integer conversions */
+  const char *const *formats;
+  uint32_t formatCount;
+  /* Writes the start of circularPrintf lines, such as a timestamp for
+   * parseTime, into buff, return : its length */
+  uint32_t (*printPrefix)(char *buff, uint32_t len);
+  /* Called after each write that moved the head, outside the mutex, to
+   * wake CIRC_FLAGS_FOLLOW readers */
+  void (*onAppend)(void);
+  /* Optional, reads up to CIRC_READV_MAX segments back to back, as DMA
+   * chains or continuous quad-SPI reads can. return : bytes read. Wrapped
+   * reads, init sector probes and index builds go through it when set */
+  uint32_t (*readv)(const circ_log_seg_t *seg, uint32_t count);
+  /* Optional, in RAM retained over soft resets and kept current by every
+   * write. circularLogInit takes head and tail from it when three small
+   * reads agree, in place of the scan. tagMap and sectorStats are then
+   * built on their first use, the bloom head sector is still read */
+  circ_log_hint_t *hint;
+  /* Set when index or compactIndex is retained too, it is then reused
+   * while it matches the hint */
+  uint8_t hintIndex;
+  /* Internal, the hint check of the RAM index, kept up as entries change */
+  uint32_t indexSum;
+  /* Internal, tagMap and sectorStats wait for their build after a warm
+   * boot */
+  uint8_t mapsStale;
+  /* Per sector line counts, SECTOR_COUNT long, rebuilt at init */
+  circ_log_sector_stat_t *sectorStats;
+  /* Tag bits counted apart in sectorStats matched */
+  uint32_t statTags;
+  /* Internal, bytes from stageAddr held in wBuff for the next program */
+  uint32_t stageAddr;
+  uint32_t stageLen;
+  /* Internal, large record from circularRecordBegin, payload bytes due
+   * and escapes it still has room for */
+  uint32_t largeLeft;
+  uint32_t largeSpare;
+  uint32_t largeStart;
+  uint8_t largeTag;
+  uint8_t largeOpen;
 } circ_log_t;
 
+/* File position that survives wraps and restarts, from circularFileTell */
+typedef struct {
+  uint32_t seq;    /* Sector sequence number */
+  uint32_t offset; /* In that sector */
+} circ_log_pos_t;
+
+/* A fragment of a line for circularWriteLogV, or one line of a batch */
+typedef struct {
+  const uint8_t *buf;
+  uint32_t len;
+} circ_log_iov_t;
+
 enum { 
     CIRC_LOG_ERR_NONE, 
     CIRC_LOG_ERR_IO, 
@@ -97,7 +431,9 @@ enum {
 
 typedef enum { 
     CIRC_FLAGS_OLDEST, 
-    CIRC_FLAGS_NEWEST 
+    CIRC_FLAGS_NEWEST,
+    /* At the newest, forward reads then return what was written since */
+    CIRC_FLAGS_FOLLOW
 } CIRC_FLAGS;
 
 typedef enum {
@@ -111,13 +447,49 @@ typedef struct {
   uint32_t tailPtr;
   uint32_t valid;
   CIRC_FLAGS flags;
-  /* Search buffer */
+  /* Window held in wBuff for circularFileGetLine */
+  uint32_t winPos;
+  uint32_t winLen;
+  /* Last sector tested against the tag map and bloom filters */
+  uint32_t skipSector;
+  uint8_t skipMatched;
+  /* Tags returned, 0 for all */
+  uint32_t tagMask;
+  /* Sequence of the head sector when opened */
+  uint32_t headSeq;
+  /* Search buffer in use, lent from the log pool while buffLent */
+  uint8_t *buff;
+  uint32_t buffLen;
+  uint8_t buffLent;
+  /* Stored bytes of the large record circularFileReadRecord is in */
+  uint32_t recordLeft;
+#if SEARCH_BUFF_SIZE
   uint8_t wBuff[SEARCH_BUFF_SIZE];
+#endif
 } circular_FILE;
 
 uint32_t circularLogInit(circ_log_t *log);
 uint32_t circularClearLog(circ_log_t *log);
 uint32_t circularWriteLog(circ_log_t *log, uint8_t *buf, uint32_t len);
+uint32_t circularWriteLogStamped(circ_log_t *log, uint32_t time, uint8_t *buf,
+                                 uint32_t len);
+uint32_t circularWriteLogTagged(circ_log_t *log, uint8_t tag, uint8_t *buf,
+                                uint32_t len);
+uint32_t circularWriteLogV(circ_log_t *log, const circ_log_iov_t *iov,
+                           uint32_t count);
+uint32_t circularWriteLogBatch(circ_log_t *log, const circ_log_iov_t *lines,
+                               uint32_t count);
+uint32_t circularPrintf(circ_log_t *log, const char *fmt, ...);
+uint32_t circularVPrintf(circ_log_t *log, const char *fmt, va_list ap);
+uint32_t circularRecordBegin(circ_log_t *log, uint8_t tag, uint32_t len);
+uint32_t circularRecordWrite(circ_log_t *log, const uint8_t *buf,
+                             uint32_t len);
+uint32_t circularRecordEnd(circ_log_t *log);
+uint32_t circularWriteLogFormat(circ_log_t *log, uint32_t time, uint8_t tag,
+                                uint16_t id, const uint32_t *args,
+                                uint32_t count);
+uint32_t circularFormatLine(circ_log_t *log, const uint8_t *line, uint32_t len,
+                            uint8_t *out, uint32_t outLen);
 uint32_t circularReadLogPartial(circ_log_t *log, uint8_t *buff,
                                uint32_t seek, uint32_t desiredlen, uint32_t *remaining);
 
@@ -128,11 +500,44 @@ uint32_t circularReadLines(circ_log_t *log, uint8_t *buff, uint32_t buffSize,
 uint32_t circularFileOpen(circ_log_t *log, CIRC_FLAGS flags,
                           circular_FILE *file);
 
+void circularFileSetTags(circular_FILE *file, uint32_t tagMask);
+void circularFileSetBuffer(circular_FILE *file, uint8_t *buff, uint32_t len);
+void circularFileRelease(circ_log_t *log, circular_FILE *file);
+uint32_t circularFileTell(circ_log_t *log, circular_FILE *file,
+                          circ_log_pos_t *pos);
+uint32_t circularFileOpenAt(circ_log_t *log, const circ_log_pos_t *pos,
+                            circular_FILE *file, uint32_t *lost);
+uint32_t circularFlushRepeats(circ_log_t *log, uint8_t force);
+uint32_t circularTrimBefore(circ_log_t *log, uint32_t time);
+uint32_t circularMaintain(circ_log_t *log, uint32_t maxErases);
+uint32_t circularHistogram(circ_log_t *log, uint32_t start, uint32_t width,
+                           uint32_t *out, uint32_t count, uint8_t flags);
+
 int32_t circularFileRead(circ_log_t *log, circular_FILE *file, void *buff,
                           uint32_t buffLen, CIRC_DIR dir, int32_t lines,
                           char *filter);
 
+int32_t circularFileGetLine(circ_log_t *log, circular_FILE *file, CIRC_DIR dir,
+                            const char **line);
+
+int32_t circularFileReadRecord(circ_log_t *log, circular_FILE *file,
+                               void *buff, uint32_t buffLen, uint32_t *left);
+
+#if CIRC_LOG_PARALLEL
+int32_t circularFileSearch(circ_log_t *log, circular_FILE *file, void *buff,
+                           uint32_t buffLen, char *filter, uint32_t threads);
+#endif
+
 uint32_t indexedLogSearch(circ_log_t *log, void *buff, uint32_t buffLen,
                           uint32_t time);
 
+void circularGetStats(circ_log_t *log, circ_log_stats_t *stats);
+
+uint32_t circularRecordInfo(circ_log_t *log, const uint8_t *line, uint32_t len,
+                            uint32_t *time);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
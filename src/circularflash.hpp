@@ -0,0 +1,289 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2022 Erik Friesen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Header only C++17 layer over the C api. Every member is an inline
+ * forward to the matching circular* call.
+ *
+ *   struct Spi {
+ *     static uint32_t read(uint32_t addr, uint8_t *buff, uint32_t len);
+ *     static uint32_t write(uint32_t addr, uint8_t *buff, uint32_t len);
+ *     static uint32_t erase(uint32_t addr, uint32_t len);
+ *   };
+ *   circular::CircularLog<circular::Geometry<0x1000, 0x100>, Spi> log(
+ *       "LOGS", 0x200000, 0x1E0000);
+ *   log.init();
+ *   auto cur = log.open(CIRC_FLAGS_OLDEST);
+ *   for (std::string_view line : cur.lines()) { ... }
+ */
+
+#ifndef __CIRCULARFLASH_HPP
+#define __CIRCULARFLASH_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include "circularflash.h"
+
+namespace circular {
+
+#if defined(__cpp_lib_span)
+template <class T> using span = std::span<T>;
+#else
+/* Minimal stand in for std::span before C++20 */
+template <class T> class span {
+public:
+  constexpr span() noexcept : data_(nullptr), size_(0) {}
+  constexpr span(T *data, std::size_t size) noexcept
+      : data_(data), size_(size) {}
+  template <std::size_t N>
+  constexpr span(T (&arr)[N]) noexcept : data_(arr), size_(N) {}
+  template <class U, std::size_t N>
+  constexpr span(std::array<U, N> &arr) noexcept
+      : data_(arr.data()), size_(N) {}
+  constexpr T *data() const noexcept { return data_; }
+  constexpr std::size_t size() const noexcept { return size_; }
+
+private:
+  T *data_;
+  std::size_t size_;
+};
+#endif
+
+template <uint32_t SectorSize, uint32_t WriteSize> struct Geometry {
+  static_assert(SectorSize % WriteSize == 0, "Sector must hold whole pages");
+  static_assert(WriteSize > FLASH_MAX_DATE_LEN, "Write size too small");
+  static constexpr uint32_t sectorSize = SectorSize;
+  static constexpr uint32_t writeSize = WriteSize;
+  static constexpr uint32_t sectors(uint32_t logsLength) {
+    return logsLength / SectorSize;
+  }
+};
+
+class Cursor;
+
+/* Forward or reverse lines as views into the cursor search buffer */
+class LineIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = std::string_view;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const std::string_view *;
+  using reference = const std::string_view &;
+
+  LineIterator() noexcept : log_(nullptr), file_(nullptr) {}
+  LineIterator(circ_log_t *log, circular_FILE *file, CIRC_DIR dir) noexcept
+      : log_(log), file_(file), dir_(dir) {
+    next();
+  }
+  reference operator*() const noexcept { return line_; }
+  pointer operator->() const noexcept { return &line_; }
+  LineIterator &operator++() noexcept {
+    next();
+    return *this;
+  }
+  bool operator==(const LineIterator &o) const noexcept {
+    return file_ == o.file_;
+  }
+  bool operator!=(const LineIterator &o) const noexcept {
+    return file_ != o.file_;
+  }
+
+private:
+  void next() noexcept {
+    const char *line;
+    int32_t len = circularFileGetLine(log_, file_, dir_, &line);
+    if (len <= 0) {
+      file_ = nullptr;
+      return;
+    }
+    line_ = std::string_view(line, (std::size_t)len);
+  }
+  circ_log_t *log_;
+  circular_FILE *file_;
+  CIRC_DIR dir_ = CIRC_DIR_FORWARD;
+  std::string_view line_;
+};
+
+class LineRange {
+public:
+  LineRange(circ_log_t *log, circular_FILE *file, CIRC_DIR dir) noexcept
+      : log_(log), file_(file), dir_(dir) {}
+  LineIterator begin() const noexcept {
+    return LineIterator(log_, file_, dir_);
+  }
+  LineIterator end() const noexcept { return LineIterator(); }
+
+private:
+  circ_log_t *log_;
+  circular_FILE *file_;
+  CIRC_DIR dir_;
+};
+
+/* Owns a circular_FILE, invalidated when it goes out of scope */
+class Cursor {
+public:
+  Cursor(circ_log_t *log, CIRC_FLAGS flags) noexcept : log_(log), file_() {
+    err_ = circularFileOpen(log_, flags, &file_);
+  }
+  ~Cursor() {
+    circularFileRelease(log_, &file_);
+    file_.valid = 0;
+  }
+  Cursor(const Cursor &) = delete;
+  Cursor &operator=(const Cursor &) = delete;
+
+  explicit operator bool() const noexcept { return err_ == CIRC_LOG_ERR_NONE; }
+  uint32_t error() const noexcept { return err_; }
+
+  int32_t read(span<uint8_t> buff, CIRC_DIR dir, int32_t lines,
+               const char *filter = nullptr) noexcept {
+    return circularFileRead(log_, &file_, buff.data(), (uint32_t)buff.size(),
+                            dir, lines, const_cast<char *>(filter));
+  }
+  int32_t readRecord(span<uint8_t> buff, uint32_t &left) noexcept {
+    return circularFileReadRecord(log_, &file_, buff.data(),
+                                  (uint32_t)buff.size(), &left);
+  }
+  LineRange lines(CIRC_DIR dir = CIRC_DIR_FORWARD) noexcept {
+    return LineRange(log_, &file_, dir);
+  }
+  LineRange reverseLines() noexcept {
+    return LineRange(log_, &file_, CIRC_DIR_REVERSE);
+  }
+  circular_FILE *native() noexcept { return &file_; }
+
+private:
+  circ_log_t *log_;
+  circular_FILE file_;
+  uint32_t err_;
+};
+
+template <class Geo, class Driver> class CircularLog {
+#if !CIRC_LOG_RUNTIME_GEOMETRY
+  static_assert(Geo::sectorSize == FLASH_SECTOR_SIZE &&
+                    Geo::writeSize == FLASH_WRITE_SIZE,
+                "Geometry must match FLASH_SECTOR_SIZE/FLASH_WRITE_SIZE, or "
+                "build with CIRC_LOG_RUNTIME_GEOMETRY");
+#endif
+
+public:
+  using geometry = Geo;
+
+  CircularLog(const char *name, uint32_t baseAddress, uint32_t logsLength,
+              circ_log_index_t *index = nullptr,
+              uint32_t (*parseTime)(const char *) = nullptr) noexcept
+      : log_(makeLog(name, baseAddress, logsLength, wBuff_.data(),
+                     (uint32_t)wBuff_.size())) {
+    log_.index = index;
+    log_.read = &Driver::read;
+    log_.write = &Driver::write;
+    log_.erase = &Driver::erase;
+    log_.parseTime = parseTime;
+#if CIRC_LOG_RUNTIME_GEOMETRY
+    log_.geometry.sectorSize = Geo::sectorSize;
+    log_.geometry.writeSize = Geo::writeSize;
+#endif
+  }
+  CircularLog(const CircularLog &) = delete;
+  CircularLog &operator=(const CircularLog &) = delete;
+
+  uint32_t init() noexcept { return circularLogInit(&log_); }
+  uint32_t clear() noexcept { return circularClearLog(&log_); }
+
+  uint32_t write(span<const uint8_t> buff) noexcept {
+    return circularWriteLog(&log_, const_cast<uint8_t *>(buff.data()),
+                            (uint32_t)buff.size());
+  }
+  uint32_t write(std::string_view line) noexcept {
+    return circularWriteLog(
+        &log_, reinterpret_cast<uint8_t *>(const_cast<char *>(line.data())),
+        (uint32_t)line.size());
+  }
+  uint32_t writeStamped(uint32_t time, std::string_view line) noexcept {
+    return circularWriteLogStamped(
+        &log_, time,
+        reinterpret_cast<uint8_t *>(const_cast<char *>(line.data())),
+        (uint32_t)line.size());
+  }
+  uint32_t writeV(span<const circ_log_iov_t> iov) noexcept {
+    return circularWriteLogV(&log_, iov.data(), (uint32_t)iov.size());
+  }
+  uint32_t writeBatch(span<const circ_log_iov_t> lines) noexcept {
+    return circularWriteLogBatch(&log_, lines.data(), (uint32_t)lines.size());
+  }
+  uint32_t recordBegin(uint8_t tag, uint32_t len) noexcept {
+    return circularRecordBegin(&log_, tag, len);
+  }
+  uint32_t recordWrite(span<const uint8_t> buff) noexcept {
+    return circularRecordWrite(&log_, buff.data(), (uint32_t)buff.size());
+  }
+  uint32_t recordEnd() noexcept { return circularRecordEnd(&log_); }
+  uint32_t readPartial(span<uint8_t> buff, uint32_t seek,
+                       uint32_t &remaining) noexcept {
+    return circularReadLogPartial(&log_, buff.data(), seek,
+                                  (uint32_t)buff.size(), &remaining);
+  }
+  uint32_t readLines(span<uint8_t> buff, uint32_t lines,
+                     const char *filter = nullptr,
+                     uint32_t estLineLength = 0) noexcept {
+    return circularReadLines(&log_, buff.data(), (uint32_t)buff.size(), lines,
+                             const_cast<char *>(filter), estLineLength);
+  }
+  uint32_t search(span<uint8_t> buff, uint32_t time) noexcept {
+    return indexedLogSearch(&log_, buff.data(), (uint32_t)buff.size(), time);
+  }
+  Cursor open(CIRC_FLAGS flags) noexcept { return Cursor(&log_, flags); }
+
+  circ_log_t *native() noexcept { return &log_; }
+
+private:
+  // The const members lead circ_log_t and can only be set here, the rest
+  // are value-initialized and assigned by name
+  static circ_log_t makeLog(const char *name, uint32_t baseAddress,
+                            uint32_t logsLength, uint8_t *wBuff,
+                            uint32_t wBuffLen) noexcept {
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+#endif
+    return circ_log_t{name, baseAddress, logsLength, wBuff, wBuffLen};
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+  }
+
+  std::array<uint8_t, Geo::writeSize * 2> wBuff_;
+  circ_log_t log_;
+};
+
+} // namespace circular
+
+#endif
@@ -0,0 +1,459 @@
+/**
+ * Offline analyzer for raw flash images pulled from units
+ *
+ * Maps each image, finds head and tail with circularLogInit, linearizes the
+ * ring and filters its lines on every core. Lines are split between threads
+ * by sector, a line belongs to the chunk it starts in.
+ *
+ * Build from the repository root, Linux
+ *   gcc -O2 -Itools -I. tools/circlogdump.c src/circularflash.c -lpthread \
+ *       -o circlogdump
+ *
+ *   circlogdump [-s sector] [-w write] [-a offset] [-l length] [-j threads]
+ *               [-g text] [-t from,to] [-f formats] [-c] [-r] [-o out]
+ *               image...
+ *
+ *   -s, -w   flash sector and write size of the image (0x1000, 0x100)
+ *   -a, -l   log area within the image, default the whole file
+ *   -j       worker threads, default one per core
+ *   -g       lines holding text
+ *   -t       lines stamped from..to, seconds, located through the index
+ *   -f       format strings of formatted records, one per line by id
+ *   -c       count matching lines only
+ *   -r       export the linearized log as stored, record headers included
+ *   -o       write to out instead of stdout
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/circularflash.h"
+
+#define NO_TIME 0xFFFFFFFF
+
+typedef struct {
+  uint32_t sectorSize;
+  uint32_t writeSize;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t threads;
+  const char *grep;
+  uint32_t from;
+  uint32_t to;
+  const char **formats;
+  uint32_t formatCount;
+  uint8_t timed;
+  uint8_t countOnly;
+  uint8_t raw;
+  FILE *out;
+} options_t;
+
+typedef struct {
+  circ_log_t *log;
+  const options_t *opt;
+  const uint8_t *lin; /* Linearized live log */
+  uint32_t linLen;
+  uint32_t start; /* Chunk, lines starting in [start, end) */
+  uint32_t end;
+  uint8_t *out;
+  size_t outLen;
+  size_t outSize;
+  uint32_t lines;
+  uint32_t matches;
+} chunk_t;
+
+/* Current image for the read callback, init runs on the main thread */
+static const uint8_t *image;
+static uint32_t imageLen;
+
+static uint32_t imageRead(uint32_t FlashAddress, uint8_t *buff, uint32_t len) {
+  if (FlashAddress > imageLen || len > imageLen - FlashAddress) {
+    return 0;
+  }
+  memcpy(buff, &image[FlashAddress], len);
+  return len;
+}
+
+/* Images are never modified */
+static uint32_t imageWrite(uint32_t FlashAddress, uint8_t *buff, uint32_t len) {
+  (void)FlashAddress;
+  (void)buff;
+  (void)len;
+  return 0;
+}
+
+static uint32_t imageErase(uint32_t FlashAddress, uint32_t len) {
+  (void)FlashAddress;
+  (void)len;
+  return 0;
+}
+
+/* Leading decimal epoch, as written by the test and most units */
+static uint32_t parseTime(const char *line) {
+  char *end;
+  unsigned long t = strtoul(line, &end, 10);
+  return end == line ? NO_TIME : (uint32_t)t;
+}
+
+static int chunkEmit(chunk_t *c, const uint8_t *line, uint32_t len) {
+  if (c->outLen + len > c->outSize) {
+    size_t size = c->outSize ? c->outSize * 2 : 0x10000;
+    uint8_t *out;
+    while (size < c->outLen + len) {
+      size *= 2;
+    }
+    out = realloc(c->out, size);
+    if (out == NULL) {
+      return -1;
+    }
+    c->out = out;
+    c->outSize = size;
+  }
+  memcpy(&c->out[c->outLen], line, len);
+  c->outLen += len;
+  return 0;
+}
+
+static void *chunkScan(void *arg) {
+  chunk_t *c = arg;
+  const options_t *opt = c->opt;
+  uint32_t pos = c->start;
+  size_t grepLen = opt->grep ? strlen(opt->grep) : 0;
+  /* Finish the line the previous chunk started */
+  if (pos && c->lin[pos - 1] != '\n') {
+    const uint8_t *nl = memchr(&c->lin[pos], '\n', c->linLen - pos);
+    pos = nl ? (uint32_t)(nl - c->lin) + 1 : c->linLen;
+  }
+  while (pos < c->end) {
+    const uint8_t *line = &c->lin[pos];
+    const uint8_t *nl = memchr(line, '\n', c->linLen - pos);
+    uint32_t len = nl ? (uint32_t)(nl - line) + 1 : c->linLen - pos;
+    uint8_t text[1024];
+    uint32_t time, hdrLen;
+    pos += len;
+    hdrLen = circularRecordInfo(c->log, line, len,
+                                opt->timed ? &time : NULL);
+    /* Large records hold binary, line readers pass over them */
+    if (hdrLen && (line[1] & CIRC_REC_LEN)) {
+      continue;
+    }
+    c->lines++;
+    if (opt->timed && (time == NO_TIME || time < opt->from || time > opt->to)) {
+      continue;
+    }
+    if (len > hdrLen && line[hdrLen] == CIRC_FMT_MARKER) {
+      len = circularFormatLine(c->log, line, len, text, sizeof(text));
+      len = len < sizeof(text) ? len : sizeof(text);
+      line = text;
+      hdrLen = 0;
+    }
+    if (grepLen &&
+        memmem(&line[hdrLen], len - hdrLen, opt->grep, grepLen) == NULL) {
+      continue;
+    }
+    c->matches++;
+    if (!opt->countOnly && chunkEmit(c, &line[hdrLen], len - hdrLen) != 0) {
+      return (void *)-1;
+    }
+  }
+  return NULL;
+}
+
+/* Narrows [*start, *end) to the index slots that may hold from..to */
+static void indexRange(circ_log_t *log, const options_t *opt, uint32_t linLen,
+                       uint32_t *start, uint32_t *end) {
+  uint32_t slots = log->logsLength / log->indexGranularity;
+  uint32_t first = log->LogFlashTailPtr / log->indexGranularity;
+  uint32_t k, time;
+  *start = 0;
+  *end = linLen;
+  for (k = 0; k * log->indexGranularity < linLen; k++) {
+    time = log->index[(first + k) % slots].time;
+    if (time == NO_TIME) {
+      continue;
+    }
+    if (time < opt->from) {
+      *start = k * log->indexGranularity;
+    } else if (time > opt->to) {
+      *end = k * log->indexGranularity;
+      break;
+    }
+  }
+}
+
+static int analyze(const char *name, const options_t *opt) {
+  static uint8_t wBuff[0x10000 * 2];
+  struct stat st;
+  struct timespec t0, t1;
+  const uint8_t *map;
+  uint8_t *lin = NULL;
+  circ_log_index_t *index = NULL;
+  chunk_t *chunks = NULL;
+  pthread_t *threads = NULL;
+  uint32_t i, n = 0, tail, head, linLen, start, end, per;
+  uint32_t lines = 0, matches = 0;
+  int fd, ret = -1;
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  circ_log_t log = {.name = name,
+                    .read = imageRead,
+                    .write = imageWrite,
+                    .erase = imageErase,
+                    .baseAddress = 0,
+                    .logsLength = opt->length ? opt->length
+                                              : (uint32_t)st.st_size -
+                                                    opt->offset,
+                    .wBuff = wBuff,
+                    .wBuffLen = opt->writeSize * 2,
+                    .geometry = {.sectorSize = opt->sectorSize,
+                                 .writeSize = opt->writeSize},
+                    .formats = opt->formats,
+                    .formatCount = opt->formatCount};
+  if ((uint64_t)opt->offset + log.logsLength > (uint64_t)st.st_size ||
+      log.logsLength == 0 || log.logsLength % opt->sectorSize != 0 ||
+      opt->writeSize * 2 > sizeof(wBuff)) {
+    fprintf(stderr, "%s: log area not whole sectors of the image\n", name);
+    goto done;
+  }
+  image = &map[opt->offset];
+  imageLen = log.logsLength;
+  if (opt->timed) {
+    index = calloc(CIRC_INDEX_ENTRIES(log.logsLength, opt->sectorSize),
+                   sizeof(circ_log_index_t));
+    if (index == NULL) {
+      goto done;
+    }
+    log.index = index;
+    log.parseTime = parseTime;
+  }
+  if (circularLogInit(&log) != CIRC_LOG_ERR_NONE) {
+    fprintf(stderr, "%s: not a log image\n", name);
+    goto done;
+  }
+  /* Full device, head and tail meet at a sector start */
+  if (log.LogFlashHeadPtr < 0) {
+    tail = 0;
+    linLen = log.logsLength;
+  } else {
+    tail = log.LogFlashTailPtr;
+    head = log.LogFlashHeadPtr;
+    linLen = head >= tail ? head - tail : log.logsLength - tail + head;
+    if (log.emptyFlag) {
+      linLen = 0;
+    }
+  }
+  /* One copy puts the wrapped part after the rest */
+  lin = malloc(linLen + 1);
+  if (lin == NULL) {
+    goto done;
+  }
+  if (tail + linLen <= log.logsLength) {
+    memcpy(lin, &image[tail], linLen);
+  } else {
+    memcpy(lin, &image[tail], log.logsLength - tail);
+    memcpy(&lin[log.logsLength - tail], image,
+           linLen - (log.logsLength - tail));
+  }
+  /* parseTime stops here on an unterminated last line */
+  lin[linLen] = 0;
+  if (opt->raw) {
+    ret = fwrite(lin, 1, linLen, opt->out) == linLen ? 0 : -1;
+    goto done;
+  }
+  start = 0;
+  end = linLen;
+  if (opt->timed) {
+    indexRange(&log, opt, linLen, &start, &end);
+  }
+  /* Sector aligned chunks, at least one sector each */
+  n = opt->threads;
+  per = (end - start + n - 1) / n;
+  per = (per + opt->sectorSize - 1) / opt->sectorSize * opt->sectorSize;
+  if (per == 0) {
+    per = opt->sectorSize;
+  }
+  n = (end - start + per - 1) / per;
+  chunks = calloc(n ? n : 1, sizeof(chunk_t));
+  threads = calloc(n ? n : 1, sizeof(pthread_t));
+  if (chunks == NULL || threads == NULL) {
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    chunks[i].log = &log;
+    chunks[i].opt = opt;
+    chunks[i].lin = lin;
+    chunks[i].linLen = linLen;
+    chunks[i].start = start + i * per;
+    chunks[i].end = chunks[i].start + per < end ? chunks[i].start + per : end;
+    if (pthread_create(&threads[i], NULL, chunkScan, &chunks[i]) != 0) {
+      n = i;
+      break;
+    }
+  }
+  ret = 0;
+  for (i = 0; i < n; i++) {
+    void *res;
+    pthread_join(threads[i], &res);
+    if (res != NULL) {
+      ret = -1;
+    }
+  }
+  /* Merged in log order */
+  for (i = 0; i < n && ret == 0; i++) {
+    if (chunks[i].outLen &&
+        fwrite(chunks[i].out, 1, chunks[i].outLen, opt->out) !=
+            chunks[i].outLen) {
+      ret = -1;
+    }
+    lines += chunks[i].lines;
+    matches += chunks[i].matches;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (opt->countOnly) {
+    fprintf(opt->out, "%s: %u\n", name, matches);
+  }
+  fprintf(stderr,
+          "%s: tail 0x%X head 0x%X live %u bytes, %u of %u lines, %u threads "
+          "%.1f ms\n",
+          name, log.LogFlashTailPtr, log.LogFlashHeadPtr, linLen, matches,
+          lines, n,
+          (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+done:
+  if (chunks != NULL) {
+    for (i = 0; i < n; i++) {
+      free(chunks[i].out);
+    }
+  }
+  free(chunks);
+  free(threads);
+  free(lin);
+  free(index);
+  munmap((void *)map, st.st_size);
+  return ret;
+}
+
+/* One format per line, the line number is its id */
+static int loadFormats(const char *name, options_t *opt) {
+  char line[1024];
+  const char **formats;
+  FILE *f = fopen(name, "r");
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\r\n")] = 0;
+    formats = realloc(opt->formats, (opt->formatCount + 1) * sizeof(char *));
+    if (formats == NULL || (formats[opt->formatCount] = strdup(line)) == NULL) {
+      fclose(f);
+      return -1;
+    }
+    opt->formats = formats;
+    opt->formatCount++;
+  }
+  fclose(f);
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "circlogdump [-s sector] [-w write] [-a offset] [-l length] "
+          "[-j threads]\n"
+          "            [-g text] [-t from,to] [-f formats] [-c] [-r] [-o out] "
+          "image...\n");
+}
+
+int main(int argc, char *argv[]) {
+  options_t opt = {.sectorSize = FLASH_SECTOR_SIZE,
+                   .writeSize = FLASH_WRITE_SIZE,
+                   .out = stdout};
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  char *end;
+  int c, i, ret = 0;
+  opt.threads = cores > 0 ? (uint32_t)cores : 1;
+  while ((c = getopt(argc, argv, "s:w:a:l:j:g:t:f:cro:")) != -1) {
+    switch (c) {
+    case 's':
+      opt.sectorSize = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      opt.writeSize = strtoul(optarg, NULL, 0);
+      break;
+    case 'a':
+      opt.offset = strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      opt.length = strtoul(optarg, NULL, 0);
+      break;
+    case 'j':
+      opt.threads = strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      opt.grep = optarg;
+      break;
+    case 't':
+      opt.from = strtoul(optarg, &end, 0);
+      opt.to = *end == ',' ? strtoul(end + 1, NULL, 0) : NO_TIME;
+      opt.timed = 1;
+      break;
+    case 'f':
+      if (loadFormats(optarg, &opt) != 0) {
+        return 1;
+      }
+      break;
+    case 'c':
+      opt.countOnly = 1;
+      break;
+    case 'r':
+      opt.raw = 1;
+      break;
+    case 'o':
+      opt.out = fopen(optarg, "wb");
+      if (opt.out == NULL) {
+        fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind >= argc || opt.threads == 0 || opt.sectorSize == 0 ||
+      opt.writeSize == 0 || opt.sectorSize % opt.writeSize != 0) {
+    usage();
+    return 1;
+  }
+  for (i = optind; i < argc; i++) {
+    if (analyze(argv[i], &opt) != 0) {
+      ret = 1;
+    }
+  }
+  if (opt.out != stdout) {
+    fclose(opt.out);
+  }
+  return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef __CIRCULARFLASHCONFIG_H
+#define __CIRCULARFLASHCONFIG_H
+/* Host tools configuration, build with -Itools ahead of the test one */
+#define FLASH_SECTOR_SIZE 0x1000
+#define FLASH_WRITE_SIZE 0x100
+/* Image geometry is given on the command line */
+#define CIRC_LOG_RUNTIME_GEOMETRY 1
+
+/* Images are read from one thread, workers only call circularRecordInfo */
+#define FLASH_MUTEX_ENTER(x)
+#define FLASH_MUTEX_EXIT(x)
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CIRCULAR_LOG_ASSERT(expr)                                              \
+  if (!(expr)) {                                                               \
+    fprintf(stderr, "CIRCULAR_LOG_ASSERT(%s:%i)\n", __FILE__, __LINE__);       \
+    abort();                                                                   \
+  }
+
+#endif